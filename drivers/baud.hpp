@@ -0,0 +1,239 @@
+#pragma once
+
+#include "driver.hpp"
+#include "frame.hpp"
+#include "timer_wheel.hpp"
+
+// Link rate negotiation on a FrameLink. Link starts at safe rate, host
+// moves it to a faster rate in steps it can verify:
+//
+//   BAUD_CAPS_FRAME_TYPE    request empty, reply
+//       current(u32) safe(u32) framing(u32) noise(u32) overruns(u32)
+//       parity(u32) count(u8) rates[count](u32)
+//     rates of baud_candidates which current bus clock reaches within
+//     BAUD_MAX_ERROR_PPM, error counters are USART line errors.
+//   BAUD_SWITCH_FRAME_TYPE  request rate(u32), reply status(u8) rate(u32)
+//     reply goes at the old rate, then USART switches once tx is idle
+//     and trial of BAUD_TRIAL_TICKS starts. Host switches after reply.
+//   BAUD_TEST_FRAME_TYPE    request pattern, reply is the same pattern
+//     (loopback), host compares it with what it sent.
+//   BAUD_COMMIT_FRAME_TYPE  request empty, reply status(u8) rate(u32)
+//     ends trial, new rate stays.
+//
+// Trial falls back to the previous rate on timeout or on any line error
+// (framing, noise, overrun, parity) or corrupted test pattern, host
+// falls back after the same timeout and tries a slower rate. Out of
+// trial, BAUD_ERROR_LIMIT line errors within BAUD_ERROR_WINDOW ticks
+// move the link back to safe rate, host reopens at safe rate when it
+// loses the link. Little endian, status: 0 - ok, 1 - rate is not
+// supported, 2 - other switch is in progress, 3 - no trial.
+
+#define BAUD_CAPS_FRAME_TYPE    0xF3
+#define BAUD_SWITCH_FRAME_TYPE  0xF4
+#define BAUD_TEST_FRAME_TYPE    0xF5
+#define BAUD_COMMIT_FRAME_TYPE  0xF6
+
+#define BAUD_MAX_ERROR_PPM      USART_BAUD_MAX_ERROR_PPM
+#define BAUD_TRIAL_TICKS        500
+#define BAUD_ERROR_LIMIT        16
+#define BAUD_ERROR_WINDOW       1000
+
+#define BAUD_OK             0
+#define BAUD_UNSUPPORTED    1
+#define BAUD_BUSY           2
+#define BAUD_NO_TRIAL       3
+
+/// @brief standard rates and multiples of 84 MHz / 42 MHz bus clocks,
+///         slowest first
+inline constexpr uint32_t baud_candidates[] = {
+    9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600,
+    1000000, 1500000, 2000000, 3000000, 4000000, 5250000, 10500000,
+};
+
+#define BAUD_CANDIDATES (sizeof(baud_candidates) / sizeof(baud_candidates[0]))
+
+enum class BaudState : uint8_t { Idle, Switching, Trial };
+
+class BaudNegotiator final{
+    USART& usart;
+    TimerWheel& timers;
+    uint32_t safe_rate;
+    uint32_t previous_rate = 0;
+    uint32_t pending_rate = 0;
+    uint32_t trial_errors = 0;
+    uint32_t window_start = 0;
+    uint32_t window_errors = 0;
+    BaudState state = BaudState::Idle;
+    volatile bool timed_out = false;
+    SoftTimer trial;
+
+    static void on_trial(SoftTimer& timer, void* arg){
+        (void)timer;
+        static_cast<BaudNegotiator*>(arg)->timed_out = true;
+    }
+
+    void apply(uint32_t rate){
+        usart.disable_usart();
+        usart.set_baud_rate(rate);
+        usart.enable_usart();
+    }
+
+    void reply_status(FrameEncoder& encoder, uint8_t type, uint8_t status, uint32_t rate){
+        uint8_t payload[5];
+        payload[0] = status;
+        write_le32(payload + 1, rate);
+        encoder.send(type, payload, sizeof(payload));
+    }
+
+    void reply_caps(FrameEncoder& encoder){
+        uint8_t payload[25 + BAUD_CANDIDATES * 4];
+        write_le32(payload, usart.baud_rate);
+        write_le32(payload + 4, safe_rate);
+        write_le32(payload + 8, usart.framing_errors);
+        write_le32(payload + 12, usart.noise_errors);
+        write_le32(payload + 16, usart.overruns);
+        write_le32(payload + 20, usart.parity_errors);
+
+        uint8_t count = 0;
+        for(uint32_t rate : baud_candidates)
+            if(is_supported(rate)) write_le32(payload + 25 + 4 * count++, rate);
+        payload[24] = count;
+
+        encoder.send(BAUD_CAPS_FRAME_TYPE, payload, 25 + 4 * count);
+    }
+
+    void on_switch(const Frame& frame, FrameEncoder& encoder){
+        if(frame.len != 4){
+            reply_status(encoder, BAUD_SWITCH_FRAME_TYPE, BAUD_UNSUPPORTED, 0);
+            return;
+        }
+        uint32_t rate = read_le32(frame.payload);
+        if(state != BaudState::Idle){
+            reply_status(encoder, BAUD_SWITCH_FRAME_TYPE, BAUD_BUSY, rate);
+            return;
+        }
+        if(!is_supported(rate)){
+            reply_status(encoder, BAUD_SWITCH_FRAME_TYPE, BAUD_UNSUPPORTED, rate);
+            return;
+        }
+
+        reply_status(encoder, BAUD_SWITCH_FRAME_TYPE, BAUD_OK, rate);
+        pending_rate = rate;
+        state = BaudState::Switching;
+    }
+
+    void on_test(const Frame& frame, FrameEncoder& encoder){
+        if(state != BaudState::Trial){
+            reply_status(encoder, BAUD_TEST_FRAME_TYPE, BAUD_NO_TRIAL, usart.baud_rate);
+            return;
+        }
+        // frame passed CRC, bytes around it must be clean too
+        if(usart.get_line_errors() != trial_errors){
+            fall_back(previous_rate);
+            return;
+        }
+        encoder.send(BAUD_TEST_FRAME_TYPE, frame.payload, frame.len);
+    }
+
+    void on_commit(FrameEncoder& encoder){
+        if(state != BaudState::Trial){
+            reply_status(encoder, BAUD_COMMIT_FRAME_TYPE, BAUD_NO_TRIAL, usart.baud_rate);
+            return;
+        }
+        if(usart.get_line_errors() != trial_errors){
+            fall_back(previous_rate);
+            return;
+        }
+
+        timers.cancel(trial);
+        state = BaudState::Idle;
+        switches++;
+        restart_window();
+        reply_status(encoder, BAUD_COMMIT_FRAME_TYPE, BAUD_OK, usart.baud_rate);
+    }
+
+    /// @brief replies are dropped, they would go at a rate host left
+    void fall_back(uint32_t rate){
+        timers.cancel(trial);
+        timed_out = false;
+        apply(rate);
+        state = BaudState::Idle;
+        fallbacks++;
+        restart_window();
+    }
+
+    void restart_window(){
+        window_start = Systick::get_ticks();
+        window_errors = usart.get_line_errors();
+    }
+public:
+    uint32_t switches = 0;
+    uint32_t fallbacks = 0;
+
+    /// @param safe_rate rate set up by caller, used at start and after
+    ///         too many line errors
+    BaudNegotiator(USART& usart, TimerWheel& timers, uint32_t safe_rate) :
+        usart(usart), timers(timers), safe_rate(safe_rate), trial(&on_trial, this) {}
+
+    BaudNegotiator(const BaudNegotiator&) = delete;
+    BaudNegotiator& operator=(const BaudNegotiator&) = delete;
+
+    static bool is_baud_frame(uint8_t type){
+        return type >= BAUD_CAPS_FRAME_TYPE && type <= BAUD_COMMIT_FRAME_TYPE;
+    }
+
+    bool is_supported(uint32_t rate) const {
+        return usart_baud_within(usart.get_clock(), rate, BAUD_MAX_ERROR_PPM);
+    }
+
+    BaudState get_state() const {
+        return state;
+    }
+
+    /// @brief switch waits for tx to drain, trial timed out
+    bool has_work() const {
+        return state == BaudState::Switching || timed_out;
+    }
+
+    void on_frame(const Frame& frame, FrameEncoder& encoder){
+        switch(frame.type){
+        case BAUD_CAPS_FRAME_TYPE:
+            reply_caps(encoder);
+            return;
+        case BAUD_SWITCH_FRAME_TYPE:
+            on_switch(frame, encoder);
+            return;
+        case BAUD_TEST_FRAME_TYPE:
+            on_test(frame, encoder);
+            return;
+        case BAUD_COMMIT_FRAME_TYPE:
+            on_commit(encoder);
+            return;
+        }
+    }
+
+    /// @brief must be called from main loop
+    void poll(){
+        if(state == BaudState::Switching){
+            if(!usart.is_tx_idle()) return;
+
+            previous_rate = usart.baud_rate;
+            apply(pending_rate);
+            trial_errors = usart.get_line_errors();
+            timed_out = false;
+            timers.start(trial, BAUD_TRIAL_TICKS);
+            state = BaudState::Trial;
+            return;
+        }
+
+        if(state == BaudState::Trial){
+            if(timed_out || usart.get_line_errors() != trial_errors) fall_back(previous_rate);
+            return;
+        }
+
+        uint32_t errors = usart.get_line_errors();
+        if(Systick::get_ticks() - window_start >= BAUD_ERROR_WINDOW) restart_window();
+        else if(errors - window_errors >= BAUD_ERROR_LIMIT && usart.baud_rate != safe_rate)
+            fall_back(safe_rate);
+    }
+};
@@ -0,0 +1,118 @@
+#pragma once
+
+#include "driver.hpp"
+
+// Input capture timestamps of 64 bit on TIM2..TIM5. Counter runs free
+// over the whole range, every update (overflow) interrupt adds one to
+// overflow count, captured CCR is extended with it:
+//   timestamp = overflows * period + capture
+// Capture and overflow can be pending in one interrupt, capture value
+// in the lower half of period was taken after the overflow then.
+// Timestamps are in timer ticks (timer clock / (prescaler + 1)) and are
+// queued for main loop.
+
+#define CAPTURE_QUEUE_SIZE  32
+
+struct CaptureEvent{
+    uint64_t timestamp;
+    uint8_t channel;
+};
+
+class InputCapture final{
+    TIM& tim;
+    uint64_t period = 0;
+    uint16_t enabled = 0;
+    volatile uint32_t overflows = 0;
+    SpscQueue<CaptureEvent, CAPTURE_QUEUE_SIZE> events;
+public:
+    volatile uint32_t dropped = 0;
+    /// @brief captures overwritten in CCR before interrupt read them
+    volatile uint32_t overcaptures = 0;
+
+    InputCapture(TIM& tim) : tim(tim) {}
+
+    InputCapture(const InputCapture&) = delete;
+    InputCapture& operator=(const InputCapture&) = delete;
+
+    /// @brief counter runs over full 16 / 32 bit range, timer clock
+    ///         must be enabled, channels are added with add_channel()
+    /// @return 1 if timer is invalid or 0 if ok
+    uint8_t start(NVIC& nvic, uint16_t prescaler = 0){
+        if(tim.set_time_base(prescaler, tim.is_32bit() ? UINT32_T_MAX : 0xFFFF)) return 1;
+
+        period = tim.is_32bit() ? 0x100000000ull : 0x10000ull;
+        overflows = 0;
+        enabled = TIM_FLAG_UPDATE;
+        tim.interrupt_enable(TIM_FLAG_UPDATE);
+        nvic.enable_interrupt(tim.get_irq());
+        tim.start();
+        return 0;
+    }
+
+    void stop(){
+        tim.stop();
+        tim.interrupt_disable(enabled);
+        enabled = 0;
+    }
+
+    /// @brief pin of channel must use alternate function of timer
+    /// @return 1 if channel or filter is out of range or 0 if ok
+    uint8_t add_channel(uint8_t channel, TimCaptureEdge edge, uint8_t filter = 0){
+        if(tim.capture_enable(channel, edge, filter)) return 1;
+
+        tim.clear_flags(TIM_FLAG_CC(channel) | TIM_FLAG_OVERCAPTURE(channel));
+        enabled |= TIM_FLAG_CC(channel);
+        tim.interrupt_enable(TIM_FLAG_CC(channel));
+        return 0;
+    }
+
+    /// @brief current time in timer ticks
+    uint64_t now() const {
+        uint32_t high;
+        uint32_t counter;
+        bool pending;
+        do{
+            high = overflows;
+            counter = tim.get_counter();
+            pending = tim.get_flags() & TIM_FLAG_UPDATE;
+        } while(high != overflows);
+
+        // overflow which interrupt did not count yet (interrupts masked)
+        uint64_t extended = high;
+        if(pending && counter < period / 2) extended++;
+        return extended * period + counter;
+    }
+
+    bool pop(CaptureEvent& event){
+        return events.pop(event);
+    }
+
+    bool is_empty() const {
+        return events.is_empty();
+    }
+
+    /// @brief must be called from timer interrupt handler
+    void irq_handler(){
+        uint16_t flags = tim.get_flags();
+        bool wrapped = flags & TIM_FLAG_UPDATE;
+        if(wrapped) tim.clear_flags(TIM_FLAG_UPDATE);
+
+        uint32_t base = overflows;
+        for(uint8_t channel = 1; channel <= 4; channel++){
+            if(!(flags & enabled & TIM_FLAG_CC(channel))) continue;
+
+            // reading CCR clears CC flag
+            uint32_t capture = tim.get_capture(channel);
+            uint64_t high = base;
+            if(wrapped && capture < period / 2) high++;
+
+            if(!events.push(CaptureEvent{ high * period + capture, channel })) dropped++;
+            if(flags & TIM_FLAG_OVERCAPTURE(channel)){
+                tim.clear_flags(TIM_FLAG_OVERCAPTURE(channel));
+                overcaptures++;
+            }
+        }
+
+        if(wrapped) overflows = base + 1;
+    }
+};
@@ -0,0 +1,120 @@
+#pragma once
+
+#include "driver.hpp"
+#include "frame.hpp"
+
+// Table driven dispatch of received frames. Frame type is the opcode,
+// commands are listed once in a constexpr array of Command, CommandIndex
+// turns it into 256 byte lookup table at compile time, so dispatch costs
+// one load and one indirect call however many commands there are.
+//
+// Handlers get Frame, a view into decoder buffer (no copy), and
+// FrameEncoder, which streams reply straight into usart tx buffer.
+// Every dispatch is timed with DWT cycle counter from lookup until the
+// handler returned, reply queued included, per command.
+//
+// COMMAND_STATS_FRAME_TYPE dump, all little endian:
+//   count(u8) unknown(u32) then per command opcode(u8) calls(u32)
+//   last(u32) max(u32) total_low(u32) total_high(u32), cycles
+
+#define COMMAND_NONE                0xFF
+#define COMMAND_STATS_FRAME_TYPE    0xF7
+
+typedef void (*CommandHandler)(const Frame& frame, FrameEncoder& encoder);
+
+struct Command{
+    uint8_t opcode;
+    CommandHandler handler;
+};
+
+struct CommandStats{
+    uint32_t calls;
+    uint32_t last;
+    uint32_t max;
+    uint64_t total;
+};
+
+/// @tparam COUNT commands in table, less than COMMAND_NONE
+template<uint32_t COUNT>
+struct CommandIndex{
+    static_assert(COUNT < COMMAND_NONE, "command index is 8 bit");
+
+    uint8_t slots[256];
+    bool unique;
+
+    constexpr CommandIndex(const Command (&commands)[COUNT]) : slots(), unique(true) {
+        for(uint32_t opcode = 0; opcode < 256; opcode++) slots[opcode] = COMMAND_NONE;
+        for(uint32_t i = 0; i < COUNT; i++){
+            if(slots[commands[i].opcode] != COMMAND_NONE) unique = false;
+            slots[commands[i].opcode] = i;
+        }
+    }
+};
+
+template<uint32_t COUNT>
+class CommandDispatcher final{
+    static_assert(5 + COUNT * 21 <= FRAME_MAX_PAYLOAD, "stats dump must fit one frame");
+
+    const Command (&commands)[COUNT];
+    const CommandIndex<COUNT>& index;
+    CommandStats stats[COUNT] = {};
+public:
+    /// @brief frames with opcode which is not in table
+    uint32_t unknown = 0;
+
+    /// @param index built from the same commands, static_assert its
+    ///         unique field to catch repeated opcodes
+    constexpr CommandDispatcher(const Command (&commands)[COUNT], const CommandIndex<COUNT>& index) :
+        commands(commands), index(index) {}
+
+    CommandDispatcher(const CommandDispatcher&) = delete;
+    CommandDispatcher& operator=(const CommandDispatcher&) = delete;
+
+    /// @return false if frame type is not a command
+    bool dispatch(const Frame& frame, FrameEncoder& encoder){
+        uint32_t start = DWT::cycles();
+
+        uint8_t slot = index.slots[frame.type];
+        if(slot == COMMAND_NONE){
+            unknown++;
+            return false;
+        }
+        commands[slot].handler(frame, encoder);
+
+        uint32_t cycles = DWT::cycles() - start;
+        CommandStats& entry = stats[slot];
+        entry.calls++;
+        entry.last = cycles;
+        if(cycles > entry.max) entry.max = cycles;
+        entry.total += cycles;
+        return true;
+    }
+
+    const CommandStats& get_stats(uint8_t opcode) const {
+        static const CommandStats none = {};
+        uint8_t slot = index.slots[opcode];
+        return slot == COMMAND_NONE ? none : stats[slot];
+    }
+
+    void reset_stats(){
+        for(CommandStats& entry : stats) entry = CommandStats{};
+        unknown = 0;
+    }
+
+    void dump(FrameEncoder& encoder) const {
+        uint8_t payload[5 + COUNT * 21];
+        payload[0] = COUNT;
+        write_le32(payload + 1, unknown);
+
+        uint8_t* out = payload + 5;
+        for(uint32_t i = 0; i < COUNT; i++, out += 21){
+            out[0] = commands[i].opcode;
+            write_le32(out + 1, stats[i].calls);
+            write_le32(out + 5, stats[i].last);
+            write_le32(out + 9, stats[i].max);
+            write_le32(out + 13, static_cast<uint32_t>(stats[i].total));
+            write_le32(out + 17, static_cast<uint32_t>(stats[i].total >> 32));
+        }
+        encoder.send(COMMAND_STATS_FRAME_TYPE, payload, sizeof(payload));
+    }
+};
@@ -9,6 +9,49 @@
 #define ICTR_BASE       0xE000E004
 #define STIR_BASE       0xE000EF00
 #define USART1_BASE     0x40011000
+#define USART2_BASE     0x40004400
+#define USART6_BASE     0x40011400
+#define DMA1_BASE       0x40026000
+#define DMA2_BASE       0x40026400
+#define ADC1_BASE       0x40012000
+#define ADC_COMMON_BASE 0x40012300
+#define DWT_BASE        0xE0001000
+#define DEMCR_BASE      0xE000EDFC
+#define CRC_BASE        0x40023000
+#define SCB_BASE        0xE000ED00
+#define FPCCR_BASE      0xE000EF34
+#define EXTI_BASE       0x40013C00
+#define SYSCFG_BASE     0x40013800
+#define PWR_BASE        0x40007000
+#define RTC_BASE        0x40002800
+
+#define USART1_IRQ      37
+#define USART2_IRQ      38
+#define USART6_IRQ      71
+#define RTC_WKUP_IRQ    3
+#define FLASH_IRQ       4
+#define EXTI0_IRQ       6
+#define EXTI9_5_IRQ     23
+#define EXTI15_10_IRQ   40
+
+// stm32F401: 85 interrupts after 16 core exceptions, 4 priority bits
+#define IRQ_COUNT           85
+#define VECTOR_TABLE_SIZE   (16 + IRQ_COUNT)
+#define NVIC_PRIORITY_BITS  4
+
+// USART1 and USART6 requests go to DMA2, USART2 to DMA1
+#define USART1_DMA_CHANNEL      4
+#define USART1_DMA_RX_STREAM    2
+#define USART1_DMA_TX_STREAM    7
+#define USART2_DMA_CHANNEL      4
+#define USART2_DMA_RX_STREAM    5
+#define USART2_DMA_TX_STREAM    6
+#define USART6_DMA_CHANNEL      5
+#define USART6_DMA_RX_STREAM    1
+#define USART6_DMA_TX_STREAM    6
+
+#define USART_TX_BUFFER_SIZE    256
+#define USART_RX_BUFFER_SIZE    256
 
 typedef unsigned char uint8_t;
 typedef unsigned short uint16_t;
@@ -16,23 +59,147 @@ typedef unsigned int uint32_t;
 
 #define UINT32_T_MAX 0xFFFFFFFF
 
+#define HSI_HZ              16000000
+#define SYSCLK_MAX_HZ       84000000
+#define APB1_MAX_HZ         42000000
+#define FLASH_WS_STEP_HZ    30000000
+#define PLL_VCO_MIN_HZ      192000000
+#define PLL_VCO_MAX_HZ      432000000
+
+// sectors 0..4 keep firmware (mem.ld), sector 5 takes uploaded user code
+#define USER_FLASH_BASE     0x08020000
+#define USER_FLASH_SIZE     (128 * 1024)
+#define USER_FLASH_SECTOR   5
+// bottom of SRAM takes user code loaded for RAM execution (mem.ld)
+#define USER_RAM_BASE       0x20000000
+#define USER_RAM_SIZE       (24 * 1024)
+
+// HOST_BACKEND maps every *_Reg struct onto host memory with
+// behavioral peripheral models (see host_backend.hpp), otherwise
+// registers are accessed at their real addresses
+#ifdef HOST_BACKEND
+#include "host_backend.hpp"
+typedef host::Reg reg32_t;
+#define PERIPHERAL(type, address) (host::Bus::instance().map<type>(address))
+
+inline uint32_t bus_address(const volatile void* pointer){
+    return host::Bus::instance().bus_address(pointer);
+}
+
+inline uint32_t irq_save(){
+    return 0;
+}
+
+inline void irq_restore(uint32_t primask){
+    (void)primask;
+}
+
+inline void sync_barrier(){}
+
+#define RAMFUNC
+
+/// @brief time passes until models raise interrupts
+inline void wait_for_interrupt(){
+    host::Bus::instance().advance(host::Bus::instance().slice_cycles);
+}
+#else
+// host gets uint64_t from <cstdint> of host_backend.hpp
+typedef unsigned long long uint64_t;
+typedef volatile uint32_t reg32_t;
+#define PERIPHERAL(type, address) (reinterpret_cast<type*>(address))
+
+inline uint32_t bus_address(const volatile void* pointer){
+    return reinterpret_cast<uint32_t>(pointer);
+}
+
+/// @brief masks interrupts
+/// @return previous PRIMASK for irq_restore
+inline uint32_t irq_save(){
+    uint32_t primask;
+    asm volatile("mrs %0, primask\n\tcpsid i" : "=r"(primask) :: "memory");
+    return primask;
+}
+
+inline void irq_restore(uint32_t primask){
+    asm volatile("msr primask, %0" :: "r"(primask) : "memory");
+}
+
+/// @brief dsb + isb, memory and system register writes take effect
+///         before next instruction is fetched
+inline void sync_barrier(){
+    asm volatile("dsb\n\tisb" ::: "memory");
+}
+
+/// @brief function is copied to SRAM by reset_handler (.ramfunc of
+///         mem.ld) and runs without flash wait states, noinline keeps it
+///         there, calls between flash and SRAM go through linker veneers.
+///         Functions it calls are placed by their own attributes, out of
+///         line copies of inline functions go to flash .text
+#define RAMFUNC __attribute__((section(".ramfunc"), noinline))
+
+/// @brief sleeps until interrupt is pending, wakes up even when
+///         interrupts are masked with irq_save(), so check and sleep
+///         under IrqLock does not miss the interrupt
+inline void wait_for_interrupt(){
+    asm volatile("dsb\n\twfi" ::: "memory");
+}
+#endif
+
+/// @brief interrupts are masked while object is alive, nesting is allowed
+class IrqLock final{
+    uint32_t primask;
+public:
+    IrqLock() : primask(irq_save()) {}
+    ~IrqLock(){
+        irq_restore(primask);
+    }
+
+    IrqLock(const IrqLock&) = delete;
+    IrqLock& operator=(const IrqLock&) = delete;
+};
+
+#include "field.hpp"
+
 enum class ProgramSize{ Eight, Sixteen, ThirtyTwo, SixtyFour };
+
+#define FLASH_SR_EOP        (1 << 0)
+#define FLASH_SR_ERRORS     0x1F2
+#define FLASH_SR_BSY        (1 << 16)
 typedef struct {
-    volatile uint32_t acr;
-    volatile uint32_t keyr;
-    volatile uint32_t optkeyr;
-    volatile uint32_t sr;
-    volatile uint32_t cr;
-    volatile uint32_t optcr;
+    reg32_t acr;
+    reg32_t keyr;
+    reg32_t optkeyr;
+    reg32_t sr;
+    reg32_t cr;
+    reg32_t optcr;
 } Flash_Reg;
 
+namespace flash_acr{
+    inline constexpr Field<&Flash_Reg::acr, 0, 4> LATENCY{};
+}
+
+namespace flash_cr{
+    inline constexpr Field<&Flash_Reg::cr, 0, 1> PG{};
+    inline constexpr Field<&Flash_Reg::cr, 1, 1> SER{};
+    inline constexpr Field<&Flash_Reg::cr, 2, 1> MER{};
+    inline constexpr Field<&Flash_Reg::cr, 3, 4> SNB{};
+    inline constexpr Field<&Flash_Reg::cr, 8, 2> PSIZE{};
+    inline constexpr Field<&Flash_Reg::cr, 16, 1> STRT{};
+    inline constexpr Field<&Flash_Reg::cr, 24, 1> EOPIE{};
+    inline constexpr Field<&Flash_Reg::cr, 25, 1> ERRIE{};
+    inline constexpr Field<&Flash_Reg::cr, 31, 1> LOCK{};
+}
+
 class Flash final{
 public:
     Flash_Reg* registers;
 
-    Flash() : registers (reinterpret_cast<Flash_Reg*>(FLASH_BASE)) {}
+    Flash() : registers (PERIPHERAL(Flash_Reg, FLASH_BASE)) {}
 
+    /// @brief key sequence only while locked, KEYR write to unlocked
+    ///         flash is a bus fault and keeps CR locked until reset
     void unlock_cr_register(){
+        if(read_field(registers, flash_cr::LOCK) == 0) return;
         registers->keyr = 0x45670123;
         registers->keyr = 0xCDEF89AB;
     }
@@ -47,32 +214,24 @@ public:
     }
 
     void enable_interrupts(){
-        while ((registers->cr & (1 << 31)) != 0);
-        registers->cr |= (1 << 25);
+        while (read_field(registers, flash_cr::LOCK) != 0);
+        modify(registers, flash_cr::ERRIE = 1);
     }
 
     void disable_interrupts(){
-        while ((registers->cr & (1 << 31)) != 0);
-        registers->cr &= ~(1 << 25);
+        while (read_field(registers, flash_cr::LOCK) != 0);
+        modify(registers, flash_cr::ERRIE = 0);
     }
 
     void start_erasing(){
-        while ((registers->cr & (1 << 31)) != 0);
-        registers->cr |= (1 << 16);
+        while (read_field(registers, flash_cr::LOCK) != 0);
+        modify(registers, flash_cr::STRT = 1);
     }
 
-    
+    /// @brief PSIZE encodes ProgramSize in declaration order
     void set_program_size(ProgramSize size){
-        while ((registers->cr & (1 << 31)) != 0);
-        
-        registers->cr &= ~(0b11 << 8);
-
-        switch (size){
-            case ProgramSize::Sixteen:   registers->cr |= (0b01 << 8); return;
-            case ProgramSize::ThirtyTwo: registers->cr |= (0b10 << 8); return;
-            case ProgramSize::SixtyFour: registers->cr |= (0b11 << 8); return;
-            default:        return;
-        }
+        while (read_field(registers, flash_cr::LOCK) != 0);
+        modify(registers, flash_cr::PSIZE = static_cast<uint32_t>(size));
     }
 
     /// @brief if you check documentation you can see
@@ -85,130 +244,428 @@ public:
         if(sector_count > 5) 
             return 1;
         
-        registers->cr &= ~(0xF);
-        registers->cr |= sector_count << 3;
+        modify(registers, flash_cr::SNB = sector_count);
 
         return 0;
     }
 
     void mass_erase(){
-        registers->cr |= 0b100;
+        modify(registers, flash_cr::MER = 1);
     }
 
     void sector_erase(){
-        registers->cr |= 0b10;
+        modify(registers, flash_cr::SER = 1);
     }
 
     void programming(){
-        registers->cr |= 0b1;
+        modify(registers, flash_cr::PG = 1);
+    }
+
+    void lock(){
+        modify(registers, flash_cr::LOCK = 1);
+    }
+
+    bool is_busy() const {
+        return registers->sr & FLASH_SR_BSY;
+    }
+
+    void wait_ready() const {
+        while(is_busy());
+    }
+
+    /// @return FLASH_SR_ERRORS bits set by last erase or program
+    uint32_t get_errors() const {
+        return registers->sr & FLASH_SR_ERRORS;
+    }
+
+    void clear_status(){
+        registers->sr = FLASH_SR_EOP | FLASH_SR_ERRORS;
+    }
+
+    /// @brief EOP is raised after every erase and every programmed word
+    void interrupt_eop_enable(){
+        modify(registers, flash_cr::EOPIE = 1);
+    }
+
+    void interrupt_eop_disable(){
+        modify(registers, flash_cr::EOPIE = 0);
+    }
+
+    /// @brief sector layout of stm32F401CC: 4 x 16K, 64K, 128K
+    /// @return first address of sector, 0 if sector is bigger than 5
+    static uint32_t sector_address(uint8_t sector){
+        if(sector < 4) return 0x08000000 + sector * 0x4000;
+        if(sector == 4) return 0x08010000;
+        if(sector == 5) return 0x08020000;
+        return 0;
+    }
+
+    static uint8_t sector_of(uint32_t address){
+        if(address < 0x08010000) return (address - 0x08000000) / 0x4000;
+        return address < 0x08020000 ? 4 : 5;
+    }
+
+    /// @brief starts erase and returns, end is signalled by EOP
+    ///         (interrupt if enabled) and BSY cleared, flash must be unlocked.
+    ///         Code fetched from flash stalls until erase ends.
+    /// @return 1 if sector is bigger than 5 or 0 if ok
+    uint8_t start_sector_erase(uint8_t sector){
+        if(sector > 5) return 1;
+
+        wait_ready();
+        clear_status();
+        modify(registers, flash_cr::PG = 0, flash_cr::SER = 1, flash_cr::MER = 0,
+            flash_cr::SNB = sector, flash_cr::PSIZE = static_cast<uint32_t>(ProgramSize::ThirtyTwo));
+        modify(registers, flash_cr::STRT = 1);
+
+        return 0;
+    }
+
+    /// @brief PG mode with x32 parallelism (2.7..3.6 V supply),
+    ///         flash must be unlocked, words written to flash
+    ///         address are programmed until end_programming()
+    void begin_programming(){
+        wait_ready();
+        clear_status();
+        modify(registers, flash_cr::PG = 1, flash_cr::SER = 0, flash_cr::MER = 0,
+            flash_cr::PSIZE = static_cast<uint32_t>(ProgramSize::ThirtyTwo));
+    }
+
+    /// @brief next write to flash stalls the bus while previous
+    ///         word is programmed, so words are not polled one by one
+    /// @return 1 if any word failed (errors stay in status) or 0 if ok
+    uint8_t program_words(reg32_t* destination, const uint32_t* words, uint32_t count){
+        for(uint32_t i = 0; i < count; i++) destination[i] = words[i];
+        wait_ready();
+
+        return get_errors() != 0;
+    }
+
+    void end_programming(){
+        wait_ready();
+        modify(registers, flash_cr::PG = 0);
     }
 };
 
 typedef struct {
-    volatile uint32_t cr;
-    volatile uint32_t pllcfgr;
-    volatile uint32_t cfgr;
-    volatile uint32_t cir;
-    volatile uint32_t ahb1rstr;
-    volatile uint32_t ahb2rstr;
-    volatile uint32_t reserved0[2];
-    volatile uint32_t apb1rstr;
-    volatile uint32_t apb2rstr;
-    volatile uint32_t reserved1[2];
-    volatile uint32_t ahb1enr;
-    volatile uint32_t ahb2enr;
-    volatile uint32_t reserved2[2];
-    volatile uint32_t apb1enr;
-    volatile uint32_t apb2enr;
-    volatile uint32_t reserved3[2];
-    volatile uint32_t rcc_ahb1lpenr;
-    volatile uint32_t rcc_ahb2lpenr;
-    volatile uint32_t reserved4[2];
-    volatile uint32_t rcc_apb1lpenr;
-    volatile uint32_t rcc_apb2lpenr;
-    volatile uint32_t reserved5[2];
-    volatile uint32_t rcc_bdcr;
-    volatile uint32_t rcc_csr;
-    volatile uint32_t reserved6[2];
-    volatile uint32_t rcc_sscgr;
-    volatile uint32_t rcc_plli2scfgr;
-    volatile uint32_t reserved;
-    volatile uint32_t rcc_dckcfgr;
-} RCC_Reg;        
+    reg32_t cr;
+    reg32_t pllcfgr;
+    reg32_t cfgr;
+    reg32_t cir;
+    reg32_t ahb1rstr;
+    reg32_t ahb2rstr;
+    reg32_t reserved0[2];
+    reg32_t apb1rstr;
+    reg32_t apb2rstr;
+    reg32_t reserved1[2];
+    reg32_t ahb1enr;
+    reg32_t ahb2enr;
+    reg32_t reserved2[2];
+    reg32_t apb1enr;
+    reg32_t apb2enr;
+    reg32_t reserved3[2];
+    reg32_t rcc_ahb1lpenr;
+    reg32_t rcc_ahb2lpenr;
+    reg32_t reserved4[2];
+    reg32_t rcc_apb1lpenr;
+    reg32_t rcc_apb2lpenr;
+    reg32_t reserved5[2];
+    reg32_t rcc_bdcr;
+    reg32_t rcc_csr;
+    reg32_t reserved6[2];
+    reg32_t rcc_sscgr;
+    reg32_t rcc_plli2scfgr;
+    reg32_t reserved;
+    reg32_t rcc_dckcfgr;
+} RCC_Reg;
+
+namespace rcc_cr{
+    inline constexpr Field<&RCC_Reg::cr, 0, 1> HSION{};
+    inline constexpr Field<&RCC_Reg::cr, 1, 1> HSIRDY{};
+    inline constexpr Field<&RCC_Reg::cr, 24, 1> PLLON{};
+    inline constexpr Field<&RCC_Reg::cr, 25, 1> PLLRDY{};
+}
+
+namespace rcc_pllcfgr{
+    inline constexpr Field<&RCC_Reg::pllcfgr, 0, 6> PLLM{};
+    inline constexpr Field<&RCC_Reg::pllcfgr, 6, 9> PLLN{};
+    inline constexpr Field<&RCC_Reg::pllcfgr, 16, 2> PLLP{};
+    inline constexpr Field<&RCC_Reg::pllcfgr, 22, 1> PLLSRC{};
+    inline constexpr Field<&RCC_Reg::pllcfgr, 24, 4> PLLQ{};
+}
+
+namespace rcc_cfgr{
+    inline constexpr Field<&RCC_Reg::cfgr, 0, 2> SW{};
+    inline constexpr Field<&RCC_Reg::cfgr, 2, 2> SWS{};
+    inline constexpr Field<&RCC_Reg::cfgr, 4, 4> HPRE{};
+    inline constexpr Field<&RCC_Reg::cfgr, 10, 3> PPRE1{};
+    inline constexpr Field<&RCC_Reg::cfgr, 13, 3> PPRE2{};
+}
+
+// SW / SWS values
+#define RCC_SYSCLK_HSI  0b00
+#define RCC_SYSCLK_PLL  0b10
 
 class RCC final{
 public:    
     RCC_Reg* registers;
 
-    RCC() : registers(reinterpret_cast<RCC_Reg*>(RCC_BASE)) {}
+    RCC() : registers(PERIPHERAL(RCC_Reg, RCC_BASE)) {}
 
     void enable_pll(){
-        registers->cr |= 1 << 24;
+        modify(registers, rcc_cr::PLLON = 1);
     }    
     
     void diasble_pll(){
-        registers->cr &= ~(1 << 24);
+        modify(registers, rcc_cr::PLLON = 0);
     }    
 
     bool is_locked() const {
-        return registers->cr & 1 << 25;
+        return read_field(registers, rcc_cr::PLLRDY);
     }    
 
     void enable_hsi(){
-        registers->cr |= 1;
-        while(((registers->cr >> 1) & 1) != 1);
+        modify(registers, rcc_cr::HSION = 1);
+        while(read_field(registers, rcc_cr::HSIRDY) != 1);
     }    
 
     void switch_to_pll(){
-        registers->cfgr &= ~0b11;
-        registers->cfgr |= 0b10;
-        while(((registers->cfgr >> 2) & 0b11) != 0b10);
+        modify(registers, rcc_cfgr::SW = RCC_SYSCLK_PLL);
+        while(read_field(registers, rcc_cfgr::SWS) != RCC_SYSCLK_PLL);
     }    
 
-    uint8_t config_pll(uint8_t pllq, uint8_t pllp, uint32_t plln, uint16_t pllm){
+    void switch_to_hsi(){
+        modify(registers, rcc_cfgr::SW = RCC_SYSCLK_HSI);
+        while(read_field(registers, rcc_cfgr::SWS) != RCC_SYSCLK_HSI);
+    }
+
+    bool is_pll_source() const {
+        return read_field(registers, rcc_cfgr::SWS) == RCC_SYSCLK_PLL;
+    }
+
+    /// @brief wake up from Stop leaves SYSCLK on HSI and PLL off,
+    ///         PLLCFGR, prescalers and flash latency are kept, so
+    ///         clocks of config_pll() come back without recalculation
+    void resume_pll(){
+        enable_pll();
+        while(!is_locked());
+        switch_to_pll();
+    }
+
+    /// @brief current clocks, updated by config_pll() and use_hsi(),
+    ///         after reset core runs from HSI without prescalers
+    static inline uint32_t sysclk = HSI_HZ;
+    static inline uint32_t hclk = HSI_HZ;
+    static inline uint32_t pclk1 = HSI_HZ;
+    static inline uint32_t pclk2 = HSI_HZ;
+
+    static uint32_t get_sysclk(){
+        return sysclk;
+    }
+
+    static uint32_t get_hclk(){
+        return hclk;
+    }
+
+    static uint32_t get_pclk1(){
+        return pclk1;
+    }
+
+    static uint32_t get_pclk2(){
+        return pclk2;
+    }
+
+    /// @brief timers get doubled bus clock if APB prescaler is not 1
+    static uint32_t get_apb1_timer_clock(){
+        return pclk1 == hclk ? pclk1 : pclk1 * 2;
+    }
+
+    static uint32_t get_apb2_timer_clock(){
+        return pclk2 == hclk ? pclk2 : pclk2 * 2;
+    }
+
+    /// @brief SYSCLK which config_pll() sets up from HSI, constant
+    ///         expression for clocks known at compile time
+    static constexpr uint32_t pll_clock(uint8_t pllp, uint32_t plln, uint16_t pllm){
+        return HSI_HZ / pllm * plln / pllp;
+    }
+
+    /// @brief minimum flash wait states for hclk (2.7 - 3.6 V supply)
+    static uint8_t flash_wait_states(uint32_t frequency){
+        return frequency == 0 ? 0 : (frequency - 1) / FLASH_WS_STEP_HZ;
+    }
+
+    /// @param pllq 2..15
+    /// @param pllp 2, 4, 6 or 8
+    /// @param plln 192..432, VCO (HSI / pllm * plln) must be 192..432 MHz
+    /// @param pllm 2..63 (VCO input 1..2 MHz)
+    /// @param ahb_div 1, 2, 4, 8, 16, 64, 128, 256 or 512
+    /// @param apb1_div 1, 2, 4, 8 or 16, APB1 must stay <= 42 MHz
+    /// @param apb2_div 1, 2, 4, 8 or 16
+    /// @return 1 if settings are invalid or 0 if ok
+    uint8_t config_pll(uint8_t pllq, uint8_t pllp, uint32_t plln, uint16_t pllm,
+            uint16_t ahb_div = 1, uint8_t apb1_div = 2, uint8_t apb2_div = 1){
+        if(pllm < 2 || pllm > 63 || plln < 192 || plln > 432 || pllq < 2 || pllq > 15)
+            return 1;
+        if(pllp != 2 && pllp != 4 && pllp != 6 && pllp != 8)
+            return 1;
+
+        uint32_t vco_in = HSI_HZ / pllm;
+        uint32_t vco = vco_in * plln;
+        uint32_t new_sysclk = pll_clock(pllp, plln, pllm);
+        if(vco_in < 1000000 || vco_in > 2000000 || new_sysclk > SYSCLK_MAX_HZ)
+            return 1;
+        if(vco < PLL_VCO_MIN_HZ || vco > PLL_VCO_MAX_HZ) return 1;
+
+        FieldValue<&RCC_Reg::cfgr> new_cfgr;
+        if(prescalers(ahb_div, apb1_div, apb2_div, new_cfgr)) return 1;
+        if(new_sysclk / ahb_div / apb1_div > APB1_MAX_HZ) return 1;
+
+        // PLL can't be changed while it drives SYSCLK
         enable_hsi();
+        if(is_pll_source()) apply_clock(HSI_HZ, RCC_SYSCLK_HSI, 1, 1, 1);
         diasble_pll();
         while(is_locked());
         
-        registers->pllcfgr = 0;
-        registers->pllcfgr |= (pllq & 0xF) << 24;
-        registers->pllcfgr |= (plln & 0x1FF) << 6;
-        registers->pllcfgr |= pllm & 0x3F;
-        registers->pllcfgr &= ~(1 << 22);
-        
-        switch(pllp) {
-            case 2:  registers->pllcfgr |= (0b00 << 16); break;
-            case 4:  registers->pllcfgr |= (0b01 << 16); break;
-            case 6:  registers->pllcfgr |= (0b10 << 16); break;
-            case 8:  registers->pllcfgr |= (0b11 << 16); break;
-            default: return 1;
-        }    
+        // reserved bits keep reset value
+        modify(registers, rcc_pllcfgr::PLLQ = pllq, rcc_pllcfgr::PLLSRC = 0,
+            rcc_pllcfgr::PLLP = pllp / 2 - 1, rcc_pllcfgr::PLLN = plln, rcc_pllcfgr::PLLM = pllm);
 
         enable_pll();
-        
-        Flash_Reg* flash = reinterpret_cast<Flash_Reg*>(FLASH_BASE);
-        flash->acr &= ~3;
-        flash->acr |= 3;
-        
         while(!is_locked());
-        switch_to_pll();
+
+        apply_clock(new_sysclk, RCC_SYSCLK_PLL, ahb_div, apb1_div, apb2_div);
 
         return 0;
     }    
+
+    /// @brief low power profile: SYSCLK from HSI, PLL is stopped
+    /// @return 1 if prescalers are invalid or 0 if ok
+    uint8_t use_hsi(uint16_t ahb_div = 1, uint8_t apb1_div = 1, uint8_t apb2_div = 1){
+        FieldValue<&RCC_Reg::cfgr> new_cfgr;
+        if(prescalers(ahb_div, apb1_div, apb2_div, new_cfgr)) return 1;
+
+        enable_hsi();
+        apply_clock(HSI_HZ, RCC_SYSCLK_HSI, ahb_div, apb1_div, apb2_div);
+        diasble_pll();
+
+        return 0;
+    }
+
+private:
+    /// @return 1 if some divider is not supported or 0 if ok, cfgr gets HPRE/PPRE fields
+    static uint8_t prescalers(uint16_t ahb_div, uint8_t apb1_div, uint8_t apb2_div,
+            FieldValue<&RCC_Reg::cfgr>& cfgr){
+        uint8_t ahb_log = log2_exact(ahb_div);
+        uint8_t apb1_log = log2_exact(apb1_div);
+        uint8_t apb2_log = log2_exact(apb2_div);
+        if(ahb_log > 9 || ahb_log == 5 || apb1_log > 4 || apb2_log > 4) return 1;
+
+        // /64 is next after /16
+        uint32_t hpre = ahb_log == 0 ? 0 : 0b1000 | (ahb_log - (ahb_log > 5 ? 2 : 1));
+        uint32_t ppre1 = apb1_log == 0 ? 0 : 0b100 | (apb1_log - 1);
+        uint32_t ppre2 = apb2_log == 0 ? 0 : 0b100 | (apb2_log - 1);
+
+        cfgr = merge_fields(rcc_cfgr::HPRE = hpre, rcc_cfgr::PPRE1 = ppre1, rcc_cfgr::PPRE2 = ppre2);
+        return 0;
+    }
+
+    /// @return log2 of value or 0xFF if value is not power of two
+    static uint8_t log2_exact(uint32_t value){
+        if(value == 0 || (value & (value - 1)) != 0) return 0xFF;
+        uint8_t log = 0;
+        while(value >>= 1) log++;
+        return log;
+    }
+
+    void set_flash_latency(uint8_t wait_states){
+        Flash_Reg* flash = PERIPHERAL(Flash_Reg, FLASH_BASE);
+        modify(flash, flash_acr::LATENCY = wait_states);
+        while(read_field(flash, flash_acr::LATENCY) != wait_states);
+    }
+
+    /// @brief switches SYSCLK source keeping flash wait states
+    ///         sufficient for both old and new frequency
+    void apply_clock(uint32_t new_sysclk, uint8_t source,
+            uint16_t ahb_div, uint8_t apb1_div, uint8_t apb2_div){
+        uint32_t new_hclk = new_sysclk / ahb_div;
+        FieldValue<&RCC_Reg::cfgr> cfgr = {};
+        prescalers(ahb_div, apb1_div, apb2_div, cfgr);
+
+        if(new_hclk > hclk) set_flash_latency(flash_wait_states(new_hclk));
+
+        // AHB and APB /2 while source is switched
+        modify(registers, rcc_cfgr::HPRE = 0b1000, rcc_cfgr::PPRE1 = 0b100, rcc_cfgr::PPRE2 = 0b100);
+        modify(registers, rcc_cfgr::SW = source);
+        while(read_field(registers, rcc_cfgr::SWS) != source);
+        modify(registers, cfgr);
+
+        if(new_hclk < hclk) set_flash_latency(flash_wait_states(new_hclk));
+
+        sysclk = new_sysclk;
+        hclk = new_hclk;
+        pclk1 = new_hclk / apb1_div;
+        pclk2 = new_hclk / apb2_div;
+    }
 };    
 
+typedef struct {
+    reg32_t dr;
+    reg32_t idr;
+    reg32_t cr;
+} CRC_Reg;
+
+/// @brief CRC calculation unit: CRC-32/MPEG-2 (poly 0x04C11DB7,
+///         init 0xFFFFFFFF, no reflection, no final xor) over 32 bit words
+class CRC final{
+public:
+    CRC_Reg* registers;
+
+    CRC() : registers(PERIPHERAL(CRC_Reg, CRC_BASE)) {}
+
+    void clock_enable(RCC& rcc){
+        rcc.registers->ahb1enr |= 1 << 12;
+    }
+
+    void reset(){
+        registers->cr = 1;
+    }
+
+    void feed(uint32_t word){
+        registers->dr = word;
+    }
+
+    uint32_t get() const {
+        return registers->dr;
+    }
+
+    uint32_t compute(const reg32_t* words, uint32_t count){
+        reset();
+        for(uint32_t i = 0; i < count; i++) feed(words[i]);
+
+        return get();
+    }
+
+    uint32_t compute(const uint32_t* words, uint32_t count){
+        reset();
+        for(uint32_t i = 0; i < count; i++) feed(words[i]);
+
+        return get();
+    }
+};
+
 enum class GpioSpeed { Zero, One, Two, Three };
 typedef struct {
-    volatile uint32_t moder;
-    volatile uint32_t otyper;
-    volatile uint32_t ospeedr;
-    volatile uint32_t pupdr;
-    volatile uint32_t idr;
-    volatile uint32_t odr;
-    volatile uint32_t bsrr;
-    volatile uint32_t lckr;
-    volatile uint32_t afrl;
-    volatile uint32_t afrh;
+    reg32_t moder;
+    reg32_t otyper;
+    reg32_t ospeedr;
+    reg32_t pupdr;
+    reg32_t idr;
+    reg32_t odr;
+    reg32_t bsrr;
+    reg32_t lckr;
+    reg32_t afrl;
+    reg32_t afrh;
 } GPIO_Reg;    
 
 class GPIO{
@@ -220,7 +677,7 @@ public:
 
     GPIO(){};
     GPIO(uint8_t num, uint8_t letter) : 
-        registers(reinterpret_cast<GPIO_Reg*>(
+        registers(PERIPHERAL(GPIO_Reg, 
             GPIO_BASE + (0x400 * (letter - 'A'))
         )) {
             this->num = num;
@@ -281,8 +738,23 @@ public:
 
     void set_alt_function(uint8_t function_num){
         if (function_num > 15) return;
-        if (num < 8) registers->afrl |= function_num << (num * 4);
-        else if (num < 16) registers->afrh |= function_num << ((num - 8) * 4);
+        if (num < 8){
+            registers->afrl &= ~(0xF << (num * 4));
+            registers->afrl |= function_num << (num * 4);
+        }
+        else if (num < 16){
+            registers->afrh &= ~(0xF << ((num - 8) * 4));
+            registers->afrh |= function_num << ((num - 8) * 4);
+        }
+    }
+
+    bool is_output() const {
+        return ((registers->moder >> (2 * num)) & 0b11) == 0b01;
+    }
+
+    /// @brief one BSRR write, other pins of port are not touched
+    void write(bool high){
+        registers->bsrr = high ? 1 << num : 1 << (num + 16);
     }
 };    
 
@@ -291,15 +763,15 @@ public:
     LED(uint8_t num, uint8_t letter) : GPIO(num, letter){}
     
     void enable_light(){
-        registers->odr &= ~(1 << 13);
+        registers->odr &= ~(1 << num);
     }    
 
     void disable_light(){
-        registers->odr |= 1 << 13;
+        registers->odr |= 1 << num;
     }    
 
     void blink(){
-        registers->odr ^= 1 << 13;
+        registers->odr ^= 1 << num;
     }    
 };    
 
@@ -312,134 +784,352 @@ public:
         return read_data();
     }
 };    
-typedef struct {
-    volatile uint32_t cr1;
-    volatile uint32_t cr2;
-    volatile uint32_t smcr;
-    volatile uint32_t dier;
-    volatile uint32_t sr;
-    volatile uint32_t egr;
-    volatile uint32_t ccmr1;
-    volatile uint32_t ccmr2;
-    volatile uint32_t ccer;
-    volatile uint32_t cnt;
-    volatile uint32_t psc;
-    volatile uint32_t arr;
-    volatile uint32_t ccr1;
-    volatile uint32_t ccr2;
-    volatile uint32_t ccr3;
-    volatile uint32_t ccr4;
-    volatile uint32_t reserved;
-    volatile uint32_t dcr;
-    volatile uint32_t dmar;
-    volatile uint32_t tim2;
-} TIM_Reg;    
+enum class GpioMode { Input, Output, Alternate, Analog };
+enum class GpioPull { None, Up, Down };
+enum class GpioOutput { PushPull, OpenDrain };
+
+/// @brief full configuration of one pin, bits and masks of
+///         every GPIO register are computed at compile time
+template<uint8_t Num, GpioMode Mode, GpioSpeed Speed = GpioSpeed::Zero,
+        GpioPull Pull = GpioPull::None, GpioOutput Output = GpioOutput::PushPull,
+        uint8_t Function = 0>
+struct PinConfig final{
+    static_assert(Num < 16, "pin number must be 0..15");
+    static_assert(Function < 16, "alternate function must be 0..15");
+
+    static constexpr uint32_t pin_mask = 1u << Num;
+    static constexpr uint32_t mask2 = 0b11u << (2 * Num);
+
+    static constexpr uint32_t moder = static_cast<uint32_t>(Mode) << (2 * Num);
+    static constexpr uint32_t ospeedr = static_cast<uint32_t>(Speed) << (2 * Num);
+    static constexpr uint32_t pupdr = static_cast<uint32_t>(Pull) << (2 * Num);
+    static constexpr uint32_t otyper = Output == GpioOutput::OpenDrain ? pin_mask : 0;
+
+    static constexpr uint32_t afrl_mask = Num < 8 ? 0xFu << (Num * 4) : 0;
+    static constexpr uint32_t afrh_mask = Num < 8 ? 0 : 0xFu << ((Num - 8) * 4);
+    static constexpr uint32_t afrl = Num < 8 ? static_cast<uint32_t>(Function) << (Num * 4) : 0;
+    static constexpr uint32_t afrh = Num < 8 ? 0 : static_cast<uint32_t>(Function) << ((Num - 8) * 4);
+};
 
-class TIM final{
-public:    
-    TIM_Reg* registers;
-    
-    TIM(uint8_t num){
-        if(num >= 2 && num <= 5)
-        registers = reinterpret_cast<TIM_Reg*>(TIM_BASE + (0x400 * (num - 2)));
-    }    
- 
-    void delay(uint32_t milliseconds){
-        stop();
-        init();
-        start();
-        while(registers->cnt < milliseconds);
-        stop();
-    }    
-    void clock_enable(RCC& rcc){
-        rcc.registers->apb1enr |= 1;
-    }    
-    
-private:    
-    void stop(){
-        registers->cr1 &= ~1;
-    }    
-    void start(){
-        registers->cr1 |= 1;
-    }    
-    void init(){
-        registers->cr1 = 0;
-        registers->cr2 = 0;
-        registers->smcr = 0;
-        registers->dier = 0;
-        registers->psc = 84000 - 1;
-        registers->arr = UINT32_T_MAX;
-        registers->cnt = 0;
-        registers->egr = 1;
-    }    
-};    
+/// @brief whole GPIO port, configures and drives many pins
+///         with one access per register
+template<char Port>
+class GpioPort final{
+    static_assert((Port >= 'A' && Port <= 'E') || Port == 'H', "port must be A..E or H");
+
+    template<uint32_t Mask, uint32_t Value>
+    static void modify(reg32_t& reg){
+        if constexpr (Mask == 0) return;
+        else if constexpr (Mask == 0xFFFFFFFF) reg = Value;
+        else reg = (reg & ~Mask) | Value;
+    }
+public:
+    static constexpr uint32_t base = GPIO_BASE + 0x400 * (Port - 'A');
+
+    GpioPort() = delete;
+
+    static GPIO_Reg* registers(){
+        return PERIPHERAL(GPIO_Reg, base);
+    }
+
+    static void clock_enable(RCC& rcc){
+        rcc.registers->ahb1enr |= 1u << (Port - 'A');
+    }
+
+    /// @brief merges PinConfig of any count of pins into one
+    ///         read-modify-write per register, mode is written last
+    ///         so alternate function is ready when pin switches to it
+    template<typename... Configs>
+    static void apply(){
+        static_assert(sizeof...(Configs) > 0, "at least one PinConfig required");
+
+        constexpr uint32_t pins = (0u | ... | Configs::pin_mask);
+        static_assert(pins == (0u + ... + Configs::pin_mask), "pin is configured twice");
+
+        modify<(0u | ... | Configs::afrl_mask), (0u | ... | Configs::afrl)>(registers()->afrl);
+        modify<(0u | ... | Configs::afrh_mask), (0u | ... | Configs::afrh)>(registers()->afrh);
+        modify<pins, (0u | ... | Configs::otyper)>(registers()->otyper);
+        modify<(0u | ... | Configs::mask2), (0u | ... | Configs::ospeedr)>(registers()->ospeedr);
+        modify<(0u | ... | Configs::mask2), (0u | ... | Configs::pupdr)>(registers()->pupdr);
+        modify<(0u | ... | Configs::mask2), (0u | ... | Configs::moder)>(registers()->moder);
+    }
+
+    /// @brief sets and resets pins at the same clock edge, set wins
+    static void write(uint16_t set_mask, uint16_t reset_mask){
+        registers()->bsrr = set_mask | (static_cast<uint32_t>(reset_mask) << 16);
+    }
+
+    /// @brief pins of mask take values of matching bits of value
+    static void write_masked(uint16_t mask, uint16_t value){
+        write(value & mask, ~value & mask);
+    }
+
+    static uint16_t read(){
+        return registers()->idr;
+    }
+
+    static uint16_t read_output(){
+        return registers()->odr;
+    }
+};
+
+/// @brief pin with address, masks and afr register known at compile time,
+///         every operation is one access with immediate constants,
+///         use GPIO when pin is known only at runtime
+template<char Port, uint8_t Num>
+class Pin final{
+    static_assert((Port >= 'A' && Port <= 'E') || Port == 'H', "port must be A..E or H");
+    static_assert(Num < 16, "pin number must be 0..15");
+    static_assert(Port != 'H' || Num < 2, "port H has only PH0 and PH1");
+
+    static GPIO_Reg* registers(){
+        return PERIPHERAL(GPIO_Reg, base);
+    }
+
+    static void write_field2(reg32_t& reg, uint32_t value){
+        reg = (reg & ~(0b11u << (2 * Num))) | (value << (2 * Num));
+    }
+public:
+    static constexpr uint32_t base = GPIO_BASE + 0x400 * (Port - 'A');
+    static constexpr uint32_t mask = 1u << Num;
+    static constexpr uint8_t port = Port;
+    static constexpr uint8_t num = Num;
+
+    Pin() = delete;
+
+    static void clock_enable(RCC& rcc){
+        rcc.registers->ahb1enr |= 1u << (Port - 'A');
+    }
+
+    static void set_input_mode(){
+        write_field2(registers()->moder, 0b00);
+    }
+
+    static void set_output_mode(){
+        write_field2(registers()->moder, 0b01);
+    }
+
+    static void set_alt_function_mode(){
+        write_field2(registers()->moder, 0b10);
+    }
+
+    static void set_analog_mode(){
+        write_field2(registers()->moder, 0b11);
+    }
+
+    static void enable_push_pull(){
+        registers()->otyper &= ~mask;
+    }
+
+    static void enable_open_drain(){
+        registers()->otyper |= mask;
+    }
+
+    static void set_speed(GpioSpeed speed){
+        write_field2(registers()->ospeedr, static_cast<uint32_t>(speed));
+    }
+
+    static void no_pull_up_down(){
+        write_field2(registers()->pupdr, 0b00);
+    }
+
+    static void set_pull_up(){
+        write_field2(registers()->pupdr, 0b01);
+    }
+
+    static void set_pull_down(){
+        write_field2(registers()->pupdr, 0b10);
+    }
+
+    template<uint8_t Function>
+    static void set_alt_function(){
+        static_assert(Function < 16, "alternate function must be 0..15");
+        constexpr uint8_t shift = (Num % 8) * 4;
+        reg32_t& afr = Num < 8 ? registers()->afrl : registers()->afrh;
+        afr = (afr & ~(0xFu << shift)) | (static_cast<uint32_t>(Function) << shift);
+    }
+
+    static void set(){
+        registers()->bsrr = mask;
+    }
+
+    static void reset(){
+        registers()->bsrr = mask << 16;
+    }
+
+    static void write(bool value){
+        registers()->bsrr = value ? mask : mask << 16;
+    }
+
+    /// @brief atomic for other pins of the port, unlike odr ^=
+    static void toggle(){
+        registers()->bsrr = (registers()->odr & mask) ? mask << 16 : mask;
+    }
+
+    static bool read(){
+        return registers()->idr & mask;
+    }
+
+    static bool read_output(){
+        return registers()->odr & mask;
+    }
+};
 
 typedef struct {
-    volatile uint32_t iser[16];
-    volatile uint32_t icer[16];
-    volatile uint32_t ispr[16];
-    volatile uint32_t icpr[16];
-    volatile uint32_t iabr[16];
-    volatile uint32_t reserved1[47];
-    volatile uint32_t ipr[123];
-    volatile uint32_t reserved2[451];
+    reg32_t iser[16];
+    reg32_t icer[16];
+    reg32_t ispr[16];
+    reg32_t icpr[16];
+    reg32_t iabr[16];
+    reg32_t reserved1[47];
+    reg32_t ipr[123];
+    reg32_t reserved2[451];
 } NVIC_Reg;
 
+typedef struct {
+    reg32_t cpuid;
+    reg32_t icsr;
+    reg32_t vtor;
+    reg32_t aircr;
+    reg32_t scr;
+    reg32_t ccr;
+    reg32_t shpr[3];
+    reg32_t shcsr;
+    reg32_t cfsr;
+    reg32_t hfsr;
+    reg32_t dfsr;
+    reg32_t mmfar;
+    reg32_t bfar;
+    reg32_t afsr;
+} SCB_Reg;
+
 class NVIC final{
+    static reg32_t& aircr(){
+        return PERIPHERAL(SCB_Reg, SCB_BASE)->aircr;
+    }
 public:
     NVIC_Reg* registers;
 
-    NVIC() : registers(reinterpret_cast<NVIC_Reg*>(NVIC_BASE)){}
+    NVIC() : registers(PERIPHERAL(NVIC_Reg, NVIC_BASE)){}
 
     uint8_t get_interrupts_count(){
-        return ((*reinterpret_cast<uint32_t*>(ICTR_BASE) & 0b1111) + 1) * 32;
+        return ((*PERIPHERAL(reg32_t, ICTR_BASE) & 0b1111) + 1) * 32;
     }
 
     void trigger_interrupt(uint8_t num){
         num %= get_interrupts_count();
 
-        *reinterpret_cast<uint32_t*>(STIR_BASE) |= num;
+        *PERIPHERAL(reg32_t, STIR_BASE) = num;
     }
 
     uint8_t enable_interrupt(uint16_t num){
-        if(num > (32 * 15)) return 1;
-        registers->iser[num / 32] |= 1 << (num % 32);
+        if(num >= IRQ_COUNT) return 1;
+        registers->iser[num / 32] = 1 << (num % 32);
 
         return 0;
     }
     
     uint8_t disable_interrupt(uint16_t num){
-        if(num > (32 * 15)) return 1;
+        if(num >= IRQ_COUNT) return 1;
         registers->icer[num / 32] = 1 << (num % 32);
 
         return 0;
     }
     
     bool is_active(uint16_t interrupt){
-        if(interrupt > (32 * 15)) return false;
+        if(interrupt >= IRQ_COUNT) return false;
         return registers->iabr[interrupt / 32] & (1 << (interrupt % 32));
     }
 
+    bool is_pending(uint16_t num){
+        if(num >= IRQ_COUNT) return false;
+        return registers->ispr[num / 32] & (1 << (num % 32));
+    }
+
+    uint8_t set_pending(uint16_t num){
+        if(num >= IRQ_COUNT) return 1;
+        registers->ispr[num / 32] = 1 << (num % 32);
+
+        return 0;
+    }
+
+    uint8_t clear_pending(uint16_t num){
+        if(num >= IRQ_COUNT) return 1;
+        registers->icpr[num / 32] = 1 << (num % 32);
+
+        return 0;
+    }
+
+    /// @param priority 0..15, 0 is the most urgent, see encode_priority()
+    /// @return 1 if num or priority is out of range or 0 if ok
     uint8_t set_priority(uint16_t num, uint8_t priority){
-        if(num > (32 * 15) && priority > 15) return 1;
-        registers->ipr[num / 4] |= (priority << (8 * (num % 4) + 4));
+        if(num >= IRQ_COUNT || priority >= (1 << NVIC_PRIORITY_BITS)) return 1;
+
+        uint8_t shift = 8 * (num % 4);
+        registers->ipr[num / 4] = (registers->ipr[num / 4] & ~(0xFF << shift))
+            | (priority << (shift + 8 - NVIC_PRIORITY_BITS));
+
+        return 0;
+    }
+
+    uint8_t get_priority(uint16_t num){
+        if(num >= IRQ_COUNT) return 0;
+        return (registers->ipr[num / 4] >> (8 * (num % 4) + 8 - NVIC_PRIORITY_BITS))
+            & ((1 << NVIC_PRIORITY_BITS) - 1);
+    }
+
+    /// @brief priority of core exception (4 memory management .. 15 systick)
+    /// @return 1 if exception or priority is out of range or 0 if ok
+    static uint8_t set_system_priority(uint8_t exception, uint8_t priority){
+        if(exception < 4 || exception > 15 || priority >= (1 << NVIC_PRIORITY_BITS)) return 1;
+
+        reg32_t& shpr = PERIPHERAL(SCB_Reg, SCB_BASE)->shpr[(exception - 4) / 4];
+        uint8_t shift = 8 * (exception % 4);
+        shpr = (shpr & ~(0xFF << shift)) | (priority << (shift + 8 - NVIC_PRIORITY_BITS));
+
+        return 0;
+    }
+
+    /// @brief splits priority into preemption (group) and sub priority,
+    ///         only group priority decides about preemption
+    /// @param preempt_bits 0..4 bits of group priority
+    /// @return 1 if preempt_bits is bigger than 4 or 0 if ok
+    static uint8_t set_priority_grouping(uint8_t preempt_bits){
+        if(preempt_bits > NVIC_PRIORITY_BITS) return 1;
+
+        // PRIGROUP: group priority takes bits 7..PRIGROUP+1
+        aircr() = (0x05FA << 16) | ((aircr() & ~(0b111 << 8)) & 0xFFFF)
+            | ((7 - preempt_bits) << 8);
 
         return 0;
     }
+
+    static uint8_t get_preempt_bits(){
+        uint8_t prigroup = (aircr() >> 8) & 0b111;
+        return prigroup < 3 ? NVIC_PRIORITY_BITS : 7 - prigroup;
+    }
+
+    /// @brief priority for set_priority() from group and sub priority
+    ///         with current grouping, extra bits are cut off
+    static uint8_t encode_priority(uint8_t preempt, uint8_t sub){
+        uint8_t sub_bits = NVIC_PRIORITY_BITS - get_preempt_bits();
+        return ((preempt << sub_bits) | (sub & ((1 << sub_bits) - 1)))
+            & ((1 << NVIC_PRIORITY_BITS) - 1);
+    }
 };
 
 typedef struct {
-    volatile uint32_t csr;
-    volatile uint32_t rvr;
-    volatile uint32_t cvr;
-    volatile uint32_t calib;
+    reg32_t csr;
+    reg32_t rvr;
+    reg32_t cvr;
+    reg32_t calib;
 } Systick_Reg;
 
 class Systick final{
 public:
     Systick_Reg* registers;
 
-    Systick() : registers(reinterpret_cast<Systick_Reg*>(SYSTICK_BASE)){};
+    Systick() : registers(PERIPHERAL(Systick_Reg, SYSTICK_BASE)){};
 
     bool is_end() const{
         return (registers->csr & (1 << 16));
@@ -463,28 +1153,94 @@ public:
         registers->csr &= ~1;
     }
 
-    void set_ticks(uint32_t ticks){
-        ticks &= 0x00FFFFFF;
-        registers->rvr = ticks - 1;
+    /// @brief stops counter, reading CSR clears COUNTFLAG, so it is
+    ///         read only once here
+    /// @return true if counter reached zero since last read of CSR
+    bool stop_and_take_flag(){
+        uint32_t csr = registers->csr;
+        registers->csr = csr & ~((1 << 16) | 1);
+        return csr & (1 << 16);
+    }
+
+    uint32_t get_reload() const {
+        return registers->rvr + 1;
+    }
+
+    /// @param ticks 1..0x1000000 clock cycles between interrupts
+    /// @return 1 if ticks is out of range or 0 if ok
+    uint8_t set_ticks(uint32_t ticks){
+        if(ticks == 0 || ticks > 0x01000000) return 1;
+        registers->rvr = ticks - 1;
+        return 0;
     }
 
     uint32_t get_current_value(){
         return registers->cvr;
     }
 
-    void delay_ms_interrupt(uint32_t milliseconds){
+    /// @brief one interrupt every milliseconds, falls back to
+    ///         core clock / 8 when period does not fit 24 bits
+    /// @return 1 if period is too long for SysTick or 0 if ok
+    uint8_t delay_ms_interrupt(uint32_t milliseconds){
+        uint32_t ticks_per_ms = RCC::get_hclk() / 1000;
+        bool is_proc_clock = milliseconds <= 0x01000000 / ticks_per_ms;
+        if(!is_proc_clock){
+            ticks_per_ms /= 8;
+            if(milliseconds > 0x01000000 / ticks_per_ms) return 1;
+        }
+
+        stop();
+        set_is_proc_clock(is_proc_clock);
+        set_is_interrupt(true);
+        set_ticks(ticks_per_ms * milliseconds);
+        registers->cvr = 0;
+
+        start();
+        return 0;
+    }
+
+    /// @brief ticks since start_tick(), advanced by on_tick()
+    static inline volatile uint32_t ticks = 0;
+    static inline uint32_t tick_hz = 0;
+
+    /// @brief monotonic tick of tick_hz, systick_handler must call on_tick()
+    /// @return 1 if hz can't be reached with 24 bit reload or 0 if ok
+    uint8_t start_tick(uint32_t hz = 1000){
+        if(hz == 0) return 1;
+
+        stop();
+        if(set_ticks(RCC::get_hclk() / hz)) return 1;
         set_is_proc_clock(true);
         set_is_interrupt(true);
-        set_ticks(84000 * milliseconds - 1);
+        registers->cvr = 0;
+        tick_hz = hz;
 
         start();
+        return 0;
+    }
+
+    /// @brief keeps tick_hz after RCC clock change
+    uint8_t update_clock(){
+        return tick_hz == 0 ? 0 : start_tick(tick_hz);
+    }
+
+    /// @brief must be called from systick_handler
+    /// @return new tick count
+    static uint32_t on_tick(){
+        uint32_t now = ticks + 1;
+        ticks = now;
+        return now;
+    }
+
+    static uint32_t get_ticks(){
+        return ticks;
     }
 
     /// @brief extreme simple delay function (for my own use)
     void delay(uint32_t milliseconds){
         set_is_proc_clock(true);
         set_is_interrupt(false);
-        set_ticks(84000 * 10 - 1);
+        set_ticks(RCC::get_hclk() / 1000 * 10);
         registers->cvr = 0;
         start();
 
@@ -495,29 +1251,1317 @@ public:
     }
 };
 
+typedef struct {
+    reg32_t ctrl;
+    reg32_t cyccnt;
+    reg32_t cpicnt;
+    reg32_t exccnt;
+    reg32_t sleepcnt;
+    reg32_t lsucnt;
+    reg32_t foldcnt;
+    reg32_t pcsr;
+} DWT_Reg;
+
+/// @brief set by reset_handler, cycles from reset to main()
+extern "C" volatile uint32_t boot_cycles;
+
+/// @brief data watchpoint and trace unit, only cycle counter is used,
+///         reset_handler already enables it
+class DWT final{
+public:
+    DWT_Reg* registers;
+
+    DWT() : registers(PERIPHERAL(DWT_Reg, DWT_BASE)) {}
+
+    void enable_cycle_counter(){
+        *PERIPHERAL(reg32_t, DEMCR_BASE) |= 1 << 24;
+        registers->ctrl |= 1;
+    }
+
+    void disable_cycle_counter(){
+        registers->ctrl &= ~1;
+    }
+
+    /// @brief core clock cycles, wraps every 2^32 cycles (51 s at 84 MHz)
+    static uint32_t cycles(){
+        return PERIPHERAL(DWT_Reg, DWT_BASE)->cyccnt;
+    }
+};
+
+#include "profile_zone.hpp"
+
+/// @brief system control block: vector table offset and fault status
+class SCB final{
+public:
+    SCB_Reg* registers;
+
+    SCB() : registers(PERIPHERAL(SCB_Reg, SCB_BASE)) {}
+
+    uint32_t get_vector_table() const {
+        return registers->vtor;
+    }
+
+    /// @param address table address, aligned to table size rounded
+    ///         up to power of two (512 bytes for stm32F401)
+    void set_vector_table(uint32_t address){
+        registers->vtor = address;
+        sync_barrier();
+    }
+
+    /// @brief no exception is active except the current one
+    bool returns_to_base() const {
+        return registers->icsr & (1 << 11);
+    }
+
+    /// @brief clears sticky fault status bits (write one to clear)
+    void clear_faults(){
+        registers->cfsr = registers->cfsr;
+        registers->hfsr = registers->hfsr;
+    }
+
+    /// @brief SysTick exception is pending (ICSR PENDSTSET)
+    bool is_systick_pending() const {
+        return registers->icsr & (1 << 26);
+    }
+
+    /// @brief wfi enters Stop (with PWR settings) instead of Sleep
+    void set_sleep_deep(bool deep){
+        if(deep) registers->scr |= 1 << 2;
+        else registers->scr &= ~(1 << 2);
+        sync_barrier();
+    }
+};
+
+enum class ExtiEdge{ Rising, Falling, Both };
+
+typedef struct {
+    reg32_t imr;
+    reg32_t emr;
+    reg32_t rtsr;
+    reg32_t ftsr;
+    reg32_t swier;
+    reg32_t pr;
+} EXTI_Reg;
+
+typedef struct {
+    reg32_t memrmp;
+    reg32_t pmc;
+    reg32_t exticr[4];
+    reg32_t reserved[2];
+    reg32_t cmpcr;
+} SYSCFG_Reg;
+
+/// @brief external interrupt lines 0..15 of GPIO pins, line n is
+///         shared by pin n of all ports, SYSCFG selects the port
+class EXTI final{
+public:
+    EXTI_Reg* registers;
+    SYSCFG_Reg* syscfg;
+
+    EXTI() : registers(PERIPHERAL(EXTI_Reg, EXTI_BASE)),
+        syscfg(PERIPHERAL(SYSCFG_Reg, SYSCFG_BASE)) {}
+
+    /// @brief SYSCFG clock, needed only to route lines
+    void clock_enable(RCC& rcc){
+        rcc.registers->apb2enr |= 1 << 14;
+    }
+
+    /// @brief line (pin number) takes edges of pin of port
+    /// @return 1 if line or port is wrong or 0 if ok
+    uint8_t route(uint8_t line, uint8_t port){
+        if(line > 15) return 1;
+        if(!((port >= 'A' && port <= 'E') || port == 'H')) return 1;
+
+        uint8_t shift = (line % 4) * 4;
+        reg32_t& exticr = syscfg->exticr[line / 4];
+        exticr = (exticr & ~(0xF << shift)) | ((port - 'A') << shift);
+        return 0;
+    }
+
+    void set_edge(uint8_t line, ExtiEdge edge){
+        if(edge == ExtiEdge::Falling) registers->rtsr &= ~(1 << line);
+        else registers->rtsr |= 1 << line;
+
+        if(edge == ExtiEdge::Rising) registers->ftsr &= ~(1 << line);
+        else registers->ftsr |= 1 << line;
+    }
+
+    void interrupt_enable(uint8_t line){
+        registers->imr |= 1 << line;
+    }
+
+    void interrupt_disable(uint8_t line){
+        registers->imr &= ~(1 << line);
+    }
+
+    bool is_pending(uint8_t line) const {
+        return registers->pr & (1 << line);
+    }
+
+    /// @return pending lines of mask, all of them are cleared
+    uint32_t take_pending(uint32_t mask){
+        uint32_t pending = registers->pr & mask;
+        registers->pr = pending;
+        return pending;
+    }
+
+    void clear_pending(uint8_t line){
+        registers->pr = 1 << line;
+    }
+
+    /// @brief sets pending bit as an edge would do, interrupt
+    ///         follows if line is enabled
+    void trigger(uint8_t line){
+        registers->swier = 1 << line;
+    }
+
+    /// @brief NVIC interrupt of line, lines 5..9 and 10..15 share one
+    static uint8_t get_irq(uint8_t line){
+        if(line <= 4) return EXTI0_IRQ + line;
+        if(line <= 9) return EXTI9_5_IRQ;
+        return EXTI15_10_IRQ;
+    }
+};
+
+typedef struct {
+    reg32_t cr;
+    reg32_t csr;
+} PWR_Reg;
+
+/// @brief power controller, only Stop entry settings are used
+class PWR final{
+public:
+    PWR_Reg* registers;
+
+    PWR() : registers(PERIPHERAL(PWR_Reg, PWR_BASE)) {}
+
+    void clock_enable(RCC& rcc){
+        rcc.registers->apb1enr |= 1 << 28;
+    }
+
+    /// @brief RTC and RCC BDCR are write protected after reset
+    void backup_access(bool enable){
+        if(enable) registers->cr |= 1 << 8;
+        else registers->cr &= ~(1 << 8);
+    }
+
+    /// @brief deep sleep (SCB::set_sleep_deep) enters Stop, not Standby,
+    ///         regulator in low power mode, flash optionally powered down
+    ///         (lower current, longer wake up), wake up flag is cleared
+    void configure_stop(bool flash_power_down = true){
+        uint32_t cr = (registers->cr & ~((1 << 1) | (1 << 9))) | (1 << 0) | (1 << 2);
+        if(flash_power_down) cr |= 1 << 9;
+        registers->cr = cr;
+    }
+};
+
+typedef struct {
+    reg32_t tr;
+    reg32_t dr;
+    reg32_t cr;
+    reg32_t isr;
+    reg32_t prer;
+    reg32_t wutr;
+    reg32_t calibr;
+    reg32_t alrmar;
+    reg32_t alrmbr;
+    reg32_t wpr;
+    reg32_t ssr;
+} RTC_Reg;
+
+// LSI is nominally 32 kHz (17..47 kHz over temperature and parts),
+// prescalers give 1000 sub second steps, wakeup timer counts LSI / 16
+#define RTC_LSI_HZ          32000
+#define RTC_PREDIV_A        31
+#define RTC_PREDIV_S        999
+#define RTC_WAKEUP_HZ       (RTC_LSI_HZ / 16)
+#define RTC_WAKEUP_MAX      0x10000
+#define RTC_DAY_MS          86400000
+// EXTI line of RTC wakeup timer
+#define RTC_WAKEUP_LINE     22
+
+/// @brief RTC on LSI as time base which keeps running in Stop:
+///         millisecond clock of the day and wakeup timer
+class RTC final{
+    void unlock(){
+        registers->wpr = 0xCA;
+        registers->wpr = 0x53;
+    }
+
+    void lock(){
+        registers->wpr = 0xFF;
+    }
+
+    static uint32_t from_bcd(uint32_t value){
+        return (value >> 4) * 10 + (value & 0xF);
+    }
+
+    /// @brief rc_w0 flags are kept by writing one, INIT stays zero
+    void clear_isr_flag(uint32_t flag){
+        registers->isr = ~(flag | (1 << 7));
+    }
+public:
+    RTC_Reg* registers;
+
+    RTC() : registers(PERIPHERAL(RTC_Reg, RTC_BASE)) {}
+
+    /// @brief starts LSI, selects it for RTC (backup domain is reset if
+    ///         RTC had another clock) and starts calendar at 00:00:00,
+    ///         PWR clock and backup access must be enabled
+    void start_lsi(RCC& rcc){
+        rcc.registers->rcc_csr |= 1;
+        while(!(rcc.registers->rcc_csr & (1 << 1)));
+
+        // RTCSEL can be changed only after backup domain reset
+        if((rcc.registers->rcc_bdcr & (0b11 << 8)) != (0b10 << 8)){
+            rcc.registers->rcc_bdcr = 1 << 16;
+            rcc.registers->rcc_bdcr = 0;
+        }
+        rcc.registers->rcc_bdcr |= (0b10 << 8) | (1 << 15);
+
+        unlock();
+        registers->isr |= 1 << 7;
+        while(!(registers->isr & (1 << 6)));
+        // two separate writes, synchronous prescaler first
+        registers->prer = RTC_PREDIV_S;
+        registers->prer |= RTC_PREDIV_A << 16;
+        registers->tr = 0;
+        // counters are read directly, shadow registers are not
+        // updated in Stop
+        registers->cr |= 1 << 5;
+        registers->isr &= ~(1 << 7);
+        lock();
+    }
+
+    /// @brief milliseconds of the day in LSI time, wraps at RTC_DAY_MS
+    uint32_t get_millis() const {
+        uint32_t ssr;
+        uint32_t tr;
+        // second rolls over together with SSR reload
+        do{
+            ssr = registers->ssr;
+            tr = registers->tr;
+        } while(ssr != registers->ssr);
+
+        uint32_t seconds = from_bcd((tr >> 16) & 0x3F) * 3600
+            + from_bcd((tr >> 8) & 0x7F) * 60 + from_bcd(tr & 0x7F);
+        return seconds * 1000 + RTC_PREDIV_S - ssr;
+    }
+
+    static uint32_t elapsed_millis(uint32_t from, uint32_t to){
+        return to >= from ? to - from : to + RTC_DAY_MS - from;
+    }
+
+    /// @brief wakeup flag and interrupt (EXTI RTC_WAKEUP_LINE, rising
+    ///         edge) after units periods of RTC_WAKEUP_HZ
+    /// @param units 1..RTC_WAKEUP_MAX
+    /// @return 1 if units is out of range or 0 if ok
+    uint8_t start_wakeup(uint32_t units){
+        if(units == 0 || units > RTC_WAKEUP_MAX) return 1;
+
+        unlock();
+        registers->cr &= ~((1 << 14) | (1 << 10));
+        while(!(registers->isr & (1 << 2)));
+        registers->wutr = units - 1;
+        // WUCKSEL = RTC / 16
+        registers->cr &= ~0b111;
+        clear_isr_flag(1 << 10);
+        registers->cr |= (1 << 14) | (1 << 10);
+        lock();
+        return 0;
+    }
+
+    void stop_wakeup(){
+        unlock();
+        registers->cr &= ~((1 << 14) | (1 << 10));
+        lock();
+        clear_isr_flag(1 << 10);
+    }
+};
+
+enum class DmaDirection{ PeripheralToMemory, MemoryToPeripheral, MemoryToMemory };
+enum class DmaSize{ Byte, HalfWord, Word };
+
+#define DMA_FLAG_FIFO_ERROR         (1 << 0)
+#define DMA_FLAG_DIRECT_MODE_ERROR  (1 << 2)
+#define DMA_FLAG_TRANSFER_ERROR     (1 << 3)
+#define DMA_FLAG_HALF_TRANSFER      (1 << 4)
+#define DMA_FLAG_TRANSFER_COMPLETE  (1 << 5)
+#define DMA_FLAGS_ALL               0x3D
+
+typedef struct {
+    reg32_t cr;
+    reg32_t ndtr;
+    reg32_t par;
+    reg32_t m0ar;
+    reg32_t m1ar;
+    reg32_t fcr;
+} DMA_Stream_Reg;
+
+typedef struct {
+    reg32_t lisr;
+    reg32_t hisr;
+    reg32_t lifcr;
+    reg32_t hifcr;
+    DMA_Stream_Reg stream[8];
+} DMA_Reg;
+
+class DMA final{
+    uint8_t num;
+    uint8_t stream;
+
+    /// @brief position of stream flags inside lisr/hisr
+    uint8_t flags_offset() const {
+        return (stream & 1) * 6 + (stream & 2) * 8;
+    }
+public:
+    DMA_Reg* registers;
+    DMA_Stream_Reg* stream_registers;
+
+    /// @param num controller 1..2
+    /// @param stream 0..7
+    DMA(uint8_t num, uint8_t stream) : num(num), stream(stream & 7),
+        registers(PERIPHERAL(DMA_Reg, num == 1 ? DMA1_BASE : DMA2_BASE)),
+        stream_registers(&registers->stream[stream & 7]) {}
+
+    void clock_enable(RCC& rcc){
+        rcc.registers->ahb1enr |= 1 << (20 + num);
+    }
+
+    /// @brief NVIC interrupt number of this stream
+    uint8_t get_irq() const {
+        if(num == 1) return stream == 7 ? 47 : 11 + stream;
+        return stream < 5 ? 56 + stream : 68 + (stream - 5);
+    }
+
+    void enable(){
+        stream_registers->cr |= 1;
+    }
+
+    /// @brief waits for current transfer to stop, after that
+    ///         stream can be configured
+    void disable(){
+        stream_registers->cr &= ~1;
+        while(stream_registers->cr & 1);
+    }
+
+    bool is_enabled() const {
+        return stream_registers->cr & 1;
+    }
+
+    /// @brief resets stream configuration, stream must be disabled
+    /// @param channel 0..7
+    void configure(uint8_t channel, DmaDirection direction,
+                DmaSize peripheral_size, DmaSize memory_size, bool memory_increment){
+        uint32_t cr = (channel & 0b111) << 25;
+        cr |= static_cast<uint32_t>(direction) << 6;
+        cr |= static_cast<uint32_t>(peripheral_size) << 11;
+        cr |= static_cast<uint32_t>(memory_size) << 13;
+        if(memory_increment) cr |= 1 << 10;
+
+        stream_registers->cr = cr;
+        stream_registers->fcr = 0;
+    }
+
+    void set_priority(uint8_t priority){
+        stream_registers->cr &= ~(0b11 << 16);
+        stream_registers->cr |= (priority & 0b11) << 16;
+    }
+
+    void set_peripheral_address(volatile void* address){
+        stream_registers->par = bus_address(address);
+    }
+
+    void set_memory0(const volatile void* address){
+        stream_registers->m0ar = bus_address(address);
+    }
+
+    /// @brief second buffer of double buffer mode, can be changed
+    ///         while stream is enabled if it is not current target
+    void set_memory1(const volatile void* address){
+        stream_registers->m1ar = bus_address(address);
+    }
+
+    void set_count(uint16_t count){
+        stream_registers->ndtr = count;
+    }
+
+    /// @brief items left in current transfer
+    uint16_t get_count() const {
+        return stream_registers->ndtr;
+    }
+
+    void enable_circular(){
+        stream_registers->cr |= 1 << 8;
+    }
+
+    void disable_circular(){
+        stream_registers->cr &= ~(1 << 8);
+    }
+
+    /// @brief switches memory0/memory1 after every transfer,
+    ///         circular mode is enabled by hardware
+    void enable_double_buffer(){
+        stream_registers->cr |= 1 << 18;
+    }
+
+    void disable_double_buffer(){
+        stream_registers->cr &= ~(1 << 18);
+    }
+
+    /// @return 0 if stream uses memory0 now, 1 if memory1
+    uint8_t current_target() const {
+        return (stream_registers->cr >> 19) & 1;
+    }
+
+    void interrupt_tc_enable(){
+        stream_registers->cr |= 1 << 4;
+    }
+
+    void interrupt_tc_disable(){
+        stream_registers->cr &= ~(1 << 4);
+    }
+
+    void interrupt_ht_enable(){
+        stream_registers->cr |= 1 << 3;
+    }
+
+    void interrupt_ht_disable(){
+        stream_registers->cr &= ~(1 << 3);
+    }
+
+    void interrupt_te_enable(){
+        stream_registers->cr |= 1 << 2;
+    }
+
+    void interrupt_te_disable(){
+        stream_registers->cr &= ~(1 << 2);
+    }
+
+    /// @return DMA_FLAG_* bits of this stream
+    uint8_t get_flags() const {
+        uint32_t isr = stream < 4 ? registers->lisr : registers->hisr;
+        return (isr >> flags_offset()) & DMA_FLAGS_ALL;
+    }
+
+    void clear_flags(uint8_t flags){
+        uint32_t mask = static_cast<uint32_t>(flags & DMA_FLAGS_ALL) << flags_offset();
+        if(stream < 4) registers->lifcr = mask;
+        else registers->hifcr = mask;
+    }
+
+    /// @brief must be called from stream interrupt handler
+    /// @return DMA_FLAG_* bits which caused interrupt, they are cleared
+    uint8_t irq_handler(){
+        uint8_t flags = get_flags();
+        clear_flags(flags);
+        return flags;
+    }
+};
+
+typedef struct {
+    reg32_t cr1;
+    reg32_t cr2;
+    reg32_t smcr;
+    reg32_t dier;
+    reg32_t sr;
+    reg32_t egr;
+    reg32_t ccmr1;
+    reg32_t ccmr2;
+    reg32_t ccer;
+    reg32_t cnt;
+    reg32_t psc;
+    reg32_t arr;
+    reg32_t reserved1;
+    reg32_t ccr1;
+    reg32_t ccr2;
+    reg32_t ccr3;
+    reg32_t ccr4;
+    reg32_t reserved2;
+    reg32_t dcr;
+    reg32_t dmar;
+    reg32_t tim2;
+} TIM_Reg;
+
+namespace tim_cr1{
+    inline constexpr Field<&TIM_Reg::cr1, 0, 1> CEN{};
+    inline constexpr Field<&TIM_Reg::cr1, 2, 1> URS{};
+    inline constexpr Field<&TIM_Reg::cr1, 3, 1> OPM{};
+    inline constexpr Field<&TIM_Reg::cr1, 7, 1> ARPE{};
+}
+
+namespace tim_cr2{
+    inline constexpr Field<&TIM_Reg::cr2, 4, 3> MMS{};
+}
+
+namespace tim_smcr{
+    inline constexpr Field<&TIM_Reg::smcr, 0, 3> SMS{};
+    inline constexpr Field<&TIM_Reg::smcr, 4, 3> TS{};
+}
+
+/// @brief CCMR1 (channels 1, 2) and CCMR2 (channels 3, 4) share layout,
+///         index is channel - 1 & 1, output and input fields overlap
+template<auto CCMR>
+struct TimCcmrFields{
+    static constexpr FieldArray<CCMR, 0, 2, 8, 2> CCS{};
+    static constexpr FieldArray<CCMR, 2, 1, 8, 2> OCFE{};
+    static constexpr FieldArray<CCMR, 3, 1, 8, 2> OCPE{};
+    static constexpr FieldArray<CCMR, 4, 3, 8, 2> OCM{};
+    static constexpr FieldArray<CCMR, 7, 1, 8, 2> OCCE{};
+    static constexpr FieldArray<CCMR, 2, 2, 8, 2> ICPSC{};
+    static constexpr FieldArray<CCMR, 4, 4, 8, 2> ICF{};
+};
+
+/// @brief index is channel - 1
+namespace tim_ccer{
+    inline constexpr FieldArray<&TIM_Reg::ccer, 0, 1, 4, 4> CCE{};
+    inline constexpr FieldArray<&TIM_Reg::ccer, 1, 1, 4, 4> CCP{};
+    inline constexpr FieldArray<&TIM_Reg::ccer, 3, 1, 4, 4> CCNP{};
+}
+
+namespace tim_dcr{
+    inline constexpr Field<&TIM_Reg::dcr, 0, 5> DBA{};
+    inline constexpr Field<&TIM_Reg::dcr, 8, 5> DBL{};
+}
+
+// MMS value, update event is TRGO
+#define TIM_TRGO_UPDATE     0b010
+// SMS value, trigger starts counter
+#define TIM_SLAVE_TRIGGER   0b110
+
+#define TIM_DELAY_HZ    10000
+
+#define TIM_FLAG_UPDATE         (1 << 0)
+/// @brief capture / compare of channel 1..4
+#define TIM_FLAG_CC(channel)    (1 << (channel))
+#define TIM_FLAG_TRIGGER        (1 << 6)
+/// @brief capture of channel 1..4 was lost, CCR was not read in time
+#define TIM_FLAG_OVERCAPTURE(channel)   (1 << (8 + (channel)))
+/// @brief DIER bit of update DMA request
+#define TIM_DMA_UPDATE          (1 << 8)
+/// @brief DMAR burst starts with CCR1 (offset 0x34 / 4)
+#define TIM_DCR_CCR1            13
+
+enum class TimOutputMode{
+    Frozen, ActiveOnMatch, InactiveOnMatch, Toggle,
+    ForceInactive, ForceActive, Pwm1, Pwm2
+};
+enum class TimCaptureEdge{ Rising, Falling, Both };
+
+/// @brief general purpose timers TIM2..TIM5, TIM2/TIM5 have 32 bit
+///         counter, TIM3/TIM4 16 bit, all of them count timer clock of APB1
+class TIM final{
+    uint8_t num;
+
+    template<auto CCMR>
+    void set_ccmr_output(uint8_t index, TimOutputMode mode){
+        typedef TimCcmrFields<CCMR> ccmr;
+        modify(registers, ccmr::CCS[index] = 0, ccmr::OCFE[index] = 0, ccmr::OCPE[index] = 1,
+            ccmr::OCM[index] = static_cast<uint32_t>(mode), ccmr::OCCE[index] = 0);
+    }
+
+    template<auto CCMR>
+    void set_ccmr_input(uint8_t index, uint8_t filter, uint8_t prescaler){
+        typedef TimCcmrFields<CCMR> ccmr;
+        modify(registers, ccmr::CCS[index] = 1, ccmr::ICPSC[index] = prescaler, ccmr::ICF[index] = filter);
+    }
+
+    static bool is_channel(uint8_t channel){
+        return channel >= 1 && channel <= 4;
+    }
+public:    
+    /// @brief nullptr if number passed to constructor is not 2..5
+    TIM_Reg* registers;
+    
+    TIM(uint8_t num) : num(num),
+        registers(num >= 2 && num <= 5
+            ? PERIPHERAL(TIM_Reg, TIM_BASE + (0x400 * (num - 2))) : nullptr) {}
+
+    bool is_valid() const {
+        return registers != nullptr;
+    }
+
+    uint8_t get_num() const {
+        return num;
+    }
+
+    bool is_32bit() const {
+        return num == 2 || num == 5;
+    }
+
+    /// @brief NVIC interrupt number of this timer
+    uint8_t get_irq() const {
+        return num == 5 ? 50 : 26 + num;
+    }
+
+    /// @brief DMA1 stream and channel of update request (TIMx_UP),
+    ///         used for DMA burst
+    uint8_t get_update_dma_stream() const {
+        static const uint8_t streams[] = { 1, 2, 6, 0 };
+        return streams[(num - 2) & 3];
+    }
+
+    uint8_t get_update_dma_channel() const {
+        static const uint8_t channels[] = { 3, 5, 2, 6 };
+        return channels[(num - 2) & 3];
+    }
+
+    static uint32_t get_clock(){
+        return RCC::get_apb1_timer_clock();
+    }
+ 
+    /// @brief counts at TIM_DELAY_HZ, TIM3/TIM4 are 16 bit so
+    ///         they can wait up to 6553 ms
+    void delay(uint32_t milliseconds){
+        stop();
+        init();
+        start();
+        while(registers->cnt < milliseconds * (TIM_DELAY_HZ / 1000));
+        stop();
+    }    
+
+    /// @return 1 if timer number is invalid or 0 if ok
+    uint8_t clock_enable(RCC& rcc){
+        if(!is_valid()) return 1;
+        rcc.registers->apb1enr |= 1 << (num - 2);
+        return 0;
+    }    
+
+    /// @brief free running timer, update event is TRGO for
+    ///         ADC/DAC/other timers, frequency times per second
+    /// @return 1 if frequency is 0 or bigger than timer clock or 0 if ok
+    uint8_t start_trigger(uint32_t frequency){
+        if(!is_valid()) return 1;
+        uint32_t clock = get_clock();
+        if(frequency == 0 || frequency > clock) return 1;
+
+        stop();
+        init();
+        uint32_t ticks = clock / frequency;
+        // 16 bit ARR of TIM3/TIM4 needs prescaler for low rates
+        uint32_t psc = (ticks - 1) >> 16;
+        registers->psc = psc;
+        registers->arr = ticks / (psc + 1) - 1;
+        write_fields(registers, tim_cr2::MMS = TIM_TRGO_UPDATE);
+        registers->egr = 1;
+        start();
+
+        return 0;
+    }
+
+    void start(){
+        modify(registers, tim_cr1::CEN = 1);
+    }    
+
+    void stop(){
+        modify(registers, tim_cr1::CEN = 0);
+    }    
+
+    bool is_running() const {
+        return read_field(registers, tim_cr1::CEN);
+    }
+
+    /// @brief resets timer to stopped up counter, counter runs at
+    ///         timer clock / (prescaler + 1) and wraps after auto_reload,
+    ///         ARR and CCR writes take effect at next update (preload)
+    /// @return 1 if timer is invalid or auto_reload does not fit 16 bit
+    ///         counter of TIM3/TIM4 or 0 if ok
+    uint8_t set_time_base(uint16_t prescaler, uint32_t auto_reload){
+        if(!is_valid()) return 1;
+        if(!is_32bit() && auto_reload > 0xFFFF) return 1;
+
+        stop();
+        // only overflow raises update interrupt / DMA request, not egr
+        write_fields(registers, tim_cr1::ARPE = 1, tim_cr1::URS = 1);
+        registers->cr2 = 0;
+        registers->smcr = 0;
+        registers->dier = 0;
+        registers->psc = prescaler;
+        registers->arr = auto_reload;
+        registers->cnt = 0;
+        registers->egr = 1;
+        registers->sr = 0;
+        return 0;
+    }
+
+    /// @brief counter ticks in one period (ARR + 1)
+    uint32_t get_period() const {
+        return registers->arr + 1;
+    }
+
+    uint32_t get_counter() const {
+        return registers->cnt;
+    }
+
+    /// @brief time base of frequency periods per second with largest
+    ///         resolution which fits the counter, timer is stopped
+    /// @return 1 if frequency is 0, bigger than timer clock or too low
+    ///         for 16 bit prescaler or 0 if ok
+    uint8_t set_frequency(uint32_t frequency){
+        uint32_t clock = get_clock();
+        if(frequency == 0 || frequency > clock) return 1;
+
+        uint32_t ticks = clock / frequency;
+        uint32_t psc = is_32bit() ? 0 : (ticks - 1) >> 16;
+        if(psc > 0xFFFF) return 1;
+        return set_time_base(psc, ticks / (psc + 1) - 1);
+    }
+
+    /// @brief output compare mode of channel 1..4 with CCR preload,
+    ///         output is enabled, pin must use alternate function of timer
+    /// @return 1 if channel is not 1..4 or 0 if ok
+    uint8_t output_enable(uint8_t channel, TimOutputMode mode, bool active_low = false){
+        if(!is_channel(channel)) return 1;
+
+        uint8_t index = (channel - 1) & 1;
+        if(channel <= 2) set_ccmr_output<&TIM_Reg::ccmr1>(index, mode);
+        else set_ccmr_output<&TIM_Reg::ccmr2>(index, mode);
+
+        modify(registers, tim_ccer::CCE[channel - 1] = 1,
+            tim_ccer::CCP[channel - 1] = active_low, tim_ccer::CCNP[channel - 1] = 0);
+        return 0;
+    }
+
+    /// @brief PWM mode 1: output is active while counter < CCR
+    uint8_t pwm_enable(uint8_t channel, bool active_low = false){
+        return output_enable(channel, TimOutputMode::Pwm1, active_low);
+    }
+
+    void channel_disable(uint8_t channel){
+        if(is_channel(channel)) modify(registers, tim_ccer::CCE[channel - 1] = 0);
+    }
+
+    /// @brief CCR of channel, PWM duty is compare / get_period()
+    void set_compare(uint8_t channel, uint32_t compare){
+        if(is_channel(channel)) (&registers->ccr1)[channel - 1] = compare;
+    }
+
+    /// @brief channel 1..4 captures counter on edge of its own input (TIx)
+    /// @param filter 0..15 input filter (ICxF)
+    /// @param prescaler 0..3, capture every 2^prescaler edges
+    /// @return 1 if channel, filter or prescaler is out of range or 0 if ok
+    uint8_t capture_enable(uint8_t channel, TimCaptureEdge edge,
+            uint8_t filter = 0, uint8_t prescaler = 0){
+        if(!is_channel(channel) || filter > 15 || prescaler > 3) return 1;
+
+        // CCxS is writable only while channel is off
+        modify(registers, tim_ccer::CCE[channel - 1] = 0);
+
+        uint8_t index = (channel - 1) & 1;
+        if(channel <= 2) set_ccmr_input<&TIM_Reg::ccmr1>(index, filter, prescaler);
+        else set_ccmr_input<&TIM_Reg::ccmr2>(index, filter, prescaler);
+
+        // CCxP selects falling edge, CCxP + CCxNP both edges
+        modify(registers, tim_ccer::CCE[channel - 1] = 1,
+            tim_ccer::CCP[channel - 1] = edge != TimCaptureEdge::Rising,
+            tim_ccer::CCNP[channel - 1] = edge == TimCaptureEdge::Both);
+        return 0;
+    }
+
+    /// @brief captured counter of channel, reading clears its CC flag
+    uint32_t get_capture(uint8_t channel) const {
+        return (&registers->ccr1)[(channel - 1) & 3];
+    }
+
+    /// @brief one pulse of channel 1..4 after fire() (or trigger):
+    ///         output is inactive for delay ticks then active for pulse
+    ///         ticks, counter stops at update, time base is kept
+    /// @return 1 if channel is invalid, delay is 0, pulse is 0 or
+    ///         both do not fit the counter or 0 if ok
+    uint8_t set_one_pulse(uint8_t channel, uint32_t delay, uint32_t pulse){
+        if(!is_channel(channel) || delay == 0 || pulse == 0) return 1;
+        uint32_t max = is_32bit() ? UINT32_T_MAX : 0xFFFF;
+        if(delay > max || pulse - 1 > max - delay) return 1;
+
+        stop();
+        modify(registers, tim_cr1::OPM = 1);
+        registers->arr = delay + pulse - 1;
+        set_compare(channel, delay);
+        output_enable(channel, TimOutputMode::Pwm2);
+        registers->cnt = 0;
+        registers->egr = 1;
+        return 0;
+    }
+
+    /// @brief starts one pulse, ignored while pulse is running
+    void fire(){
+        start();
+    }
+
+    /// @brief counter (one pulse) starts at edge of input 1 or 2,
+    ///         input polarity is set by capture_enable of that channel
+    /// @return 1 if input is not 1 or 2 or 0 if ok
+    uint8_t set_trigger_input(uint8_t input){
+        if(input != 1 && input != 2) return 1;
+        // TS = TI1FP1 / TI2FP2
+        write_fields(registers, tim_smcr::TS = input == 1 ? 0b101 : 0b110,
+            tim_smcr::SMS = TIM_SLAVE_TRIGGER);
+        return 0;
+    }
+
+    /// @param flags TIM_FLAG_UPDATE, TIM_FLAG_CC(n), TIM_FLAG_TRIGGER
+    ///         or TIM_DMA_UPDATE
+    void interrupt_enable(uint16_t flags){
+        registers->dier |= flags;
+    }
+
+    void interrupt_disable(uint16_t flags){
+        registers->dier &= ~flags;
+    }
+
+    /// @return TIM_FLAG_* bits which are set
+    uint16_t get_flags() const {
+        return registers->sr;
+    }
+
+    /// @brief status bits are cleared by writing zero
+    void clear_flags(uint16_t flags){
+        registers->sr = ~static_cast<uint32_t>(flags);
+    }
+
+    /// @brief must be called from timer interrupt handler
+    /// @return enabled TIM_FLAG_* bits which caused interrupt, they are cleared
+    uint16_t irq_handler(){
+        uint16_t flags = get_flags() & registers->dier & 0x5F;
+        clear_flags(flags);
+        return flags;
+    }
+
+    /// @brief every update event DMA writes channels CCRs starting with
+    ///         CCR of first_channel from table through DMAR, table keeps
+    ///         periods rows of channels words and is repeated (circular),
+    ///         CCRs are preloaded so row n is output in period n + 1
+    /// @param dma DMA1 stream of get_update_dma_stream(), clock enabled
+    /// @return 1 if channels are out of range or table is too long or 0 if ok
+    uint8_t dma_burst_start(DMA& dma, const uint32_t* table, uint16_t periods,
+            uint8_t first_channel = 1, uint8_t channels = 4){
+        if(!is_channel(first_channel) || channels == 0 || first_channel + channels > 5) return 1;
+        if(periods == 0 || periods * channels > 0xFFFF) return 1;
+
+        registers->dier &= ~TIM_DMA_UPDATE;
+        dma.disable();
+        dma.clear_flags(DMA_FLAGS_ALL);
+        dma.configure(get_update_dma_channel(), DmaDirection::MemoryToPeripheral,
+            DmaSize::Word, DmaSize::Word, true);
+        dma.set_peripheral_address(&registers->dmar);
+        dma.set_memory0(table);
+        dma.set_count(periods * channels);
+        dma.enable_circular();
+        dma.enable();
+
+        write_fields(registers, tim_dcr::DBL = channels - 1, tim_dcr::DBA = TIM_DCR_CCR1 + first_channel - 1);
+        registers->dier |= TIM_DMA_UPDATE;
+        return 0;
+    }
+
+    void dma_burst_stop(DMA& dma){
+        registers->dier &= ~TIM_DMA_UPDATE;
+        dma.disable();
+    }
+private:    
+    void init(){
+        registers->cr1 = 0;
+        registers->cr2 = 0;
+        registers->smcr = 0;
+        registers->dier = 0;
+        // PSC is 16 bit, timer clock / 1000 does not fit
+        registers->psc = get_clock() / TIM_DELAY_HZ - 1;
+        registers->arr = UINT32_T_MAX;
+        registers->cnt = 0;
+        registers->egr = 1;
+    }    
+};    
+
+#define ADC1_DMA_STREAM         0
+#define ADC1_DMA_CHANNEL        0
+#define ADC_VREFINT_CHANNEL     17
+#define ADC_TEMPERATURE_CHANNEL 18
+#define ADC_MAX_HZ              36000000
+// EXTSEL value of regular group
+#define ADC_TRIGGER_TIM2_TRGO   0b0110
+// factory calibration, raw 12 bit values at VDDA = 3.3 V
+#define ADC_VREFINT_CAL         0x1FFF7A2A
+#define ADC_TS_CAL1             0x1FFF7A2C
+#define ADC_TS_CAL2             0x1FFF7A2E
+
+enum class AdcSampleTime{
+    Cycles3, Cycles15, Cycles28, Cycles56, Cycles84, Cycles112, Cycles144, Cycles480
+};
+
+typedef struct {
+    reg32_t sr;
+    reg32_t cr1;
+    reg32_t cr2;
+    reg32_t smpr1;
+    reg32_t smpr2;
+    reg32_t jofr[4];
+    reg32_t htr;
+    reg32_t ltr;
+    reg32_t sqr1;
+    reg32_t sqr2;
+    reg32_t sqr3;
+    reg32_t jsqr;
+    reg32_t jdr[4];
+    reg32_t dr;
+} ADC_Reg;
+
+typedef struct {
+    reg32_t csr;
+    reg32_t ccr;
+    reg32_t cdr;
+} ADC_Common_Reg;
+
+/// @brief ADC1, 12 bit, regular group only
+class ADC final{
+public:
+    ADC_Reg* registers;
+    ADC_Common_Reg* common;
+
+    ADC() : registers(PERIPHERAL(ADC_Reg, ADC1_BASE)),
+        common(PERIPHERAL(ADC_Common_Reg, ADC_COMMON_BASE)) {}
+
+    void clock_enable(RCC& rcc){
+        rcc.registers->apb2enr |= 1 << 8;
+    }
+
+    /// @brief smallest PCLK2 divider (2, 4, 6, 8) keeping ADC clock
+    ///         under ADC_MAX_HZ, call again after clock change
+    void update_clock(){
+        uint32_t divider = 0;
+        while(divider < 3 && RCC::get_pclk2() / ((divider + 1) * 2) > ADC_MAX_HZ) divider++;
+        common->ccr = (common->ccr & ~(0b11 << 16)) | (divider << 16);
+    }
+
+    uint32_t get_clock() const {
+        return RCC::get_pclk2() / ((((common->ccr >> 16) & 0b11) + 1) * 2);
+    }
+
+    void enable(){
+        registers->cr2 |= 1;
+    }
+
+    void disable(){
+        registers->cr2 &= ~1;
+    }
+
+    /// @brief connects temperature sensor (ADC_TEMPERATURE_CHANNEL) and
+    ///         VREFINT (ADC_VREFINT_CHANNEL), both need >= 10 us sampling
+    void enable_internal_channels(){
+        common->ccr |= 1 << 23;
+    }
+
+    void disable_internal_channels(){
+        common->ccr &= ~(1 << 23);
+    }
+
+    /// @param channel 0..18
+    /// @return 1 if channel is bigger than 18 or 0 if ok
+    uint8_t set_sample_time(uint8_t channel, AdcSampleTime time){
+        if(channel > 18) return 1;
+
+        reg32_t& smpr = channel < 10 ? registers->smpr2 : registers->smpr1;
+        uint8_t shift = (channel % 10) * 3;
+        smpr = (smpr & ~(0b111 << shift)) | (static_cast<uint32_t>(time) << shift);
+
+        return 0;
+    }
+
+    /// @brief regular sequence, converted in given order
+    /// @param count 1..16
+    /// @return 1 if count or any channel is out of range or 0 if ok
+    uint8_t set_sequence(const uint8_t* channels, uint8_t count){
+        if(count == 0 || count > 16) return 1;
+        for(uint8_t i = 0; i < count; i++)
+            if(channels[i] > 18) return 1;
+
+        uint32_t sqr[3] = { (count - 1u) << 20, 0, 0 };
+        for(uint8_t i = 0; i < count; i++){
+            // SQ1..SQ6 in sqr3, SQ7..SQ12 in sqr2, SQ13..SQ16 in sqr1
+            sqr[2 - i / 6] |= channels[i] << ((i % 6) * 5);
+        }
+        registers->sqr1 = sqr[0];
+        registers->sqr2 = sqr[1];
+        registers->sqr3 = sqr[2];
+
+        return 0;
+    }
+
+    /// @brief scan of regular sequence on every rising edge of
+    ///         trigger (ADC_TRIGGER_*), results go to DMA
+    void configure_triggered_scan(uint8_t trigger){
+        registers->cr1 = 1 << 8;
+        registers->cr2 = (registers->cr2 & 1)
+            | (0b01 << 28) | ((trigger & 0xF) << 24) | (1 << 9) | (1 << 8);
+    }
+
+    /// @brief circular DMA of halfwords, buffer keeps count results,
+    ///         half transfer and transfer complete interrupts are enabled
+    /// @param dma DMA2 stream ADC1_DMA_STREAM, clock must be enabled
+    void dma_start(DMA& dma, uint16_t* buffer, uint16_t count){
+        dma.disable();
+        dma.clear_flags(DMA_FLAGS_ALL);
+        dma.configure(ADC1_DMA_CHANNEL, DmaDirection::PeripheralToMemory,
+                DmaSize::HalfWord, DmaSize::HalfWord, true);
+        dma.set_peripheral_address(&registers->dr);
+        dma.set_memory0(buffer);
+        dma.set_count(count);
+        dma.enable_circular();
+        dma.interrupt_ht_enable();
+        dma.interrupt_tc_enable();
+        dma.interrupt_te_enable();
+
+        // clear overrun, DMA requests stop after it
+        registers->sr = ~(1 << 5);
+        dma.enable();
+    }
+
+    void dma_stop(DMA& dma){
+        dma.disable();
+        registers->cr2 &= ~((1 << 8) | (0b11 << 28));
+    }
+
+    bool is_overrun() const {
+        return registers->sr & (1 << 5);
+    }
+
+    /// @brief single software conversion, sequence is replaced
+    uint16_t read(uint8_t channel){
+        set_sequence(&channel, 1);
+        registers->cr1 = 0;
+        registers->cr2 = (registers->cr2 & 1) | (1 << 10);
+        registers->cr2 |= 1 << 30;
+        while((registers->sr & (1 << 1)) == 0);
+
+        return registers->dr;
+    }
+
+    static uint16_t get_vrefint_cal(){
+        return *PERIPHERAL(reg32_t, ADC_VREFINT_CAL & ~3) >> 16;
+    }
+
+    static uint16_t get_ts_cal1(){
+        return *PERIPHERAL(reg32_t, ADC_TS_CAL1) & 0xFFFF;
+    }
+
+    static uint16_t get_ts_cal2(){
+        return *PERIPHERAL(reg32_t, ADC_TS_CAL2 & ~3) >> 16;
+    }
+
+    /// @brief temperature from sensor and VREFINT results taken with
+    ///         same resolution (scale times 12 bit, oversampled sums)
+    /// @return hundredths of degree Celsius
+    static int temperature(uint32_t sensor, uint32_t vrefint, uint32_t scale = 1){
+        uint32_t cal1 = get_ts_cal1() * scale;
+        uint32_t cal2 = get_ts_cal2() * scale;
+        uint32_t vref_cal = get_vrefint_cal() * scale;
+
+        // rescale to VDDA = 3.3 V of calibration
+        if(vrefint != 0 && vref_cal != 0) sensor = sensor * vref_cal / vrefint;
+
+        // no calibration: V25 = 0.76 V, 2.5 mV per degree
+        if(cal2 <= cal1){
+            int millivolts = static_cast<int>(sensor * 3300 / (4095 * scale));
+            return 2500 + (millivolts - 760) * 40;
+        }
+
+        int delta = static_cast<int>(sensor) - static_cast<int>(cal1);
+        return 3000 + delta * 8000 / static_cast<int>(cal2 - cal1);
+    }
+};
+
+#include "spsc_queue.hpp"
+
 enum class DataBits{ Eight, Nine };
 enum class WakeTrigger{ Idle, Address_Mask };
 enum class Parity{ None, Even, Odd };
 enum class StopBits{ Half, One, OneAndHalf, Two };
 typedef struct {
-    volatile uint32_t sr;
-    volatile uint32_t dr;
-    volatile uint32_t brr;
-    volatile uint32_t cr1;
-    volatile uint32_t cr2;
-    volatile uint32_t cr3;
-    volatile uint32_t gtpr;
+    reg32_t sr;
+    reg32_t dr;
+    reg32_t brr;
+    reg32_t cr1;
+    reg32_t cr2;
+    reg32_t cr3;
+    reg32_t gtpr;
 } USART_Reg;
 
+namespace usart_cr1{
+    inline constexpr Field<&USART_Reg::cr1, 0, 1> SBK{};
+    inline constexpr Field<&USART_Reg::cr1, 1, 1> RWU{};
+    inline constexpr Field<&USART_Reg::cr1, 2, 1> RE{};
+    inline constexpr Field<&USART_Reg::cr1, 3, 1> TE{};
+    inline constexpr Field<&USART_Reg::cr1, 4, 1> IDLEIE{};
+    inline constexpr Field<&USART_Reg::cr1, 5, 1> RXNEIE{};
+    inline constexpr Field<&USART_Reg::cr1, 6, 1> TCIE{};
+    inline constexpr Field<&USART_Reg::cr1, 7, 1> TXEIE{};
+    inline constexpr Field<&USART_Reg::cr1, 8, 1> PEIE{};
+    inline constexpr Field<&USART_Reg::cr1, 9, 1> PS{};
+    inline constexpr Field<&USART_Reg::cr1, 10, 1> PCE{};
+    inline constexpr Field<&USART_Reg::cr1, 11, 1> WAKE{};
+    inline constexpr Field<&USART_Reg::cr1, 12, 1> M{};
+    inline constexpr Field<&USART_Reg::cr1, 13, 1> UE{};
+    inline constexpr Field<&USART_Reg::cr1, 15, 1> OVER8{};
+}
+
+namespace usart_cr2{
+    inline constexpr Field<&USART_Reg::cr2, 12, 2> STOP{};
+    inline constexpr Field<&USART_Reg::cr2, 14, 1> LINEN{};
+}
+
+namespace usart_cr3{
+    inline constexpr Field<&USART_Reg::cr3, 5, 1> SCEN{};
+    inline constexpr Field<&USART_Reg::cr3, 6, 1> DMAR{};
+    inline constexpr Field<&USART_Reg::cr3, 7, 1> DMAT{};
+}
+
+/// @brief constants of one USART of stm32F401
+struct UsartInstance{
+    uint8_t num;
+    uint32_t base;
+    uint8_t irq;
+    /// @brief APB2 (USART1, USART6) or APB1 (USART2)
+    bool apb2;
+    /// @brief bit of apb1enr/apb2enr
+    uint8_t enable_bit;
+    uint8_t dma;
+    uint8_t dma_channel;
+    uint8_t dma_rx_stream;
+    uint8_t dma_tx_stream;
+    /// @brief GPIO alternate function of tx and rx pins
+    uint8_t alternate_function;
+};
+
+inline constexpr UsartInstance usart_instances[] = {
+    { 1, USART1_BASE, USART1_IRQ, true, 4, 2,
+        USART1_DMA_CHANNEL, USART1_DMA_RX_STREAM, USART1_DMA_TX_STREAM, 7 },
+    { 2, USART2_BASE, USART2_IRQ, false, 17, 1,
+        USART2_DMA_CHANNEL, USART2_DMA_RX_STREAM, USART2_DMA_TX_STREAM, 7 },
+    { 6, USART6_BASE, USART6_IRQ, true, 5, 2,
+        USART6_DMA_CHANNEL, USART6_DMA_RX_STREAM, USART6_DMA_TX_STREAM, 8 },
+};
+
+/// @return nullptr if there is no USART num
+constexpr const UsartInstance* find_usart(uint8_t num){
+    for(const UsartInstance& instance : usart_instances)
+        if(instance.num == num) return &instance;
+    return nullptr;
+}
+
+// Baud rate divider: BRR from bit time in bus clock cycles, OVER8 only
+// when OVER16 can't reach the rate.
+
+// default tolerance of rate error on one side of the link
+#define USART_BAUD_MAX_ERROR_PPM    10000
+
+struct UsartBaud{
+    uint16_t brr;
+    bool over8;
+};
+
+/// @brief bus clock cycles of one bit
+constexpr uint32_t usart_bit_cycles(uint32_t clock, uint32_t baud){
+    return (clock + baud / 2) / baud;
+}
+
+/// @brief OVER8 needs 8 cycles per bit, BRR has 16 bits
+constexpr bool usart_baud_reachable(uint32_t clock, uint32_t baud){
+    return baud != 0 && usart_bit_cycles(clock, baud) >= 8
+        && usart_bit_cycles(clock, baud) <= 0xFFFF;
+}
+
+/// @brief divider of reachable baud, OVER8 BRR has 3 fraction bits
+constexpr UsartBaud usart_baud(uint32_t clock, uint32_t baud){
+    uint32_t cycles = usart_bit_cycles(clock, baud);
+    if(cycles >= 16) return UsartBaud{ static_cast<uint16_t>(cycles), false };
+    return UsartBaud{ static_cast<uint16_t>(((cycles >> 3) << 4) | (cycles & 0b111)), true };
+}
+
+/// @brief deviation of real rate from baud in ppm, UINT32_T_MAX if baud
+///         is not reachable, 64 bit math, meant for constant expressions
+constexpr uint32_t usart_baud_error_ppm(uint32_t clock, uint32_t baud){
+    if(!usart_baud_reachable(clock, baud)) return UINT32_T_MAX;
+    uint64_t nominal = static_cast<uint64_t>(usart_bit_cycles(clock, baud)) * baud;
+    uint64_t difference = nominal > clock ? nominal - clock : clock - nominal;
+    return difference * 1000000 / nominal;
+}
+
+/// @brief run time check with 32 bit math, max_ppm up to 40000
+constexpr bool usart_baud_within(uint32_t clock, uint32_t baud, uint32_t max_ppm){
+    if(!usart_baud_reachable(clock, baud)) return false;
+    uint32_t nominal = usart_bit_cycles(clock, baud) * baud;
+    uint32_t difference = nominal > clock ? nominal - clock : clock - nominal;
+    return difference <= nominal / 1000 * max_ppm / 1000;
+}
+
+/// @brief divider checked at compile time
+/// @tparam CLOCK bus clock of the USART (USART::get_clock())
+template<uint32_t CLOCK, uint32_t BAUD, uint32_t MAX_ERROR_PPM = USART_BAUD_MAX_ERROR_PPM>
+constexpr UsartBaud usart_baud_checked(){
+    static_assert(usart_baud_reachable(CLOCK, BAUD), "baud rate needs 8..65535 clock cycles per bit");
+    static_assert(usart_baud_error_ppm(CLOCK, BAUD) <= MAX_ERROR_PPM, "baud rate error is above tolerance");
+    return usart_baud(CLOCK, BAUD);
+}
+
 class USART final{
+    const UsartInstance* instance;
 public:
     GPIO tx, rx;
+    /// @brief nullptr if number passed to constructor is not 1, 2 or 6
     USART_Reg* usart_registers;
 
-    USART(uint8_t tx_num, char tx_letter, uint8_t rx_num, char rx_letter){
-        usart_registers = reinterpret_cast<USART_Reg*>(USART1_BASE);
-        tx = GPIO(tx_num, tx_letter);
-        rx = GPIO(rx_num, rx_letter);
+    SpscQueue<uint8_t, USART_TX_BUFFER_SIZE> tx_buffer;
+    SpscQueue<uint8_t, USART_RX_BUFFER_SIZE> rx_buffer;
+    /// @brief bytes lost because rx_buffer was full
+    volatile uint32_t rx_dropped = 0;
+    /// @brief line errors of received bytes (SR FE, NF, ORE, PE),
+    ///         counted in interrupt driven mode
+    volatile uint32_t framing_errors = 0;
+    volatile uint32_t noise_errors = 0;
+    volatile uint32_t overruns = 0;
+    volatile uint32_t parity_errors = 0;
+
+    /// @param num USART 1, 2 or 6, pins must use its alternate function
+    USART(uint8_t num, uint8_t tx_num, char tx_letter, uint8_t rx_num, char rx_letter) :
+        instance(find_usart(num)), tx(tx_num, tx_letter), rx(rx_num, rx_letter),
+        usart_registers(instance != nullptr ? PERIPHERAL(USART_Reg, instance->base) : nullptr) {}
+
+    bool is_valid() const {
+        return instance != nullptr;
+    }
+
+    /// @return 0 if USART number is invalid
+    uint8_t get_num() const {
+        return is_valid() ? instance->num : 0;
+    }
+
+    /// @brief NVIC interrupt number of this USART
+    /// @return 0xFF if USART number is invalid
+    uint8_t get_irq() const {
+        return is_valid() ? instance->irq : 0xFF;
+    }
+
+    /// @brief bus clock which BRR divides, 0 if USART number is invalid
+    uint32_t get_clock() const {
+        if(!is_valid()) return 0;
+        return instance->apb2 ? RCC::get_pclk2() : RCC::get_pclk1();
+    }
+
+    /// @brief DMA controller (1..2) of rx and tx streams,
+    ///         0 if USART number is invalid
+    uint8_t get_dma() const {
+        return is_valid() ? instance->dma : 0;
+    }
+
+    uint8_t get_dma_rx_stream() const {
+        return is_valid() ? instance->dma_rx_stream : 0;
+    }
+
+    uint8_t get_dma_tx_stream() const {
+        return is_valid() ? instance->dma_tx_stream : 0;
+    }
+
+    uint8_t get_alternate_function() const {
+        return is_valid() ? instance->alternate_function : 0;
     }
 
     bool is_tx_empty() const {
@@ -533,6 +2577,7 @@ public:
     }
     
     void sync_write_buf(void* buf, uint8_t len){
+        PROFILE_ZONE(ZoneUsartWrite);
         sync();
         
         for(int i = 0; i < len; i++){
@@ -544,12 +2589,116 @@ public:
         while(!is_transmition_complete());
     }
 
+    /// @brief switch to interrupt driven mode, after that
+    ///         write() and read() never block
+    void async_enable(NVIC& nvic){
+        interrupt_rxne_enable();
+        nvic.enable_interrupt(get_irq());
+    }
+
+    /// @brief queue bytes for transmission, returns immediately
+    /// @return count of queued bytes, less than len if tx buffer is full
+    uint32_t write(const void* buf, uint32_t len){
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(buf);
+        uint32_t count = tx_buffer.push(bytes, len);
+        if(count != 0) interrupt_txe_enable();
+
+        return count;
+    }
+
+    /// @brief take already received bytes, returns immediately
+    /// @return count of bytes written to buf
+    uint32_t read(void* buf, uint32_t max){
+        return rx_buffer.pop(reinterpret_cast<uint8_t*>(buf), max);
+    }
+
+    uint32_t get_line_errors() const {
+        return framing_errors + noise_errors + overruns + parity_errors;
+    }
+
+    /// @brief true when tx buffer is drained and last byte left the shift register
+    bool is_tx_idle() const {
+        return is_transmition_complete() && tx_buffer.is_empty();
+    }
+
+    /// @brief must be called from interrupt handler of this USART
+    void irq_handler(){
+        uint32_t sr = usart_registers->sr;
+
+        // RXNE or ORE, reading dr clears both and error flags
+        // of the byte (read of sr, then dr)
+        if(sr & ((1 << 5) | (1 << 3))){
+            if(sr & (1 << 1)) framing_errors = framing_errors + 1;
+            if(sr & (1 << 2)) noise_errors = noise_errors + 1;
+            if(sr & (1 << 3)) overruns = overruns + 1;
+            if(sr & (1 << 0)) parity_errors = parity_errors + 1;
+            uint8_t byte = usart_registers->dr;
+            if(!rx_buffer.push(byte)) rx_dropped = rx_dropped + 1;
+        }
+
+        if((sr & (1 << 7)) && read_field(usart_registers, usart_cr1::TXEIE)){
+            uint8_t byte;
+            if(tx_buffer.pop(byte)) usart_registers->dr = byte;
+            else interrupt_txe_disable();
+        }
+    }
+
+    /// @brief start double buffered reception, bytes land in buf0 then
+    ///         buf1 then buf0 again... without cpu, on transfer complete
+    ///         interrupt the buffer which is not DMA::current_target() is full
+    /// @param dma stream get_dma_rx_stream() of get_dma(), clock must be enabled
+    void dma_rx_start(DMA& dma, uint8_t* buf0, uint8_t* buf1, uint16_t len){
+        dma.disable();
+        dma.clear_flags(DMA_FLAGS_ALL);
+        dma.configure(instance->dma_channel, DmaDirection::PeripheralToMemory,
+                DmaSize::Byte, DmaSize::Byte, true);
+        dma.set_peripheral_address(&usart_registers->dr);
+        dma.set_memory0(buf0);
+        dma.set_memory1(buf1);
+        dma.set_count(len);
+        dma.enable_double_buffer();
+        dma.interrupt_tc_enable();
+        dma.interrupt_te_enable();
+
+        interrupt_rxne_disable();
+        rx_enable_dma();
+        dma.enable();
+    }
+
+    void dma_rx_stop(DMA& dma){
+        dma.disable();
+        rx_disable_dma();
+    }
+
+    /// @brief send buf without copying, buf must stay untouched
+    ///         until dma reports transfer complete
+    /// @param dma stream get_dma_tx_stream() of get_dma(), clock must be enabled
+    /// @return 1 if previous transfer is still in progress or 0 if ok
+    uint8_t dma_write(DMA& dma, const void* buf, uint16_t len){
+        if(dma.is_enabled()) return 1;
+
+        dma.clear_flags(DMA_FLAGS_ALL);
+        dma.configure(instance->dma_channel, DmaDirection::MemoryToPeripheral,
+                DmaSize::Byte, DmaSize::Byte, true);
+        dma.set_peripheral_address(&usart_registers->dr);
+        dma.set_memory0(buf);
+        dma.set_count(len);
+        dma.interrupt_tc_enable();
+        dma.interrupt_te_enable();
+
+        usart_registers->sr = ~(1 << 6);
+        tx_enable_dma();
+        dma.enable();
+
+        return 0;
+    }
+
     void tx_enable(){
-        usart_registers->cr1 |= 1 << 3;
+        modify(usart_registers, usart_cr1::TE = 1);
     }
     
     void tx_disable(){
-        usart_registers->cr1 &= ~(1 << 3);
+        modify(usart_registers, usart_cr1::TE = 0);
     }
 
     bool is_rx_empty() const {
@@ -567,47 +2716,51 @@ public:
     }
     
     void rx_enable(){
-        usart_registers->cr1 |= 1 << 2;
+        modify(usart_registers, usart_cr1::RE = 1);
     }
     
     void rx_disable(){
-        usart_registers->cr1 &= ~(1 << 2);
+        modify(usart_registers, usart_cr1::RE = 0);
     }
 
     void sleep(){
-        usart_registers->cr1 |= 1 << 1;
+        modify(usart_registers, usart_cr1::RWU = 1);
     }
 
     void wake(){
-        usart_registers->cr1 &= ~(1 << 1);
+        modify(usart_registers, usart_cr1::RWU = 0);
     }
 
     void rx_enable_dma(){
-        usart_registers->cr3 |= 1 << 6;
+        modify(usart_registers, usart_cr3::DMAR = 1);
     }
 
     void rx_disable_dma(){
-        usart_registers->cr3 &= ~(1 << 6);
+        modify(usart_registers, usart_cr3::DMAR = 0);
     }
     
     void set_break(){
-        usart_registers->cr1 |= 1;
+        modify(usart_registers, usart_cr1::SBK = 1);
     }
 
     void tx_enable_dma(){
-        usart_registers->cr3 |= 1 << 7;
+        modify(usart_registers, usart_cr3::DMAT = 1);
     }
 
     void tx_disable_dma(){
-        usart_registers->cr3 &= ~(1 << 7);
+        modify(usart_registers, usart_cr3::DMAT = 0);
     }
 
     void clear_data_reg(){
         usart_registers->dr = 0;
     }
 
-    void clock_enable(RCC& rcc){
-        rcc.registers->apb2enr |= 1 << 4;
+    /// @return 1 if USART number is invalid or 0 if ok
+    uint8_t clock_enable(RCC& rcc){
+        if(!is_valid()) return 1;
+        if(instance->apb2) rcc.registers->apb2enr |= 1 << instance->enable_bit;
+        else rcc.registers->apb1enr |= 1 << instance->enable_bit;
+        return 0;
     }
 
     bool is_transmition_complete() const {
@@ -622,134 +2775,141 @@ public:
         return (usart_registers->sr >> 9) & 1;
     }
 
-    void set_baud_rate(float bauds){
-        usart_registers->cr1 &= ~(1 << 15);
+    /// @brief rate of last set_baud_rate()
+    uint32_t baud_rate = 0;
 
-        float div = 84000000.0 / bauds;
-        uint16_t mantissa = div;
-        uint32_t fraction = (div - mantissa) * 16 + 0.5;
-        
-        if (fraction >= 0xF) {
-            mantissa += 1;
-            fraction = 0;
-        }
-        
-        usart_registers->brr = (mantissa << 4) | (fraction & 0xF);
+    /// @brief divider from current bus clock (get_clock()), OVER8 only
+    ///         when OVER16 can't reach bauds, USART must be disabled
+    /// @return 1 if bauds can't be reached or 0 if ok
+    uint8_t set_baud_rate(uint32_t bauds){
+        if(!usart_baud_reachable(get_clock(), bauds)) return 1;
+        apply_baud(usart_baud(get_clock(), bauds));
+        baud_rate = bauds;
+        return 0;
+    }
+
+    /// @brief divider computed and checked at compile time, CLOCK
+    ///         must be get_clock() of configuration in use
+    template<uint32_t CLOCK, uint32_t BAUD, uint32_t MAX_ERROR_PPM = USART_BAUD_MAX_ERROR_PPM>
+    void set_baud_rate(){
+        constexpr UsartBaud baud = usart_baud_checked<CLOCK, BAUD, MAX_ERROR_PPM>();
+        apply_baud(baud);
+        baud_rate = BAUD;
+    }
+
+    void apply_baud(UsartBaud baud){
+        modify(usart_registers, usart_cr1::OVER8 = baud.over8);
+        usart_registers->brr = baud.brr;
+    }
+
+    /// @brief keeps baud rate after RCC clock change
+    void update_clock(){
+        if(baud_rate != 0) set_baud_rate(baud_rate);
     }
 
     void enable_usart(){
-        usart_registers->cr1 |= 1 << 13;
+        modify(usart_registers, usart_cr1::UE = 1);
     }
     
     void disable_usart(){
-        usart_registers->cr1 &= ~(1 << 13);
+        modify(usart_registers, usart_cr1::UE = 0);
+    }
+
+    /// @brief enables USART with transmitter and receiver as given,
+    ///         one CR1 access
+    void enable_usart(bool transmitter, bool receiver){
+        modify(usart_registers, usart_cr1::TE = transmitter, usart_cr1::RE = receiver, usart_cr1::UE = 1);
     }
 
     void set_data_bits(DataBits data_bits){
-        switch (data_bits) {
-        case DataBits::Eight:
-            usart_registers->cr1 &= ~(1 << 12);
-            return;
-        case DataBits::Nine:
-            usart_registers->cr1 |= 1 << 12;
-        }
+        modify(usart_registers, usart_cr1::M = data_bits == DataBits::Nine);
     }
 
+    /// @brief WAKE is 0 for idle line, 1 for address mark
     void set_wake_trigger(WakeTrigger trigger){
-        switch (trigger) {
-        case WakeTrigger::Idle:
-            usart_registers->cr1 |= 1 << 11;
-            return;
-        case WakeTrigger::Address_Mask:
-            usart_registers->cr1 &= ~(1 << 11);
-        }
+        modify(usart_registers, usart_cr1::WAKE = trigger == WakeTrigger::Address_Mask);
     }
 
     void configure_parity(Parity parity){
-        switch (parity) {
-        case Parity::None:
-            usart_registers->cr1 &= ~(1 << 10);   
-            return;     
-        case Parity::Even:
-            usart_registers->cr1 |= 1 << 10;
-            usart_registers->cr1 &= ~(1 << 9);
-            return;
-        case Parity::Odd:
-            usart_registers->cr1 |= 1 << 10;
-            usart_registers->cr1 |= 1 << 9;
-        }
+        modify(usart_registers, usart_cr1::PCE = parity != Parity::None,
+            usart_cr1::PS = parity == Parity::Odd);
+    }
+
+    /// @brief data bits, parity and stop bits in one CR1 and one
+    ///         CR2 access, USART must be disabled
+    void set_frame_format(DataBits data_bits, Parity parity, StopBits stop_bits){
+        modify(usart_registers, usart_cr1::M = data_bits == DataBits::Nine,
+            usart_cr1::PCE = parity != Parity::None, usart_cr1::PS = parity == Parity::Odd);
+        modify(usart_registers, usart_cr2::STOP = stop_bits_field(stop_bits));
     }
 
     void interrupt_pe_enable(){
-        usart_registers->cr1 |= 1 << 8;
+        modify(usart_registers, usart_cr1::PEIE = 1);
     }
 
     void interrupt_pe_disable(){
-        usart_registers->cr1 &= ~(1 << 8);
+        modify(usart_registers, usart_cr1::PEIE = 0);
     }
     
     void interrupt_txe_enable(){
-        usart_registers->cr1 |= 1 << 7;
+        modify(usart_registers, usart_cr1::TXEIE = 1);
     }
 
     void interrupt_txe_disable(){
-        usart_registers->cr1 &= ~(1 << 7);
+        modify(usart_registers, usart_cr1::TXEIE = 0);
     }
     
     void interrupt_tc1_enable(){
-        usart_registers->cr1 |= 1 << 6;
+        modify(usart_registers, usart_cr1::TCIE = 1);
     }
 
     void interrupt_tc1_disable(){
-        usart_registers->cr1 &= ~(1 << 6);
+        modify(usart_registers, usart_cr1::TCIE = 0);
     }
 
     void interrupt_rxne_enable(){
-        usart_registers->cr1 |= 1 << 5;
+        modify(usart_registers, usart_cr1::RXNEIE = 1);
     }
 
     void interrupt_rxne_disable(){
-        usart_registers->cr1 &= ~(1 << 5);
+        modify(usart_registers, usart_cr1::RXNEIE = 0);
     }
 
     void interrupt_idle_enable(){
-        usart_registers->cr1 |= 1 << 4;
+        modify(usart_registers, usart_cr1::IDLEIE = 1);
     }
 
     void interrupt_idle_disable(){
-        usart_registers->cr1 &= ~(1 << 4);
+        modify(usart_registers, usart_cr1::IDLEIE = 0);
     }
     
     void lin_mode_enable(){
-        usart_registers->cr2 |= 1 << 15;
+        modify(usart_registers, usart_cr2::LINEN = 1);
     }
 
     void lin_mode_disable(){
-        usart_registers->cr2 &= ~(1 << 15);
+        modify(usart_registers, usart_cr2::LINEN = 0);
     }
 
     void set_stop_bits(StopBits stop_bits){
-        usart_registers->cr2 &= ~(0b11 << 12);
+        modify(usart_registers, usart_cr2::STOP = stop_bits_field(stop_bits));
+    }
 
+    /// @brief STOP value: 00 - 1, 01 - 0.5, 10 - 2, 11 - 1.5
+    static constexpr uint32_t stop_bits_field(StopBits stop_bits){
         switch (stop_bits) {
-        case StopBits::Half:
-            usart_registers->cr2 |= 1 << 12;
-            return;        
-        case StopBits::One:
-            return;
-        case StopBits::Two:
-            usart_registers->cr2 |= 0b10 << 12;
-            return;
-        case StopBits::OneAndHalf:
-            usart_registers->cr2 |= 0b11 << 12;
+        case StopBits::Half:        return 0b01;
+        case StopBits::Two:         return 0b10;
+        case StopBits::OneAndHalf:  return 0b11;
+        default:                    return 0b00;
         }
     }
     
     void smatcard_enable(){
-        usart_registers->cr3 |= 1 << 5;
+        modify(usart_registers, usart_cr3::SCEN = 1);
     }
 
     void smatcard_disable(){
-        usart_registers->cr3 &= ~(1 << 5);
+        modify(usart_registers, usart_cr3::SCEN = 0);
     }
 };
\ No newline at end of file
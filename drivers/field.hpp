@@ -0,0 +1,99 @@
+#pragma once
+
+// Register fields: Field<REG, OFFSET, WIDTH> names bits of register REG
+// (member pointer of its *_Reg struct), modify() applies fields of one
+// register with one read and one write.
+//
+//   modify(usart_registers, usart_cr1::UE = 1, usart_cr1::TE = 1);
+//
+// Included by driver.hpp after its integer typedefs.
+
+template<typename MEMBER>
+struct RegisterOf;
+
+/// @brief *_Reg struct of register member pointer
+template<typename PARENT, typename REGISTER>
+struct RegisterOf<REGISTER PARENT::*>{
+    typedef PARENT Parent;
+};
+
+template<auto REG>
+using RegisterParent = typename RegisterOf<decltype(REG)>::Parent;
+
+template<auto REG>
+struct FieldValue{
+    uint32_t mask;
+    uint32_t bits;
+};
+
+template<auto REG, uint8_t OFFSET, uint8_t WIDTH>
+struct Field{
+    static_assert(WIDTH >= 1 && OFFSET + WIDTH <= 32, "field must fit 32 bit register");
+
+    /// @brief largest value of field
+    static constexpr uint32_t max = WIDTH == 32 ? UINT32_T_MAX : (1u << WIDTH) - 1;
+    static constexpr uint32_t mask = max << OFFSET;
+
+    constexpr FieldValue<REG> operator=(uint32_t value) const {
+        return FieldValue<REG>{ mask, (value << OFFSET) & mask };
+    }
+
+    static constexpr uint32_t extract(uint32_t value){
+        return (value & mask) >> OFFSET;
+    }
+};
+
+/// @brief COUNT fields of WIDTH bits, first at OFFSET, next STRIDE bits higher
+template<auto REG, uint8_t OFFSET, uint8_t WIDTH, uint8_t STRIDE, uint8_t COUNT>
+struct FieldArray{
+    static_assert(WIDTH >= 1 && STRIDE >= WIDTH && COUNT >= 1, "fields must not overlap");
+    static_assert(OFFSET + STRIDE * (COUNT - 1) + WIDTH <= 32, "fields must fit 32 bit register");
+
+    static constexpr uint32_t max = Field<REG, OFFSET, WIDTH>::max;
+
+    struct Entry{
+        uint8_t shift;
+
+        constexpr FieldValue<REG> operator=(uint32_t value) const {
+            return FieldValue<REG>{ max << shift, (value & max) << shift };
+        }
+
+        constexpr uint32_t extract(uint32_t value) const {
+            return (value >> shift) & max;
+        }
+    };
+
+    /// @param index 0..COUNT - 1, checked by caller
+    constexpr Entry operator[](uint8_t index) const {
+        return Entry{ static_cast<uint8_t>(OFFSET + index * STRIDE) };
+    }
+};
+
+template<auto REG>
+constexpr FieldValue<REG> merge_fields(FieldValue<REG> value){
+    return value;
+}
+
+template<auto REG, typename... REST>
+constexpr FieldValue<REG> merge_fields(FieldValue<REG> first, FieldValue<REG> second, REST... rest){
+    return merge_fields(FieldValue<REG>{ first.mask | second.mask, first.bits | second.bits }, rest...);
+}
+
+/// @brief one read and one write of register, other fields are kept
+template<auto REG, typename... REST>
+inline void modify(RegisterParent<REG>* registers, FieldValue<REG> first, REST... rest){
+    FieldValue<REG> value = merge_fields(first, rest...);
+    uint32_t current = registers->*REG;
+    registers->*REG = (current & ~value.mask) | value.bits;
+}
+
+/// @brief one write of register, bits of other fields are zero
+template<auto REG, typename... REST>
+inline void write_fields(RegisterParent<REG>* registers, FieldValue<REG> first, REST... rest){
+    registers->*REG = merge_fields(first, rest...).bits;
+}
+
+template<auto REG, uint8_t OFFSET, uint8_t WIDTH>
+inline uint32_t read_field(const RegisterParent<REG>* registers, Field<REG, OFFSET, WIDTH> field){
+    return field.extract(registers->*REG);
+}
@@ -0,0 +1,236 @@
+#pragma once
+
+#include "driver.hpp"
+
+// Framed stream protocol over USART, no handshake before messages.
+//
+// raw frame:   seq(u8) type(u8) len(u16 LE) payload[len] crc16(u16 LE)
+// on the wire: COBS(raw frame) 0x00
+//
+// crc16 is CRC-16/CCITT-FALSE (poly 0x1021, init 0xFFFF) over
+// seq, type, len and payload. Sender increments seq for every frame,
+// receiver counts gaps, so frames can be pipelined back to back.
+
+#define FRAME_MAX_PAYLOAD   512
+#define FRAME_HEADER_SIZE   4
+#define FRAME_CRC_SIZE      2
+#define FRAME_DELIMITER     0x00
+
+struct Crc16Table{
+    uint16_t values[256];
+
+    constexpr Crc16Table() : values() {
+        for(uint32_t i = 0; i < 256; i++){
+            uint16_t crc = i << 8;
+            for(uint8_t bit = 0; bit < 8; bit++)
+                crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+            values[i] = crc;
+        }
+    }
+};
+
+inline constexpr Crc16Table crc16_table{};
+
+inline uint16_t crc16_update(uint16_t crc, uint8_t byte){
+    return (crc << 8) ^ crc16_table.values[((crc >> 8) ^ byte) & 0xFF];
+}
+
+inline uint16_t crc16(const uint8_t* data, uint32_t len, uint16_t crc = 0xFFFF){
+    for(uint32_t i = 0; i < len; i++) crc = crc16_update(crc, data[i]);
+    return crc;
+}
+
+inline void write_le16(uint8_t* buf, uint16_t value){
+    buf[0] = value & 0xFF;
+    buf[1] = value >> 8;
+}
+
+inline void write_le32(uint8_t* buf, uint32_t value){
+    buf[0] = value & 0xFF;
+    buf[1] = (value >> 8) & 0xFF;
+    buf[2] = (value >> 16) & 0xFF;
+    buf[3] = value >> 24;
+}
+
+inline uint16_t read_le16(const uint8_t* buf){
+    return buf[0] | (buf[1] << 8);
+}
+
+inline uint32_t read_le32(const uint8_t* buf){
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | (static_cast<uint32_t>(buf[3]) << 24);
+}
+
+/// @brief view into decoder buffer, valid until next byte is fed
+struct Frame{
+    uint8_t seq;
+    uint8_t type;
+    uint16_t len;
+    const uint8_t* payload;
+};
+
+/// @brief incremental COBS decoder, fed byte by byte from rx buffer
+class FrameDecoder final{
+    uint8_t buffer[FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD + FRAME_CRC_SIZE];
+    uint16_t size = 0;
+    uint8_t code = 0;
+    uint8_t left = 0;
+    bool overflow = false;
+    bool synced = false;
+    uint8_t expected_seq = 0;
+
+    void append(uint8_t byte){
+        if(size < sizeof(buffer)) buffer[size++] = byte;
+        else overflow = true;
+    }
+
+    void reset(){
+        size = 0;
+        code = 0;
+        left = 0;
+        overflow = false;
+    }
+
+    bool finish(Frame& frame){
+        bool complete = left == 0 && !overflow
+            && size >= FRAME_HEADER_SIZE + FRAME_CRC_SIZE;
+        uint16_t len = complete ? read_le16(buffer + 2) : 0;
+
+        if(!complete || len != size - FRAME_HEADER_SIZE - FRAME_CRC_SIZE){
+            if(size != 0) malformed++;
+            reset();
+            return false;
+        }
+
+        uint16_t crc = read_le16(buffer + size - FRAME_CRC_SIZE);
+        if(crc != crc16(buffer, size - FRAME_CRC_SIZE)){
+            crc_errors++;
+            reset();
+            return false;
+        }
+
+        frame.seq = buffer[0];
+        frame.type = buffer[1];
+        frame.len = len;
+        frame.payload = buffer + FRAME_HEADER_SIZE;
+
+        if(synced && frame.seq != expected_seq)
+            lost += static_cast<uint8_t>(frame.seq - expected_seq);
+        expected_seq = frame.seq + 1;
+        synced = true;
+
+        reset();
+        return true;
+    }
+public:
+    uint32_t crc_errors = 0;
+    uint32_t malformed = 0;
+    /// @brief frames skipped by sender sequence numbers
+    uint32_t lost = 0;
+
+    /// @return true when byte completes a valid frame
+    bool feed(uint8_t byte, Frame& frame){
+        if(byte == FRAME_DELIMITER) return finish(frame);
+
+        if(left != 0){
+            append(byte);
+            left--;
+            return false;
+        }
+
+        // code byte, previous block ended with implicit zero
+        // unless it was a full 254 bytes block
+        if(code != 0 && code != 0xFF) append(0);
+        code = byte;
+        left = byte - 1;
+
+        return false;
+    }
+};
+
+/// @brief COBS encoder streaming straight into usart tx buffer,
+///         frame is never assembled in memory
+class FrameEncoder final{
+    USART& usart;
+    uint8_t seq = 0;
+
+    uint8_t header[FRAME_HEADER_SIZE];
+    uint8_t trailer[FRAME_CRC_SIZE];
+    const uint8_t* payload = nullptr;
+    uint16_t len = 0;
+
+    uint8_t at(uint32_t index) const {
+        if(index < FRAME_HEADER_SIZE) return header[index];
+        index -= FRAME_HEADER_SIZE;
+        if(index < len) return payload[index];
+        return trailer[index - len];
+    }
+
+    void put(uint8_t byte){
+        // waiting for space in tx buffer, not for the other side
+        while(!usart.tx_buffer.push(byte)) usart.interrupt_txe_enable();
+    }
+public:
+    FrameEncoder(USART& usart) : usart(usart) {}
+
+    /// @brief queue frame for transmission, blocks only while tx buffer is full
+    /// @return 1 if len bigger than FRAME_MAX_PAYLOAD or 0 if ok
+    uint8_t send(uint8_t type, const void* data, uint16_t size){
+        if(size > FRAME_MAX_PAYLOAD) return 1;
+
+        header[0] = seq++;
+        header[1] = type;
+        write_le16(header + 2, size);
+        payload = reinterpret_cast<const uint8_t*>(data);
+        len = size;
+
+        uint16_t crc = crc16(header, FRAME_HEADER_SIZE);
+        crc = crc16(payload, len, crc);
+        write_le16(trailer, crc);
+
+        uint32_t total = FRAME_HEADER_SIZE + len + FRAME_CRC_SIZE;
+        uint32_t block = 0;
+        while(true){
+            uint32_t end = block;
+            while(end < total && end - block < 254 && at(end) != 0) end++;
+
+            put(end - block + 1);
+            for(uint32_t i = block; i < end; i++) put(at(i));
+
+            if(end == total) break;
+            // full block is not followed by implicit zero
+            block = end - block == 254 ? end : end + 1;
+        }
+        put(FRAME_DELIMITER);
+        usart.interrupt_txe_enable();
+
+        return 0;
+    }
+};
+
+/// @brief frame encoder and decoder on one usart in async mode
+class FrameLink final{
+    USART& usart;
+    FrameDecoder decoder;
+public:
+    FrameEncoder encoder;
+
+    FrameLink(USART& usart) : usart(usart), encoder(usart) {}
+
+    uint8_t send(uint8_t type, const void* data, uint16_t size){
+        return encoder.send(type, data, size);
+    }
+
+    /// @brief takes received bytes from usart until frame is complete
+    /// @return true if frame is ready, frame is valid until next poll
+    bool poll(Frame& frame){
+        uint8_t byte;
+        while(usart.rx_buffer.pop(byte))
+            if(decoder.feed(byte, frame)) return true;
+
+        return false;
+    }
+
+    const FrameDecoder& stats() const {
+        return decoder;
+    }
+};
@@ -0,0 +1,966 @@
+#pragma once
+
+// Host register backend, included by driver.hpp when HOST_BACKEND is
+// defined, lets drivers run on a normal Linux machine.
+//
+// Every *_Reg struct is allocated in host memory on first use and each
+// access to its fields goes through Bus, which
+//  - counts reads and writes (globally and per peripheral),
+//  - advances simulated time by cycles_per_access core cycles,
+//  - lets behavioral models react to the access,
+//  - calls interrupt handlers attached with Bus::attach_irq when a model
+//    raises an interrupt that is enabled in NVIC.
+//
+// Models use one simulated clock for core and bus cycles (the 84 MHz
+// setup of this board, where timers and USART1 run at core clock).
+// Time moves only with register accesses, a loop which waits for an
+// interrupt handler by polling plain memory must call Bus::advance().
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <deque>
+
+namespace host {
+
+class Reg;
+uint32_t bus_read(const Reg* reg);
+void bus_write(Reg* reg, uint32_t value);
+
+/// @brief host replacement of volatile uint32_t register field
+class Reg final{
+    uint32_t value = 0;
+public:
+    Reg() = default;
+    Reg(const Reg&) = delete;
+
+    Reg& operator=(const Reg& other){
+        return *this = static_cast<uint32_t>(other);
+    }
+
+    Reg& operator=(uint32_t new_value){
+        bus_write(this, new_value);
+        return *this;
+    }
+
+    operator uint32_t() const {
+        return bus_read(this);
+    }
+
+    Reg& operator|=(uint32_t mask){
+        return *this = static_cast<uint32_t>(*this) | mask;
+    }
+
+    Reg& operator&=(uint32_t mask){
+        return *this = static_cast<uint32_t>(*this) & mask;
+    }
+
+    Reg& operator^=(uint32_t mask){
+        return *this = static_cast<uint32_t>(*this) ^ mask;
+    }
+
+    /// @brief access without counting and without model side effects
+    uint32_t raw() const {
+        return value;
+    }
+
+    void set_raw(uint32_t new_value){
+        value = new_value;
+    }
+};
+
+#define HOST_NO_IRQ         -100
+#define HOST_SYSTICK_IRQ    -1
+
+/// @brief behavior of one peripheral, offsets are in bytes
+///         from peripheral base address
+class Model{
+public:
+    virtual ~Model() = default;
+
+    /// @brief size of register window in bytes
+    virtual uint32_t size() const = 0;
+
+    virtual void reset(Reg* regs){
+        (void)regs;
+    }
+
+    virtual uint32_t read(Reg* regs, uint32_t offset){
+        return regs[offset / 4].raw();
+    }
+
+    virtual void write(Reg* regs, uint32_t offset, uint32_t value){
+        regs[offset / 4].set_raw(value);
+    }
+
+    virtual void advance(Reg* regs, uint64_t cycles){
+        (void)regs;
+        (void)cycles;
+    }
+
+    /// @return interrupt number which is requested now or HOST_NO_IRQ
+    virtual int irq_pending(Reg* regs) const {
+        (void)regs;
+        return HOST_NO_IRQ;
+    }
+
+    /// @brief called after interrupt handler returned
+    virtual void acknowledge(Reg* regs){
+        (void)regs;
+    }
+};
+
+/// @brief USART: bytes shift out at 10 (11 with M) bit times of
+///         BRR, received bytes are injected with inject()
+class UsartModel final : public Model{
+    int irq;
+    uint64_t shift_left = 0;
+    bool shifting = false;
+    bool holding = false;
+    uint8_t shift_byte = 0;
+    uint8_t hold_byte = 0;
+    uint64_t rx_wait = 0;
+
+    enum { SR = 0x00, DR = 0x04, BRR = 0x08, CR1 = 0x0C };
+
+    static uint64_t byte_cycles(Reg* regs){
+        uint32_t brr = regs[BRR / 4].raw();
+        uint32_t cr1 = regs[CR1 / 4].raw();
+        // bit time in clock cycles: OVER16 - brr, OVER8 - mantissa * 8 + fraction
+        uint64_t bit = (cr1 & (1 << 15)) ? (brr >> 4) * 8 + (brr & 0x7) : brr;
+        if(bit == 0) bit = 1;
+        return bit * ((cr1 & (1 << 12)) ? 11 : 10);
+    }
+
+    void start_shift(Reg* regs, uint8_t byte){
+        shift_byte = byte;
+        shifting = true;
+        shift_left = byte_cycles(regs);
+    }
+public:
+    std::vector<uint8_t> transmitted;
+    std::deque<uint8_t> to_receive;
+    uint64_t overruns = 0;
+
+    explicit UsartModel(int irq) : irq(irq) {}
+
+    uint32_t size() const override {
+        return 0x1C;
+    }
+
+    void reset(Reg* regs) override {
+        // TXE and TC
+        regs[SR / 4].set_raw(0xC0);
+    }
+
+    void inject(const uint8_t* data, uint32_t len){
+        to_receive.insert(to_receive.end(), data, data + len);
+    }
+
+    uint32_t read(Reg* regs, uint32_t offset) override {
+        uint32_t value = regs[offset / 4].raw();
+        if(offset == DR){
+            // RXNE and ORE are cleared by data read
+            regs[SR / 4].set_raw(regs[SR / 4].raw() & ~((1u << 5) | (1u << 3)));
+        }
+        return value;
+    }
+
+    void write(Reg* regs, uint32_t offset, uint32_t value) override {
+        Reg& sr = regs[SR / 4];
+
+        switch(offset){
+        case SR:
+            // rc_w0 bits: RXNE, TC, LBD, CTS
+            sr.set_raw(sr.raw() & (value | ~((1u << 5) | (1u << 6) | (1u << 8) | (1u << 9))));
+            return;
+        case DR:
+            if(!(regs[CR1 / 4].raw() & (1 << 3))) return;
+            sr.set_raw(sr.raw() & ~(1u << 6));
+            if(!shifting) start_shift(regs, value);
+            else{
+                hold_byte = value;
+                holding = true;
+                sr.set_raw(sr.raw() & ~(1u << 7));
+            }
+            return;
+        default:
+            regs[offset / 4].set_raw(value);
+        }
+    }
+
+    void advance(Reg* regs, uint64_t cycles) override {
+        Reg& sr = regs[SR / 4];
+        uint32_t cr1 = regs[CR1 / 4].raw();
+        if(!(cr1 & (1 << 13))) return;
+
+        uint64_t left = cycles;
+        while(shifting && left != 0){
+            if(left < shift_left){
+                shift_left -= left;
+                left = 0;
+                break;
+            }
+            left -= shift_left;
+            transmitted.push_back(shift_byte);
+            shifting = false;
+
+            if(holding){
+                holding = false;
+                start_shift(regs, hold_byte);
+                sr.set_raw(sr.raw() | (1u << 7));
+            }
+            else sr.set_raw(sr.raw() | (1u << 6));
+        }
+
+        if(!(cr1 & (1 << 2)) || to_receive.empty()){
+            rx_wait = 0;
+            return;
+        }
+
+        rx_wait += cycles;
+        while(!to_receive.empty() && rx_wait >= byte_cycles(regs)){
+            rx_wait -= byte_cycles(regs);
+            if(sr.raw() & (1u << 5)){
+                sr.set_raw(sr.raw() | (1u << 3));
+                overruns++;
+            }
+            else regs[DR / 4].set_raw(to_receive.front());
+            sr.set_raw(sr.raw() | (1u << 5));
+            to_receive.pop_front();
+        }
+    }
+
+    int irq_pending(Reg* regs) const override {
+        uint32_t sr = regs[SR / 4].raw();
+        uint32_t cr1 = regs[CR1 / 4].raw();
+        bool pending = ((cr1 & (1 << 7)) && (sr & (1 << 7)))
+            || ((cr1 & (1 << 6)) && (sr & (1 << 6)))
+            || ((cr1 & (1 << 5)) && (sr & ((1 << 5) | (1 << 3))));
+        return pending ? irq : HOST_NO_IRQ;
+    }
+};
+
+/// @brief general purpose timer: CNT advances every PSC + 1 cycles,
+///         PSC is loaded on update event like on real hardware
+class TimModel final : public Model{
+    int irq;
+    uint64_t prescaler_count = 0;
+    uint32_t active_psc = 0;
+
+    enum { CR1 = 0x00, DIER = 0x0C, SR = 0x10, EGR = 0x14, CNT = 0x24, PSC = 0x28, ARR = 0x2C,
+        CCR1 = 0x34, CCR4 = 0x40 };
+public:
+    explicit TimModel(int irq) : irq(irq) {}
+
+    uint32_t size() const override {
+        return 0x54;
+    }
+
+    uint32_t read(Reg* regs, uint32_t offset) override {
+        // reading CCR clears capture flag of its channel
+        if(offset >= CCR1 && offset <= CCR4)
+            regs[SR / 4].set_raw(regs[SR / 4].raw() & ~(1u << ((offset - CCR1) / 4 + 1)));
+        return regs[offset / 4].raw();
+    }
+
+    void reset(Reg* regs) override {
+        regs[ARR / 4].set_raw(0xFFFFFFFF);
+    }
+
+    void write(Reg* regs, uint32_t offset, uint32_t value) override {
+        switch(offset){
+        case SR:
+            regs[SR / 4].set_raw(regs[SR / 4].raw() & value);
+            return;
+        case EGR:
+            if(value & 1){
+                regs[CNT / 4].set_raw(0);
+                prescaler_count = 0;
+                active_psc = regs[PSC / 4].raw() & 0xFFFF;
+            }
+            return;
+        default:
+            regs[offset / 4].set_raw(value);
+        }
+    }
+
+    void advance(Reg* regs, uint64_t cycles) override {
+        if(!(regs[CR1 / 4].raw() & 1)) return;
+
+        prescaler_count += cycles;
+        uint64_t ticks = prescaler_count / (active_psc + 1ull);
+        prescaler_count %= active_psc + 1ull;
+        if(ticks == 0) return;
+
+        uint64_t period = regs[ARR / 4].raw() + 1ull;
+        uint64_t count = regs[CNT / 4].raw() + ticks;
+        if(count >= period){
+            count %= period;
+            active_psc = regs[PSC / 4].raw() & 0xFFFF;
+            regs[SR / 4].set_raw(regs[SR / 4].raw() | 1);
+        }
+        regs[CNT / 4].set_raw(count);
+    }
+
+    int irq_pending(Reg* regs) const override {
+        return (regs[DIER / 4].raw() & regs[SR / 4].raw() & 0x5F) ? irq : HOST_NO_IRQ;
+    }
+};
+
+/// @brief SysTick: counts down from RVR, COUNTFLAG clears on CSR read
+class SystickModel final : public Model{
+    uint64_t divider_count = 0;
+    bool pending = false;
+
+    enum { CSR = 0x00, RVR = 0x04, CVR = 0x08 };
+public:
+    uint32_t size() const override {
+        return 0x10;
+    }
+
+    uint32_t read(Reg* regs, uint32_t offset) override {
+        uint32_t value = regs[offset / 4].raw();
+        if(offset == CSR) regs[CSR / 4].set_raw(value & ~(1u << 16));
+        return value;
+    }
+
+    void write(Reg* regs, uint32_t offset, uint32_t value) override {
+        switch(offset){
+        case CSR:
+            regs[CSR / 4].set_raw((regs[CSR / 4].raw() & (1u << 16)) | (value & 0b111));
+            return;
+        case CVR:
+            regs[CVR / 4].set_raw(0);
+            regs[CSR / 4].set_raw(regs[CSR / 4].raw() & ~(1u << 16));
+            return;
+        default:
+            regs[offset / 4].set_raw(value & 0x00FFFFFF);
+        }
+    }
+
+    void advance(Reg* regs, uint64_t cycles) override {
+        uint32_t csr = regs[CSR / 4].raw();
+        if(!(csr & 1)) return;
+
+        // CLKSOURCE 0 - core clock / 8
+        uint64_t ticks = cycles;
+        if(!(csr & (1 << 2))){
+            divider_count += cycles;
+            ticks = divider_count / 8;
+            divider_count %= 8;
+        }
+
+        uint64_t reload = regs[RVR / 4].raw();
+        uint64_t current = regs[CVR / 4].raw();
+        if(reload == 0) return;
+
+        while(ticks != 0){
+            // counter at zero loads RVR on next tick
+            if(current == 0){
+                current = reload;
+                ticks--;
+                continue;
+            }
+            if(ticks < current){
+                current -= ticks;
+                break;
+            }
+            // COUNTFLAG is set on transition from 1 to 0
+            ticks -= current;
+            current = 0;
+            regs[CSR / 4].set_raw(regs[CSR / 4].raw() | (1u << 16));
+            if(csr & (1 << 1)) pending = true;
+            if(ticks > reload + 1) ticks %= reload + 1;
+        }
+        regs[CVR / 4].set_raw(current);
+    }
+
+    int irq_pending(Reg* regs) const override {
+        (void)regs;
+        return pending ? HOST_SYSTICK_IRQ : HOST_NO_IRQ;
+    }
+
+    void acknowledge(Reg* regs) override {
+        (void)regs;
+        pending = false;
+    }
+};
+
+/// @brief RCC: oscillators are ready at once, PLL locks
+///         pll_lock_cycles after PLLON, SWS follows SW
+class RccModel final : public Model{
+    uint64_t lock_left = 0;
+
+    enum { CR = 0x00, CFGR = 0x08 };
+public:
+    uint64_t pll_lock_cycles = 200;
+
+    uint32_t size() const override {
+        return 0x90;
+    }
+
+    void reset(Reg* regs) override {
+        // HSION, HSIRDY, default HSITRIM
+        regs[CR / 4].set_raw(0x83);
+    }
+
+    void write(Reg* regs, uint32_t offset, uint32_t value) override {
+        if(offset == CR){
+            uint32_t ready = 0;
+            if(value & 1) ready |= 1u << 1;
+            if(value & (1u << 16)) ready |= 1u << 17;
+
+            uint32_t old = regs[CR / 4].raw();
+            if((value & (1u << 24)) && !(old & (1u << 24))) lock_left = pll_lock_cycles;
+            if((value & (1u << 24)) && (old & (1u << 25))) ready |= 1u << 25;
+
+            uint32_t ready_bits = (1u << 1) | (1u << 17) | (1u << 25);
+            regs[CR / 4].set_raw((value & ~ready_bits) | ready);
+            return;
+        }
+        if(offset == CFGR){
+            uint32_t sw = value & 0b11;
+            regs[CFGR / 4].set_raw((value & ~(0b11u << 2)) | (sw << 2));
+            return;
+        }
+        regs[offset / 4].set_raw(value);
+    }
+
+    void advance(Reg* regs, uint64_t cycles) override {
+        uint32_t cr = regs[CR / 4].raw();
+        if(!(cr & (1u << 24)) || (cr & (1u << 25))) return;
+
+        if(cycles >= lock_left) regs[CR / 4].set_raw(cr | (1u << 25));
+        else lock_left -= cycles;
+    }
+};
+
+/// @brief NVIC: iser/icer and ispr/icpr are write one to set/clear
+class NvicModel final : public Model{
+    enum { ISER = 0x000, ICER = 0x040, ISPR = 0x080, ICPR = 0x0C0 };
+public:
+    uint32_t size() const override {
+        return 0x3F0;
+    }
+
+    uint32_t read(Reg* regs, uint32_t offset) override {
+        // clear registers read as their set pair
+        if(offset >= ICER && offset < ISPR) return regs[(offset - ICER + ISER) / 4].raw();
+        if(offset >= ICPR && offset < ICPR + 0x40) return regs[(offset - ICPR + ISPR) / 4].raw();
+        return regs[offset / 4].raw();
+    }
+
+    void write(Reg* regs, uint32_t offset, uint32_t value) override {
+        if(offset < ICER) regs[offset / 4].set_raw(regs[offset / 4].raw() | value);
+        else if(offset < ISPR){
+            Reg& iser = regs[(offset - ICER + ISER) / 4];
+            iser.set_raw(iser.raw() & ~value);
+        }
+        else if(offset < ICPR) regs[offset / 4].set_raw(regs[offset / 4].raw() | value);
+        else if(offset < ICPR + 0x40){
+            Reg& ispr = regs[(offset - ICPR + ISPR) / 4];
+            ispr.set_raw(ispr.raw() & ~value);
+        }
+        else regs[offset / 4].set_raw(value);
+    }
+
+    bool is_enabled(Reg* regs, int irq) const {
+        return regs[(ISER + 4 * (irq / 32)) / 4].raw() & (1u << (irq % 32));
+    }
+
+    /// @brief enabled interrupts pended by software (ISPR)
+    int irq_pending(Reg* regs) const override {
+        for(int irq = 0; irq < IRQ_COUNT; irq++)
+            if((regs[(ISPR + 4 * (irq / 32)) / 4].raw() & (1u << (irq % 32)))
+                    && is_enabled(regs, irq)) return irq;
+        return HOST_NO_IRQ;
+    }
+
+    void acknowledge(Reg* regs) override {
+        int irq = irq_pending(regs);
+        if(irq != HOST_NO_IRQ)
+            regs[(ISPR + 4 * (irq / 32)) / 4].set_raw(
+                regs[(ISPR + 4 * (irq / 32)) / 4].raw() & ~(1u << (irq % 32)));
+    }
+};
+
+/// @brief DWT: CYCCNT follows simulated cycles while CYCCNTENA is set
+class DwtModel final : public Model{
+    uint64_t* clock;
+    uint64_t offset = 0;
+
+    enum { CTRL = 0x00, CYCCNT = 0x04 };
+public:
+    explicit DwtModel(uint64_t* clock) : clock(clock) {}
+
+    uint32_t size() const override {
+        return 0x20;
+    }
+
+    uint32_t read(Reg* regs, uint32_t offset_bytes) override {
+        if(offset_bytes == CYCCNT && (regs[CTRL / 4].raw() & 1))
+            return static_cast<uint32_t>(*clock - offset);
+        return regs[offset_bytes / 4].raw();
+    }
+
+    void write(Reg* regs, uint32_t offset_bytes, uint32_t value) override {
+        if(offset_bytes == CYCCNT) offset = *clock - value;
+        regs[offset_bytes / 4].set_raw(value);
+    }
+};
+
+/// @brief FLASH interface: KEYR unlock sequence, sector erase and
+///         word programming take erase_cycles / program_cycles with BSY
+///         set, EOP (with EOPIE) raises FLASH_IRQ. Only user flash
+///         (FlashMemoryModel) is backed by memory.
+class FlashModel final : public Model{
+    Reg* regs = nullptr;
+    Reg* memory = nullptr;
+    uint64_t busy_left = 0;
+    bool erasing = false;
+    uint8_t key_step = 0;
+
+    enum { KEYR = 0x04, SR = 0x0C, CR = 0x10 };
+    enum : uint32_t {
+        EOP = 1u << 0, OPERR = 1u << 1, PGPERR = 1u << 6, PGSERR = 1u << 7,
+        BSY = 1u << 16, PG = 1u << 0, SER = 1u << 1, MER = 1u << 2,
+        STRT = 1u << 16, EOPIE = 1u << 24, ERRIE = 1u << 25, LOCK = 1u << 31
+    };
+
+    void start(uint64_t cycles, bool erase){
+        busy_left = cycles;
+        erasing = erase;
+        regs[SR / 4].set_raw(regs[SR / 4].raw() | BSY);
+    }
+
+    void erase_done(){
+        uint32_t cr = regs[CR / 4].raw();
+        uint32_t sector = (cr >> 3) & 0xF;
+        if(memory != nullptr && ((cr & MER) || sector == USER_FLASH_SECTOR))
+            for(uint32_t i = 0; i < USER_FLASH_SIZE / 4; i++) memory[i].set_raw(0xFFFFFFFF);
+        regs[CR / 4].set_raw(cr & ~STRT);
+    }
+public:
+    uint64_t erase_cycles = 8400000;
+    uint64_t program_cycles = 1344;
+    /// @brief KEYR was written while unlocked
+    bool key_error = false;
+
+    uint32_t size() const override {
+        return 0x18;
+    }
+
+    void reset(Reg* registers) override {
+        regs = registers;
+        regs[CR / 4].set_raw(LOCK);
+    }
+
+    void write(Reg* registers, uint32_t offset, uint32_t value) override {
+        uint32_t cr = registers[CR / 4].raw();
+
+        if(offset == KEYR){
+            // key error: bus fault, CR stays locked until reset
+            if(!(cr & LOCK) || key_error){
+                registers[CR / 4].set_raw(cr | LOCK);
+                key_error = true;
+                return;
+            }
+            if(key_step == 0 && value == 0x45670123) key_step = 1;
+            else if(key_step == 1 && value == 0xCDEF89AB) registers[CR / 4].set_raw(cr & ~LOCK);
+            else key_step = 0;
+            return;
+        }
+        if(offset == SR){
+            uint32_t sr = registers[SR / 4].raw();
+            registers[SR / 4].set_raw(sr & ~(value & ~BSY));
+            return;
+        }
+        if(offset == CR){
+            // only LOCK can be written while locked
+            if(cr & LOCK){
+                registers[CR / 4].set_raw(cr | (value & LOCK));
+                return;
+            }
+            if(value & LOCK) key_step = 0;
+            registers[CR / 4].set_raw(value);
+            if((value & STRT) && !(cr & STRT) && (value & (SER | MER)) && busy_left == 0)
+                start(erase_cycles, true);
+            return;
+        }
+        registers[offset / 4].set_raw(value);
+    }
+
+    /// @brief word write to user flash, bits can be only cleared.
+    ///         Core stalls while flash is busy, here the pending operation
+    ///         just completes (stall is not added to simulated time)
+    /// @return false if write is not allowed now
+    bool program(Reg* word, uint32_t value){
+        if(busy_left != 0) advance(regs, busy_left);
+
+        uint32_t cr = regs[CR / 4].raw();
+        if((cr & LOCK) || !(cr & PG)){
+            regs[SR / 4].set_raw(regs[SR / 4].raw() | PGSERR);
+            return false;
+        }
+        if(((cr >> 8) & 0b11) != 0b10){
+            regs[SR / 4].set_raw(regs[SR / 4].raw() | PGPERR);
+            return false;
+        }
+        word->set_raw(word->raw() & value);
+        start(program_cycles, false);
+        return true;
+    }
+
+    void attach_memory(Reg* words){
+        memory = words;
+    }
+
+    void advance(Reg* registers, uint64_t cycles) override {
+        if(busy_left == 0) return;
+        if(cycles < busy_left){
+            busy_left -= cycles;
+            return;
+        }
+
+        busy_left = 0;
+        if(erasing) erase_done();
+        uint32_t sr = registers[SR / 4].raw() & ~BSY;
+        if(registers[CR / 4].raw() & EOPIE) sr |= EOP;
+        registers[SR / 4].set_raw(sr);
+    }
+
+    int irq_pending(Reg* registers) const override {
+        uint32_t sr = registers[SR / 4].raw();
+        uint32_t cr = registers[CR / 4].raw();
+        if(((sr & EOP) && (cr & EOPIE)) || ((sr & OPERR) && (cr & ERRIE))) return FLASH_IRQ;
+        return HOST_NO_IRQ;
+    }
+};
+
+/// @brief user flash sector, erased at start, writes go through FlashModel
+class FlashMemoryModel final : public Model{
+    FlashModel* flash;
+public:
+    explicit FlashMemoryModel(FlashModel* flash) : flash(flash) {}
+
+    uint32_t size() const override {
+        return USER_FLASH_SIZE;
+    }
+
+    void reset(Reg* regs) override {
+        for(uint32_t i = 0; i < USER_FLASH_SIZE / 4; i++) regs[i].set_raw(0xFFFFFFFF);
+        flash->attach_memory(regs);
+    }
+
+    void write(Reg* regs, uint32_t offset, uint32_t value) override {
+        flash->program(&regs[offset / 4], value);
+    }
+};
+
+/// @brief CRC unit, CRC-32/MPEG-2 of words written to DR
+class CrcModel final : public Model{
+    enum { DR = 0x00, CR = 0x08 };
+public:
+    uint32_t size() const override {
+        return 0x0C;
+    }
+
+    void reset(Reg* regs) override {
+        regs[DR / 4].set_raw(0xFFFFFFFF);
+    }
+
+    void write(Reg* regs, uint32_t offset, uint32_t value) override {
+        if(offset == DR){
+            uint32_t crc = regs[DR / 4].raw() ^ value;
+            for(uint8_t bit = 0; bit < 32; bit++)
+                crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+            regs[DR / 4].set_raw(crc);
+            return;
+        }
+        if(offset == CR){
+            if(value & 1) regs[DR / 4].set_raw(0xFFFFFFFF);
+            return;
+        }
+        regs[offset / 4].set_raw(value);
+    }
+};
+
+/// @brief EXTI: PR is write one to clear, SWIER pends unmasked lines
+///         (edges of pins are simulated with SWIER), pending unmasked
+///         line raises its EXTI interrupt
+class ExtiModel final : public Model{
+    enum { IMR = 0x00, SWIER = 0x10, PR = 0x14 };
+public:
+    uint32_t size() const override {
+        return 0x18;
+    }
+
+    void write(Reg* regs, uint32_t offset, uint32_t value) override {
+        if(offset == PR){
+            regs[PR / 4].set_raw(regs[PR / 4].raw() & ~value);
+            regs[SWIER / 4].set_raw(regs[SWIER / 4].raw() & ~value);
+            return;
+        }
+        if(offset == SWIER){
+            uint32_t lines = value & ~regs[SWIER / 4].raw() & regs[IMR / 4].raw();
+            regs[PR / 4].set_raw(regs[PR / 4].raw() | lines);
+        }
+        regs[offset / 4].set_raw(value);
+    }
+
+    int irq_pending(Reg* regs) const override {
+        uint32_t lines = regs[PR / 4].raw() & regs[IMR / 4].raw() & 0xFFFF;
+        if(lines == 0) return HOST_NO_IRQ;
+
+        uint32_t line = __builtin_ctz(lines);
+        if(line <= 4) return EXTI0_IRQ + line;
+        return line <= 9 ? EXTI9_5_IRQ : EXTI15_10_IRQ;
+    }
+};
+
+struct Region{
+    uint32_t address;
+    uint32_t words;
+    std::unique_ptr<Reg[]> regs;
+    Model* model;
+    uint64_t reads;
+    uint64_t writes;
+};
+
+class Bus final{
+    std::vector<std::unique_ptr<Model>> models;
+    std::vector<std::pair<uint32_t, Model*>> attached;
+    std::vector<Region> regions;
+    std::vector<const volatile void*> handles;
+    void (*handlers[256])() = {};
+    NvicModel* nvic = nullptr;
+    uint32_t irq_depth = 0;
+
+    Bus(){
+        attach(USART1_BASE, add<UsartModel>(USART1_IRQ));
+        attach(USART2_BASE, add<UsartModel>(USART2_IRQ));
+        attach(USART6_BASE, add<UsartModel>(USART6_IRQ));
+        attach(TIM_BASE + 0x000, add<TimModel>(28));
+        attach(TIM_BASE + 0x400, add<TimModel>(29));
+        attach(TIM_BASE + 0x800, add<TimModel>(30));
+        attach(TIM_BASE + 0xC00, add<TimModel>(50));
+        attach(SYSTICK_BASE, add<SystickModel>());
+        attach(RCC_BASE, add<RccModel>());
+        attach(DWT_BASE, add<DwtModel>(&cycles));
+        FlashModel* flash = add<FlashModel>();
+        attach(FLASH_BASE, flash);
+        attach(USER_FLASH_BASE, add<FlashMemoryModel>(flash));
+        attach(CRC_BASE, add<CrcModel>());
+        attach(EXTI_BASE, add<ExtiModel>());
+        nvic = add<NvicModel>();
+        attach(NVIC_BASE, nvic);
+    }
+
+    template<typename T, typename... Args>
+    T* add(Args... args){
+        models.emplace_back(new T(args...));
+        return static_cast<T*>(models.back().get());
+    }
+
+    Model* model_at(uint32_t address) const {
+        for(auto& entry : attached)
+            if(entry.first == address) return entry.second;
+        return nullptr;
+    }
+
+    Region* find(const volatile void* pointer){
+        for(auto& region : regions){
+            const volatile void* begin = region.regs.get();
+            const volatile void* end = region.regs.get() + region.words;
+            if(pointer >= begin && pointer < end) return &region;
+        }
+        return nullptr;
+    }
+
+    Region* find(uint32_t address){
+        for(auto& region : regions)
+            if(address >= region.address && address < region.address + region.words * 4)
+                return &region;
+        return nullptr;
+    }
+
+    void dispatch_irqs(){
+        if(irq_depth != 0) return;
+
+        // level triggered, handler must clear the cause
+        for(uint32_t guard = 0; guard < 10000; guard++){
+            uint32_t pending = regions.size();
+            int irq = HOST_NO_IRQ;
+
+            for(uint32_t i = 0; i < regions.size(); i++){
+                if(regions[i].model == nullptr) continue;
+                int candidate = regions[i].model->irq_pending(regions[i].regs.get());
+                if(candidate == HOST_NO_IRQ || handlers[candidate + 16] == nullptr) continue;
+                if(candidate >= 0 && !irq_enabled(candidate)) continue;
+
+                pending = i;
+                irq = candidate;
+                break;
+            }
+            if(pending == regions.size()) return;
+
+            irq_depth++;
+            handlers[irq + 16]();
+            irq_depth--;
+            // handler can map new peripherals, regions may move
+            regions[pending].model->acknowledge(regions[pending].regs.get());
+        }
+    }
+
+    bool irq_enabled(int irq){
+        Region* region = find(static_cast<uint32_t>(NVIC_BASE));
+        return region != nullptr && nvic->is_enabled(region->regs.get(), irq);
+    }
+
+    void step(){
+        cycles += cycles_per_access;
+        for(auto& region : regions)
+            if(region.model != nullptr) region.model->advance(region.regs.get(), cycles_per_access);
+        dispatch_irqs();
+    }
+public:
+    uint64_t cycles = 0;
+    uint32_t cycles_per_access = 1;
+    uint32_t slice_cycles = 64;
+    uint64_t reads = 0;
+    uint64_t writes = 0;
+
+    static Bus& instance(){
+        static Bus bus;
+        return bus;
+    }
+
+    /// @brief storage of peripheral at address, created on first use
+    template<typename T>
+    T* map(uint32_t address){
+        Region* region = find(address);
+        if(region == nullptr){
+            Model* model = model_at(address);
+            uint32_t bytes = sizeof(T);
+            if(model != nullptr && model->size() > bytes) bytes = model->size();
+
+            regions.push_back(Region{ address, (bytes + 3) / 4,
+                std::unique_ptr<Reg[]>(new Reg[(bytes + 3) / 4]), model, 0, 0 });
+            region = &regions.back();
+            if(model != nullptr) model->reset(region->regs.get());
+        }
+        return reinterpret_cast<T*>(&region->regs[(address - region->address) / 4]);
+    }
+
+    /// @brief model for peripheral at address, must be called before
+    ///         first map() of that address
+    void attach(uint32_t address, Model* model){
+        attached.emplace_back(address, model);
+    }
+
+    template<typename T>
+    T* model(uint32_t address){
+        return static_cast<T*>(model_at(address));
+    }
+
+    /// @param irq NVIC interrupt number or HOST_SYSTICK_IRQ
+    void attach_irq(int irq, void (*handler)()){
+        handlers[irq + 16] = handler;
+    }
+
+    /// @brief time passes without bus access (core executes code),
+    ///         interrupts are checked every slice_cycles
+    void advance(uint64_t count){
+        while(count != 0){
+            uint64_t slice = count < slice_cycles ? count : slice_cycles;
+            count -= slice;
+
+            cycles += slice;
+            for(auto& region : regions)
+                if(region.model != nullptr) region.model->advance(region.regs.get(), slice);
+            dispatch_irqs();
+        }
+    }
+
+    /// @brief target address of register or handle of host memory
+    ///         which can be stored in 32 bit DMA address registers
+    uint32_t bus_address(const volatile void* pointer){
+        Region* region = find(pointer);
+        if(region != nullptr){
+            auto offset = reinterpret_cast<const volatile uint8_t*>(pointer)
+                - reinterpret_cast<const volatile uint8_t*>(region->regs.get());
+            return region->address + static_cast<uint32_t>(offset);
+        }
+
+        handles.push_back(pointer);
+        return 0xF0000000u | static_cast<uint32_t>(handles.size() - 1);
+    }
+
+    uint64_t accesses(uint32_t address){
+        Region* region = find(address);
+        return region == nullptr ? 0 : region->reads + region->writes;
+    }
+
+    uint32_t read(const Reg* reg){
+        Region* region = find(reg);
+        uint32_t offset = (reg - region->regs.get()) * 4;
+        uint32_t value = region->model != nullptr
+            ? region->model->read(region->regs.get(), offset) : reg->raw();
+
+        reads++;
+        region->reads++;
+        step();
+        return value;
+    }
+
+    void write(Reg* reg, uint32_t value){
+        Region* region = find(reg);
+        uint32_t offset = (reg - region->regs.get()) * 4;
+        if(region->model != nullptr) region->model->write(region->regs.get(), offset, value);
+        else reg->set_raw(value);
+
+        writes++;
+        region->writes++;
+        step();
+    }
+};
+
+inline uint32_t bus_read(const Reg* reg){
+    return Bus::instance().read(reg);
+}
+
+inline void bus_write(Reg* reg, uint32_t value){
+    Bus::instance().write(reg, value);
+}
+
+/// @brief register accesses and simulated cycles since construction,
+///         wrap one driver call to measure it
+class AccessCounter final{
+    uint64_t start_reads;
+    uint64_t start_writes;
+    uint64_t start_cycles;
+public:
+    AccessCounter() :
+        start_reads(Bus::instance().reads),
+        start_writes(Bus::instance().writes),
+        start_cycles(Bus::instance().cycles) {}
+
+    uint64_t reads() const {
+        return Bus::instance().reads - start_reads;
+    }
+
+    uint64_t writes() const {
+        return Bus::instance().writes - start_writes;
+    }
+
+    uint64_t accesses() const {
+        return reads() + writes();
+    }
+
+    uint64_t cycles() const {
+        return Bus::instance().cycles - start_cycles;
+    }
+};
+
+}
@@ -0,0 +1,280 @@
+#pragma once
+
+#include "driver.hpp"
+#include "frame.hpp"
+#include "memory.hpp"
+
+// In-application programming of user flash (USER_FLASH_BASE, sector
+// USER_FLASH_SECTOR) from RecieveCode frames.
+//
+// payload of RecieveCode frame:  op(u8) ...
+//   IapBegin   size(u32) crc(u32)   erase user flash
+//   IapData    offset(u32) data[]   next part of image
+//   IapEnd                          program the rest and verify crc
+// answer (RecieveCode frame):    op(u8) status(u8) received(u32)
+//
+// IapBegin is answered after erase (FLASH_IRQ), IapData frames are
+// answered only on error. Two pool blocks alternate: poll() programs
+// one while the link fills the other.
+//
+// crc is CRC-32/MPEG-2 (CRC unit) over the image as little endian
+// words, last word is padded with 0xFF.
+
+#define IAP_BLOCK_SIZE      1024
+#define IAP_WORDS_PER_POLL  16
+#define IAP_ANSWER_SIZE     6
+
+enum IapOp : uint8_t { IapBegin, IapData, IapEnd };
+
+enum IapStatus : uint8_t {
+    IapOk,
+    IapBadState,
+    IapTooBig,
+    IapBadOffset,
+    IapFlashError,
+    IapCrcMismatch,
+    IapMalformed,
+    IapBadHeader,
+    IapNoMemory
+};
+
+enum class IapState : uint8_t { Idle, Erasing, Receiving, Done, Failed };
+
+typedef struct {
+    reg32_t words[USER_FLASH_SIZE / 4];
+} UserFlash_Reg;
+
+class Iap final{
+    Flash& flash;
+    CRC& crc;
+    UserFlash_Reg* memory;
+
+    uint8_t* blocks[2] = {};
+    /// @brief image offset of block start
+    uint32_t block_offset[2] = {};
+    uint16_t fill[2] = {};
+    uint8_t filling = 0;
+    /// @brief other block (filling ^ 1) is being programmed
+    bool programming = false;
+    uint16_t programmed_words = 0;
+
+    uint32_t image_size = 0;
+    uint32_t image_crc = 0;
+    uint32_t received = 0;
+    uint8_t erase_sector = 0;
+    uint8_t erase_last = 0;
+    bool answer_begin = false;
+
+    void fail(IapStatus reason){
+        flash.interrupt_eop_disable();
+        flash.end_programming();
+        flash.lock();
+        status = reason;
+        state = IapState::Failed;
+    }
+
+    /// @brief programs up to count words of current block
+    void program(uint32_t count){
+        if(!programming || state != IapState::Receiving) return;
+
+        uint8_t programmed = filling ^ 1;
+        uint32_t total = fill[programmed] / 4;
+        if(count > total - programmed_words) count = total - programmed_words;
+
+        uint32_t first = (block_offset[programmed] / 4) + programmed_words;
+        if(flash.program_words(&memory->words[first],
+                reinterpret_cast<const uint32_t*>(blocks[programmed]) + programmed_words, count)){
+            fail(IapFlashError);
+            return;
+        }
+
+        programmed_words += count;
+        if(programmed_words == total) programming = false;
+    }
+
+    /// @brief filled block goes to programming, previous one
+    ///         is finished first if link was faster than flash
+    void commit_block(){
+        while(programming && state == IapState::Receiving) program(IAP_BLOCK_SIZE / 4);
+
+        programming = true;
+        programmed_words = 0;
+        block_offset[filling ^ 1] = block_offset[filling] + IAP_BLOCK_SIZE;
+        filling ^= 1;
+        fill[filling] = 0;
+    }
+
+    void release_blocks(){
+        for(uint8_t*& block : blocks){
+            Pools::free(block);
+            block = nullptr;
+        }
+        programming = false;
+    }
+
+    void answer(FrameEncoder& encoder, uint8_t op, uint8_t result){
+        uint8_t payload[IAP_ANSWER_SIZE];
+        payload[0] = op;
+        payload[1] = result;
+        write_le32(payload + 2, received);
+        encoder.send(frame_type, payload, sizeof(payload));
+    }
+public:
+    volatile IapState state = IapState::Idle;
+    volatile IapStatus status = IapOk;
+    /// @brief frame type of answers, RecieveCode command of main
+    uint8_t frame_type;
+
+    Iap(Flash& flash, CRC& crc, uint8_t frame_type) : flash(flash), crc(crc),
+        memory(PERIPHERAL(UserFlash_Reg, USER_FLASH_BASE)), frame_type(frame_type) {}
+
+    Iap(const Iap&) = delete;
+    Iap& operator=(const Iap&) = delete;
+
+    void interrupt_enable(NVIC& nvic){
+        nvic.enable_interrupt(FLASH_IRQ);
+    }
+
+    /// @brief starts erase of sectors which will keep size bytes
+    uint8_t begin(uint32_t size, uint32_t expected_crc){
+        if(state == IapState::Erasing) return IapBadState;
+        if(size == 0 || size > USER_FLASH_SIZE) return IapTooBig;
+        for(uint8_t*& block : blocks){
+            if(block == nullptr) block = static_cast<uint8_t*>(Pools::alloc(IAP_BLOCK_SIZE));
+        }
+        if(blocks[0] == nullptr || blocks[1] == nullptr){
+            release_blocks();
+            return IapNoMemory;
+        }
+
+        image_size = size;
+        image_crc = expected_crc;
+        received = 0;
+        filling = 0;
+        fill[0] = fill[1] = 0;
+        block_offset[0] = 0;
+        programming = false;
+        status = IapOk;
+
+        // restart while receiving: last word is finished, PG cleared
+        if(state == IapState::Receiving) flash.end_programming();
+
+        erase_sector = Flash::sector_of(USER_FLASH_BASE);
+        erase_last = Flash::sector_of(USER_FLASH_BASE + size - 1);
+
+        flash.unlock_cr_register();
+        flash.interrupt_eop_enable();
+        state = IapState::Erasing;
+        flash.start_sector_erase(erase_sector);
+
+        return IapOk;
+    }
+
+    /// @brief copies next part of image, blocks only if both blocks are full
+    uint8_t write(uint32_t offset, const uint8_t* data, uint32_t len){
+        if(state != IapState::Receiving) return IapBadState;
+        if(offset != received) return IapBadOffset;
+        if(len > image_size - received) return IapTooBig;
+
+        for(uint32_t i = 0; i < len; i++){
+            blocks[filling][fill[filling]++] = data[i];
+            if(fill[filling] == IAP_BLOCK_SIZE) commit_block();
+        }
+        received += len;
+
+        return state == IapState::Receiving ? static_cast<uint8_t>(IapOk) : static_cast<uint8_t>(status);
+    }
+
+    /// @brief programs the rest of image and checks crc
+    uint8_t finish(){
+        if(state != IapState::Receiving) return IapBadState;
+        if(received != image_size) return IapBadOffset;
+
+        uint8_t* bytes = blocks[filling];
+        while(fill[filling] % 4 != 0) bytes[fill[filling]++] = 0xFF;
+        if(fill[filling] != 0) commit_block();
+        while(programming && state == IapState::Receiving) program(IAP_BLOCK_SIZE / 4);
+        release_blocks();
+        if(state != IapState::Receiving) return status;
+
+        flash.end_programming();
+        flash.lock();
+
+        if(crc.compute(memory->words, (image_size + 3) / 4) != image_crc){
+            fail(IapCrcMismatch);
+            return status;
+        }
+        state = IapState::Done;
+        return IapOk;
+    }
+
+    /// @brief upload is in progress, flash is unlocked
+    bool is_active() const {
+        return state == IapState::Erasing || state == IapState::Receiving;
+    }
+
+    /// @brief poll() has block to program or answer to send
+    bool has_work() const {
+        return programming || (answer_begin && state != IapState::Erasing);
+    }
+
+    /// @brief call from main loop: programs next words of pending
+    ///         block and answers IapBegin after erase
+    void poll(FrameEncoder& encoder){
+        // failure in FLASH_IRQ keeps blocks, they are freed here
+        if(state == IapState::Failed && blocks[0] != nullptr) release_blocks();
+        if(answer_begin && state != IapState::Erasing){
+            answer_begin = false;
+            answer(encoder, IapBegin, state == IapState::Receiving ? IapOk : status);
+        }
+        program(IAP_WORDS_PER_POLL);
+    }
+
+    void on_frame(const Frame& frame, FrameEncoder& encoder){
+        if(frame.len < 1) return;
+        uint8_t op = frame.payload[0];
+        uint8_t result = IapMalformed;
+
+        switch(op){
+            case IapBegin:
+                if(frame.len != 9) break;
+                result = begin(read_le32(frame.payload + 1), read_le32(frame.payload + 5));
+                if(result == IapOk){
+                    answer_begin = true;
+                    return;
+                }
+                break;
+            case IapData:
+                if(frame.len < 5) break;
+                result = write(read_le32(frame.payload + 1), frame.payload + 5, frame.len - 5);
+                if(result == IapOk) return;
+                break;
+            case IapEnd:
+                result = finish();
+                break;
+            default:
+                break;
+        }
+        answer(encoder, op, result);
+    }
+
+    /// @brief FLASH_IRQ, continues erase sector by sector
+    void irq_handler(){
+        uint32_t errors = flash.get_errors();
+        flash.clear_status();
+        if(state != IapState::Erasing) return;
+
+        if(errors != 0){
+            fail(IapFlashError);
+            return;
+        }
+        if(++erase_sector <= erase_last){
+            flash.start_sector_erase(erase_sector);
+            return;
+        }
+
+        flash.interrupt_eop_disable();
+        flash.begin_programming();
+        state = IapState::Receiving;
+    }
+};
@@ -0,0 +1,192 @@
+#pragma once
+
+#include "driver.hpp"
+#include "timer_wheel.hpp"
+
+// Tickless idle: core sleeps until nearest SoftTimer expiry or any
+// interrupt, Systick::ticks are corrected after wake up. Sleep stretches
+// SysTick reload, Stop (enable_stop(), allowed per call) wakes by RTC
+// wakeup timer or USART RX start bit, whose first byte is lost.
+
+// shorter idle sleeps through periodic ticks
+#define IDLE_MIN_TICKS          2
+// Stop pays PLL lock and flash wake up on every exit
+#define IDLE_STOP_MIN_TICKS     10
+
+class PowerIdle final{
+    Systick& systick;
+    TimerWheel& timers;
+    SCB scb;
+    PWR pwr;
+    RTC rtc;
+    RCC* rcc = nullptr;
+    EXTI* exti = nullptr;
+    NVIC* nvic = nullptr;
+    uint8_t rx_line = 0;
+
+    /// @brief SysTick reload covers idle_ticks, interrupts are masked
+    void sleep(uint32_t idle_ticks){
+        uint32_t period = systick.get_reload();
+        // COUNTFLAG is stale, systick_handler does not read CSR
+        systick.stop_and_take_flag();
+        uint32_t current = systick.get_current_value();
+        if(scb.is_systick_pending() || current == 0){
+            // tick edge is due, its interrupt wakes up at once
+            systick.start();
+            wait_for_interrupt();
+            return;
+        }
+
+        uint32_t max_ticks = (0x01000000 - current) / period + 1;
+        if(idle_ticks > max_ticks) idle_ticks = max_ticks;
+        uint32_t reload = current + (idle_ticks - 1) * period;
+        systick.set_ticks(reload);
+        systick.registers->cvr = 0;
+        systick.start();
+
+        wait_for_interrupt();
+
+        bool expired = systick.stop_and_take_flag();
+        uint32_t left = systick.get_current_value();
+        uint32_t passed;
+        uint32_t partial;
+        if(expired){
+            // pending SysTick interrupt counts the deadline tick
+            uint32_t after = left == 0 ? 0 : reload - left;
+            passed = idle_ticks - 1 + after / period;
+            partial = period - after % period;
+        }
+        else{
+            // tick edges of stretched period lie at multiples of period
+            // before its end
+            passed = idle_ticks - 1 - left / period;
+            partial = left % period;
+            if(partial == 0) partial = 1;
+        }
+        Systick::ticks = Systick::ticks + passed;
+
+        // counter loads partial at once, period at next reload
+        systick.set_ticks(partial);
+        systick.registers->cvr = 0;
+        systick.start();
+        systick.set_ticks(period);
+
+        sleeps++;
+        slept_ticks += passed;
+    }
+
+    /// @brief RTC wakeup timer covers idle_ticks, interrupts are masked
+    void stop(uint32_t idle_ticks){
+        // Stop is ended at least every 32 s, RTC milliseconds wrap daily,
+        // 32 bit products (no 64 bit division without libgcc)
+        uint32_t max_ticks = RTC_WAKEUP_MAX / RTC_WAKEUP_HZ * Systick::tick_hz;
+        if(idle_ticks > max_ticks) idle_ticks = max_ticks;
+        uint32_t units = idle_ticks * RTC_WAKEUP_HZ / Systick::tick_hz;
+        if(units == 0) units = 1;
+
+        bool pll = rcc->is_pll_source();
+        uint32_t start = rtc.get_millis();
+        rtc.start_wakeup(units);
+
+        systick.stop();
+        exti->clear_pending(rx_line);
+        exti->interrupt_enable(rx_line);
+        pwr.configure_stop();
+        scb.set_sleep_deep(true);
+
+        wait_for_interrupt();
+
+        scb.set_sleep_deep(false);
+        if(pll) rcc->resume_pll();
+
+        // wake up is taken here, irq_handler() sees only later events
+        exti->interrupt_disable(rx_line);
+        exti->clear_pending(rx_line);
+        nvic->clear_pending(EXTI::get_irq(rx_line));
+        rtc.stop_wakeup();
+        exti->clear_pending(RTC_WAKEUP_LINE);
+        nvic->clear_pending(RTC_WKUP_IRQ);
+
+        uint32_t elapsed = RTC::elapsed_millis(start, rtc.get_millis());
+        uint32_t passed = elapsed * Systick::tick_hz / 1000;
+        Systick::ticks = Systick::ticks + passed;
+
+        systick.registers->cvr = 0;
+        systick.start();
+
+        stops++;
+        slept_ticks += passed;
+    }
+public:
+    uint32_t sleeps = 0;
+    uint32_t stops = 0;
+    /// @brief ticks which passed without SysTick interrupt
+    uint32_t slept_ticks = 0;
+
+    PowerIdle(Systick& systick, TimerWheel& timers) : systick(systick), timers(timers) {}
+
+    PowerIdle(const PowerIdle&) = delete;
+    PowerIdle& operator=(const PowerIdle&) = delete;
+
+    /// @brief starts RTC on LSI and prepares wake up from Stop by RTC
+    ///         and by falling edge of rx pin (line must not be used
+    ///         by a button), EXTI (SYSCFG) clock must be enabled
+    /// @return 1 if rx pin can't be routed or there is no RTC model
+    ///         on host or 0 if ok
+    uint8_t enable_stop(RCC& rcc, EXTI& exti, NVIC& nvic, uint8_t rx_num, uint8_t rx_letter){
+#ifdef HOST_BACKEND
+        (void)rcc; (void)exti; (void)nvic; (void)rx_num; (void)rx_letter;
+        return 1;
+#else
+        if(exti.route(rx_num, rx_letter)) return 1;
+
+        pwr.clock_enable(rcc);
+        pwr.backup_access(true);
+        rtc.start_lsi(rcc);
+
+        exti.set_edge(RTC_WAKEUP_LINE, ExtiEdge::Rising);
+        exti.clear_pending(RTC_WAKEUP_LINE);
+        exti.interrupt_enable(RTC_WAKEUP_LINE);
+        nvic.enable_interrupt(RTC_WKUP_IRQ);
+
+        exti.set_edge(rx_num, ExtiEdge::Falling);
+        nvic.enable_interrupt(EXTI::get_irq(rx_num));
+
+        this->rcc = &rcc;
+        this->exti = &exti;
+        this->nvic = &nvic;
+        rx_line = rx_num;
+        return 0;
+#endif
+    }
+
+    /// @brief RTC_WKUP and EXTI interrupt of rx line, clears wake up
+    ///         sources which fire outside of Stop
+    void irq_handler(){
+        if(exti == nullptr) return;
+        exti->clear_pending(rx_line);
+        rtc.stop_wakeup();
+        exti->clear_pending(RTC_WAKEUP_LINE);
+    }
+
+    /// @brief sleeps until next timer expiry or interrupt, must be
+    ///         called with interrupts masked, returns with them masked
+    /// @param allow_stop Stop instead of Sleep if enable_stop() was
+    ///         called and deadline is far enough
+    void enter(bool allow_stop = false){
+        if(Systick::tick_hz == 0){
+            wait_for_interrupt();
+            return;
+        }
+
+        // ticks counted here or in earlier idle which the
+        // wheel did not see yet
+        uint32_t lag = Systick::get_ticks() - timers.get_now();
+        uint32_t idle_ticks = timers.ticks_to_next(UINT32_T_MAX);
+        idle_ticks = idle_ticks > lag ? idle_ticks - lag : 0;
+
+        if(allow_stop && exti != nullptr && idle_ticks >= IDLE_STOP_MIN_TICKS) stop(idle_ticks);
+        else if(idle_ticks >= IDLE_MIN_TICKS) sleep(idle_ticks);
+        else wait_for_interrupt();
+    }
+};
@@ -0,0 +1,145 @@
+#pragma once
+
+#include "driver.hpp"
+#include "timer_wheel.hpp"
+
+// Debounced buttons on EXTI. Edge interrupt of the pin only stores tick
+// of the edge, masks the line (bounces are not seen) and starts settle
+// timer. When settle timer expires (systick_handler) pin is read again:
+// if level differs from last stable level, Press or Release event with
+// tick of the first edge is queued, line is unmasked again. Press starts
+// hold timer which queues LongPress if button is still pressed.
+//
+// Events of all buttons go to one InputEvents queue, producer is
+// systick_handler (timer wheel), consumer is main loop.
+
+#define INPUT_QUEUE_SIZE        16
+#define INPUT_SETTLE_TICKS      20
+#define INPUT_LONG_PRESS_TICKS  800
+
+enum class InputEventType : uint8_t { Press, Release, LongPress };
+
+struct InputEvent{
+    /// @brief Systick tick of the edge (of expiry for LongPress)
+    uint32_t tick;
+    /// @brief EXTI line (pin number) of button
+    uint8_t line;
+    InputEventType type;
+};
+
+class InputEvents final{
+    SpscQueue<InputEvent, INPUT_QUEUE_SIZE> events;
+public:
+    volatile uint32_t dropped = 0;
+
+    void push(const InputEvent& event){
+        if(!events.push(event)) dropped++;
+    }
+
+    bool pop(InputEvent& event){
+        return events.pop(event);
+    }
+
+    bool is_empty() const {
+        return events.is_empty();
+    }
+};
+
+class DebouncedButton final{
+    EXTI& exti;
+    TimerWheel& timers;
+    InputEvents& events;
+    Button button;
+    uint8_t line;
+    uint8_t port;
+    bool active_low;
+    volatile bool pressed = false;
+    volatile uint32_t edge_tick = 0;
+    SoftTimer settle;
+    SoftTimer hold;
+
+    bool read_pressed() const {
+        return button.is_pressed() != active_low;
+    }
+
+    void push(InputEventType type, uint32_t tick){
+        events.push(InputEvent{ tick, line, type });
+    }
+
+    static void on_settle(SoftTimer& timer, void* arg){
+        (void)timer;
+        static_cast<DebouncedButton*>(arg)->settled();
+    }
+
+    static void on_hold(SoftTimer& timer, void* arg){
+        DebouncedButton& self = *static_cast<DebouncedButton*>(arg);
+        if(self.pressed) self.push(InputEventType::LongPress, timer.get_expiry());
+    }
+
+    void settled(){
+        bool now_pressed = read_pressed();
+        if(now_pressed != pressed){
+            pressed = now_pressed;
+            if(pressed){
+                push(InputEventType::Press, edge_tick);
+                timers.start(hold, INPUT_LONG_PRESS_TICKS);
+            }
+            else{
+                push(InputEventType::Release, edge_tick);
+                timers.cancel(hold);
+            }
+        }
+
+        // edges while line was masked are pending or lost,
+        // level read after unmask catches the lost ones
+        exti.clear_pending(line);
+        exti.interrupt_enable(line);
+        if(read_pressed() != pressed) edge(Systick::get_ticks());
+    }
+
+    void edge(uint32_t tick){
+        exti.interrupt_disable(line);
+        edge_tick = tick;
+        timers.start(settle, INPUT_SETTLE_TICKS);
+    }
+public:
+    /// @param active_low button pulls pin to ground when pressed
+    DebouncedButton(EXTI& exti, TimerWheel& timers, InputEvents& events,
+            uint8_t num, uint8_t letter, bool active_low) :
+        exti(exti), timers(timers), events(events), button(num, letter),
+        line(num), port(letter), active_low(active_low),
+        settle(&on_settle, this), hold(&on_hold, this) {}
+
+    DebouncedButton(const DebouncedButton&) = delete;
+    DebouncedButton& operator=(const DebouncedButton&) = delete;
+
+    /// @brief pin must be configured as input, GPIO and SYSCFG clocks
+    ///         must be enabled, takes current level as stable one
+    /// @return 1 if pin can't be routed to EXTI or 0 if ok
+    uint8_t start(NVIC& nvic){
+        if(exti.route(line, port)) return 1;
+
+        pressed = read_pressed();
+        exti.set_edge(line, ExtiEdge::Both);
+        exti.clear_pending(line);
+        exti.interrupt_enable(line);
+        nvic.enable_interrupt(EXTI::get_irq(line));
+        return 0;
+    }
+
+    bool is_pressed() const {
+        return pressed;
+    }
+
+    uint8_t get_line() const {
+        return line;
+    }
+
+    /// @brief must be called from EXTI interrupt handler of line,
+    ///         shared handlers (lines 5..15) call every button
+    void irq_handler(){
+        if(!exti.is_pending(line)) return;
+        exti.clear_pending(line);
+        edge(Systick::get_ticks());
+    }
+};
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "driver.hpp"
+
+// Interrupt binding.
+//
+// Compile time: vector table in startup.c keeps weak handlers named
+// <peripheral>_handler, IRQ_BIND defines one of them as direct call of
+// a method of object with static storage, the call is inlined so the
+// vector runs the method without loading any pointer:
+//
+//   static USART usart = { 1, 9, 'A', 10, 'A' };
+//   IRQ_BIND(usart1_handler, usart, irq_handler)
+//
+// Run time: VectorTable::relocate() copies the active table into SRAM
+// and points VTOR to it, after that set_handler() changes vectors.
+// SRAM vectors are fetched without flash wait states, IRQ_BIND_RAM puts
+// the handler itself into SRAM too. Only the vector function is sure to
+// be in SRAM: the method is inlined into it, but its own callees (inline
+// members GCC emits out of line, callbacks) can stay in flash .text.
+// release.map of `make release` shows what .ramfunc really holds.
+
+template<auto& Object, auto Method>
+[[gnu::always_inline]] inline void irq_call(){
+    (Object.*Method)();
+}
+
+#define IRQ_BIND(vector, object, method) \
+    extern "C" void vector(){ \
+        irq_call<object, &decltype(object)::method>(); \
+    }
+
+/// @brief IRQ_BIND with vector and inlined method in SRAM (RAMFUNC)
+#define IRQ_BIND_RAM(vector, object, method) \
+    extern "C" RAMFUNC void vector(){ \
+        irq_call<object, &decltype(object)::method>(); \
+    }
+
+typedef void (*IrqHandler)();
+
+class VectorTable final{
+    alignas(512) static inline uint32_t table[VECTOR_TABLE_SIZE];
+    static inline bool relocated = false;
+public:
+    VectorTable() = delete;
+
+    /// @brief copies current table into SRAM and activates it,
+    ///         interrupts are masked while VTOR is switched
+    static void relocate(){
+#ifndef HOST_BACKEND
+        IrqLock lock;
+        SCB scb;
+        const uint32_t* current = reinterpret_cast<const uint32_t*>(scb.get_vector_table());
+        for(uint32_t i = 0; i < VECTOR_TABLE_SIZE; i++) table[i] = current[i];
+        scb.set_vector_table(reinterpret_cast<uint32_t>(table));
+#endif
+        relocated = true;
+    }
+
+    static bool is_relocated(){
+        return relocated;
+    }
+
+    /// @brief replaces handler of peripheral interrupt, table must be relocated
+    /// @return 1 if table is not relocated or irq is out of range or 0 if ok
+    static uint8_t set_handler(uint16_t irq, IrqHandler handler){
+        if(!relocated || irq >= IRQ_COUNT) return 1;
+
+#ifdef HOST_BACKEND
+        host::Bus::instance().attach_irq(irq, handler);
+#else
+        table[16 + irq] = reinterpret_cast<uint32_t>(handler);
+        sync_barrier();
+#endif
+        return 0;
+    }
+
+    static IrqHandler get_handler(uint16_t irq){
+        if(!relocated || irq >= IRQ_COUNT) return nullptr;
+        return reinterpret_cast<IrqHandler>(table[16 + irq]);
+    }
+};
+
+/// @brief cycles from software pend (ISPR write) of irq until its handler
+///         starts: bus write, exception entry and stacking. irq must be
+///         unused, it is disabled again and its handler restored.
+class IrqLatency final{
+    static inline volatile uint32_t entered = 0;
+
+    static void probe(){
+        entered = DWT::cycles();
+    }
+public:
+    IrqLatency() = delete;
+
+    /// @return 0 if table is not relocated or irq is out of range
+    static uint32_t measure(NVIC& nvic, uint16_t irq){
+        IrqHandler previous = VectorTable::get_handler(irq);
+        if(VectorTable::set_handler(irq, &probe) != 0) return 0;
+
+        entered = 0;
+        nvic.clear_pending(irq);
+        nvic.enable_interrupt(irq);
+
+        uint32_t start = DWT::cycles();
+        nvic.set_pending(irq);
+        sync_barrier();
+        while(entered == 0);
+
+        nvic.disable_interrupt(irq);
+        VectorTable::set_handler(irq, previous);
+
+        return entered - start;
+    }
+};
@@ -0,0 +1,320 @@
+#pragma once
+
+#include "driver.hpp"
+#include "frame.hpp"
+
+// Static memory budget. mem.ld reserves the pool region (_spool.._epool)
+// and the main stack (_sstack.._estack) at the top of SRAM and fails
+// the link if .data, .bss, pools and stack do not fit.
+//
+// Pool region is split into fixed block pools of pool_layout, one per
+// size class. Blocks are kept in intrusive free lists, alloc and free
+// are O(1) with interrupts masked for a few instructions, so they can
+// be called from interrupt handlers. PoolPtr owns one block and returns
+// it to its pool when destroyed.
+//
+// reset_handler paints unused stack with STACK_PAINT, first overwritten
+// word gives the stack high water mark.
+//
+// Memory::dump sends one frame of type MEMORY_FRAME_TYPE:
+//   classes(u8) then per class block_size(u16) count(u16) used(u16)
+//   high_water(u16) failures(u32), then stack_size(u32) stack_used(u32)
+//   alloc_failures(u32), all little endian.
+
+#define STACK_PAINT         0xA5A5A5A5
+#define MEMORY_FRAME_TYPE   0xF2
+
+struct PoolClass{
+    uint16_t block_size;
+    uint16_t count;
+};
+
+/// @brief size classes, smallest first, block sizes are multiple of 8,
+///         total size must not exceed _pool_size of mem.ld
+inline constexpr PoolClass pool_layout[] = {
+    { 32, 64 },
+    { 128, 16 },
+    { 1024, 4 },
+};
+
+#define POOL_CLASSES (sizeof(pool_layout) / sizeof(pool_layout[0]))
+
+constexpr uint32_t pool_layout_bytes(){
+    uint32_t bytes = 0;
+    for(const PoolClass& pool : pool_layout) bytes += pool.block_size * pool.count;
+    return bytes;
+}
+
+#ifdef HOST_BACKEND
+alignas(8) inline uint8_t host_pool_region[pool_layout_bytes()];
+#else
+// mem.ld
+extern "C" uint8_t _spool[], _epool[];
+extern "C" uint32_t _sstack[], _estack[];
+#endif
+
+class BlockPool final{
+    struct FreeBlock{
+        FreeBlock* next;
+    };
+
+    FreeBlock* free_list = nullptr;
+    uint8_t* memory = nullptr;
+    uint16_t block_size = 0;
+    uint16_t count = 0;
+    volatile uint16_t used = 0;
+    volatile uint16_t high_water = 0;
+    /// @brief requests which found the pool empty
+    volatile uint32_t failures = 0;
+public:
+    void init(uint8_t* region, uint16_t size, uint16_t blocks){
+        memory = region;
+        block_size = size;
+        count = blocks;
+        used = high_water = 0;
+        failures = 0;
+
+        free_list = nullptr;
+        for(uint16_t i = blocks; i > 0; i--){
+            FreeBlock* block = reinterpret_cast<FreeBlock*>(region + (i - 1) * size);
+            block->next = free_list;
+            free_list = block;
+        }
+    }
+
+    /// @return nullptr if pool is empty
+    void* alloc(){
+        IrqLock lock;
+
+        FreeBlock* block = free_list;
+        if(block == nullptr){
+            failures++;
+            return nullptr;
+        }
+        free_list = block->next;
+        if(++used > high_water) high_water = used;
+
+        return block;
+    }
+
+    void free(void* pointer){
+        IrqLock lock;
+
+        FreeBlock* block = static_cast<FreeBlock*>(pointer);
+        block->next = free_list;
+        free_list = block;
+        used--;
+    }
+
+    bool owns(const void* pointer) const {
+        const uint8_t* byte = static_cast<const uint8_t*>(pointer);
+        return byte >= memory && byte < memory + block_size * count;
+    }
+
+    uint16_t get_block_size() const {
+        return block_size;
+    }
+
+    uint16_t get_count() const {
+        return count;
+    }
+
+    uint16_t get_used() const {
+        return used;
+    }
+
+    uint16_t get_high_water() const {
+        return high_water;
+    }
+
+    uint32_t get_failures() const {
+        return failures;
+    }
+};
+
+class Pools final{
+    static inline BlockPool pools[POOL_CLASSES];
+public:
+    /// @brief requests which no pool could serve
+    static inline volatile uint32_t failures = 0;
+
+    Pools() = delete;
+
+    /// @brief splits pool region of mem.ld, must be called before
+    ///         first alloc
+    /// @return 1 if pool_layout does not fit the region or 0 if ok
+    static uint8_t init(){
+#ifdef HOST_BACKEND
+        uint8_t* region = host_pool_region;
+        uint32_t size = sizeof(host_pool_region);
+#else
+        uint8_t* region = _spool;
+        uint32_t size = _epool - _spool;
+#endif
+        if(pool_layout_bytes() > size) return 1;
+
+        for(uint8_t i = 0; i < POOL_CLASSES; i++){
+            pools[i].init(region, pool_layout[i].block_size, pool_layout[i].count);
+            region += pool_layout[i].block_size * pool_layout[i].count;
+        }
+        return 0;
+    }
+
+    /// @brief block of the smallest class which fits size and is not
+    ///         empty, 8 byte aligned
+    /// @return nullptr if no block is free
+    static void* alloc(uint32_t size){
+        for(BlockPool& pool : pools){
+            if(pool.get_block_size() < size) continue;
+            void* block = pool.alloc();
+            if(block != nullptr) return block;
+        }
+        failures++;
+        return nullptr;
+    }
+
+    /// @brief pointer must come from alloc(), nullptr is ignored
+    static void free(void* block){
+        if(block == nullptr) return;
+        for(BlockPool& pool : pools){
+            if(pool.owns(block)){
+                pool.free(block);
+                return;
+            }
+        }
+    }
+
+    static const BlockPool& get(uint8_t index){
+        return pools[index];
+    }
+};
+
+/// @brief owner of one pool block, movable, not copyable
+class PoolPtr final{
+    uint8_t* block = nullptr;
+    uint32_t length = 0;
+public:
+    PoolPtr() = default;
+
+    /// @brief empty (false) if no block of size is free
+    explicit PoolPtr(uint32_t size) :
+        block(static_cast<uint8_t*>(Pools::alloc(size))), length(block != nullptr ? size : 0) {}
+
+    PoolPtr(PoolPtr&& other) : block(other.block), length(other.length){
+        other.block = nullptr;
+        other.length = 0;
+    }
+
+    PoolPtr& operator=(PoolPtr&& other){
+        if(this != &other){
+            reset();
+            block = other.block;
+            length = other.length;
+            other.block = nullptr;
+            other.length = 0;
+        }
+        return *this;
+    }
+
+    PoolPtr(const PoolPtr&) = delete;
+    PoolPtr& operator=(const PoolPtr&) = delete;
+
+    ~PoolPtr(){
+        reset();
+    }
+
+    /// @brief takes block given up with release(), e.g. after it
+    ///         passed an SpscQueue from interrupt handler
+    static PoolPtr adopt(uint8_t* block, uint32_t size){
+        PoolPtr pointer;
+        pointer.block = block;
+        pointer.length = block != nullptr ? size : 0;
+        return pointer;
+    }
+
+    /// @brief gives up ownership, block must come back with adopt()
+    ///         or Pools::free()
+    uint8_t* release(){
+        uint8_t* released = block;
+        block = nullptr;
+        length = 0;
+        return released;
+    }
+
+    void reset(){
+        Pools::free(block);
+        block = nullptr;
+        length = 0;
+    }
+
+    uint8_t* get() const {
+        return block;
+    }
+
+    template<typename T>
+    T* as() const {
+        return reinterpret_cast<T*>(block);
+    }
+
+    /// @brief requested size, block can be bigger
+    uint32_t size() const {
+        return length;
+    }
+
+    explicit operator bool() const {
+        return block != nullptr;
+    }
+};
+
+class Memory final{
+public:
+    Memory() = delete;
+
+    static uint32_t stack_size(){
+#ifdef HOST_BACKEND
+        return 0;
+#else
+        return (_estack - _sstack) * 4;
+#endif
+    }
+
+    /// @brief deepest main stack use since reset in bytes
+    static uint32_t stack_used(){
+#ifdef HOST_BACKEND
+        return 0;
+#else
+        const uint32_t* word = _sstack;
+        while(word < _estack && *word == STACK_PAINT) word++;
+        return (_estack - word) * 4;
+#endif
+    }
+
+    /// @brief lowest stack word was overwritten, stack is exhausted
+    static bool stack_overflowed(){
+#ifdef HOST_BACKEND
+        return false;
+#else
+        return _sstack[0] != STACK_PAINT;
+#endif
+    }
+
+    static void dump(FrameEncoder& encoder){
+        uint8_t payload[1 + POOL_CLASSES * 12 + 12];
+        uint8_t* out = payload;
+
+        *out++ = POOL_CLASSES;
+        for(uint8_t i = 0; i < POOL_CLASSES; i++, out += 12){
+            const BlockPool& pool = Pools::get(i);
+            write_le16(out, pool.get_block_size());
+            write_le16(out + 2, pool.get_count());
+            write_le16(out + 4, pool.get_used());
+            write_le16(out + 6, pool.get_high_water());
+            write_le32(out + 8, pool.get_failures());
+        }
+        write_le32(out, stack_size());
+        write_le32(out + 4, stack_used());
+        write_le32(out + 8, Pools::failures);
+
+        encoder.send(MEMORY_FRAME_TYPE, payload, sizeof(payload));
+    }
+};
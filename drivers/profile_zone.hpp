@@ -0,0 +1,96 @@
+#pragma once
+
+// Cycle profiler on DWT CYCCNT. PROFILE_ZONE(zone) measures the rest of
+// the enclosing scope: count, min, max, sum and log2 histogram of cycles
+// are kept in a static table. Zone must be entered from one context only
+// (main loop or one interrupt handler), stats are not locked.
+//
+// Included by driver.hpp after DWT, so drivers can have zones,
+// Profiler::dump (frame output) is in profiler.hpp.
+//
+// Define PROFILER_DISABLED to compile zones out.
+
+class FrameEncoder;
+
+#define PROFILER_MAX_ZONES      16
+#define PROFILER_HIST_BUCKETS   24
+
+enum ProfileZone : uint8_t {
+    ZoneMainLoop,
+    ZoneConfigPll,
+    ZoneUsartWrite,
+    ZoneUsartIrq,
+    ZoneSystickIrq,
+    ZoneProfilerDump,
+    ZoneCount
+};
+static_assert(ZoneCount <= PROFILER_MAX_ZONES, "too many profile zones");
+
+struct ZoneStats{
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint32_t sum_low;
+    uint32_t sum_high;
+    uint32_t histogram[PROFILER_HIST_BUCKETS];
+};
+
+class Profiler final{
+public:
+    static inline ZoneStats zones[PROFILER_MAX_ZONES];
+
+    Profiler() = delete;
+
+    static void record(uint8_t zone, uint32_t cycles){
+        ZoneStats& stats = zones[zone];
+
+        if(stats.count == 0 || cycles < stats.min) stats.min = cycles;
+        if(cycles > stats.max) stats.max = cycles;
+        stats.count++;
+
+        uint32_t sum = stats.sum_low + cycles;
+        if(sum < cycles) stats.sum_high++;
+        stats.sum_low = sum;
+
+        uint32_t bucket = 31 - __builtin_clz(cycles | 1);
+        if(bucket >= PROFILER_HIST_BUCKETS) bucket = PROFILER_HIST_BUCKETS - 1;
+        stats.histogram[bucket]++;
+    }
+
+    static void reset(){
+        IrqLock lock;
+
+        for(ZoneStats& stats : zones){
+            stats.count = stats.min = stats.max = 0;
+            stats.sum_low = stats.sum_high = 0;
+            for(uint32_t& bucket : stats.histogram) bucket = 0;
+        }
+    }
+
+    /// @brief sends stats of used zones, defined by profiler.hpp
+    static void dump(FrameEncoder& encoder);
+};
+
+/// @brief records cycles between construction and destruction
+class ProfileScope final{
+    uint8_t zone;
+    uint32_t start;
+public:
+    explicit ProfileScope(uint8_t zone) : zone(zone), start(DWT::cycles()) {}
+
+    ~ProfileScope(){
+        Profiler::record(zone, DWT::cycles() - start);
+    }
+
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+
+#ifdef PROFILER_DISABLED
+#define PROFILE_ZONE(zone)
+#else
+#define PROFILE_ZONE(zone) ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(zone)
+#endif
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "driver.hpp"
+#include "frame.hpp"
+
+// Profiler::dump sends one frame of type PROFILER_FRAME_TYPE per used
+// zone of PROFILE_ZONE (profile_zone.hpp):
+//   zone(u8) buckets(u8) count(u32) min(u32) max(u32) sum(u64)
+//   histogram[buckets](u32), bucket n - durations of 2^n..2^(n+1)-1 cycles
+// all little endian, mean = sum / count.
+
+#define PROFILER_FRAME_TYPE     0xF0
+
+inline void Profiler::dump(FrameEncoder& encoder){
+    uint8_t payload[2 + 5 * 4 + PROFILER_HIST_BUCKETS * 4];
+
+    for(uint8_t zone = 0; zone < PROFILER_MAX_ZONES; zone++){
+        {
+            // snapshot, zone can be updated by interrupt handler
+            IrqLock lock;
+            const ZoneStats& stats = zones[zone];
+            if(stats.count == 0) continue;
+
+            payload[0] = zone;
+            payload[1] = PROFILER_HIST_BUCKETS;
+            write_le32(payload + 2, stats.count);
+            write_le32(payload + 6, stats.min);
+            write_le32(payload + 10, stats.max);
+            write_le32(payload + 14, stats.sum_low);
+            write_le32(payload + 18, stats.sum_high);
+            for(uint8_t i = 0; i < PROFILER_HIST_BUCKETS; i++)
+                write_le32(payload + 22 + i * 4, stats.histogram[i]);
+        }
+        encoder.send(PROFILER_FRAME_TYPE, payload, sizeof(payload));
+    }
+}
@@ -0,0 +1,315 @@
+#pragma once
+
+#include "driver.hpp"
+#include "frame.hpp"
+#include "iap.hpp"
+
+// Execution of user code from SRAM (USER_RAM_BASE, see mem.ld), no
+// flash erase is needed to try new code.
+//
+// payload of RunCode frame:  op(u8) ...
+//   RamBegin   size(u32)           start new image
+//   RamData    offset(u32) data[]  next part of image
+//   RamRun                         check image and run it
+// answer (RunCode frame):
+//   op(u8) status(u8) received(u32)                  RamBegin, errors
+//   op(u8) status(u8) reason(u8) exception(u8) value(u32)
+//      cfsr(u32) hfsr(u32) fault_address(u32)       RamRun
+//
+// image: header  magic(u32) size(u32) crc(u32) entry(u32) vectors(u32)
+//        followed by position independent code and data.
+// size counts the whole image with header, crc is CRC-32/MPEG-2 (CRC unit)
+// of bytes after header as little endian words, last word padded with
+// 0xFF. entry and vectors are offsets from image start, entry with thumb
+// bit. Optional vector table (vectors != 0, word aligned) holds offsets
+// as well, it is relocated into RAM table of supervisor which becomes
+// VTOR during run: 0 keeps supervisor handler, fault and SVCall entries
+// always lead back to supervisor, image itself is not modified.
+//
+// Entry runs as uint32_t entry(void) in thread mode on supervisor stack.
+// Run ends when entry returns, when user code executes svc with exit
+// value in r0, or on fault raised in thread mode, then callee saved core
+// and FP registers and VTOR of supervisor are restored.
+//
+// Header defines the trampolines in top level asm, so it is included
+// by one translation unit only (main.cpp).
+
+#define RAM_IMAGE_MAGIC         0x4D415255
+#define RAM_IMAGE_HEADER_SIZE   20
+#define RAM_IMAGE_VECTORS       VECTOR_TABLE_SIZE
+#define RAM_IMAGE_VECTOR_ALIGN  512
+#define RAM_EXEC_ANSWER_SIZE    20
+
+enum RamOp : uint8_t { RamBegin, RamData, RamRun };
+
+enum RamExitReason : uint8_t { RamReturned, RamExit, RamFault, RamNotRun };
+
+struct RamImageHeader{
+    uint32_t magic;
+    uint32_t size;
+    uint32_t crc;
+    uint32_t entry;
+    uint32_t vectors;
+};
+static_assert(sizeof(RamImageHeader) == RAM_IMAGE_HEADER_SIZE, "packed header expected");
+
+struct RamExitInfo{
+    uint8_t reason;
+    /// @brief exception number for RamExit (11) and RamFault
+    uint8_t exception;
+    /// @brief return or svc value, faulting pc for RamFault
+    uint32_t value;
+    uint32_t cfsr;
+    uint32_t hfsr;
+    /// @brief MMFAR or BFAR if CFSR marks it valid, 0 otherwise
+    uint32_t fault_address;
+};
+
+#ifndef HOST_BACKEND
+extern "C" uint32_t ram_exec_call(uint32_t entry, volatile uint32_t* saved_sp);
+extern "C" void ram_exec_resume();
+extern "C" void ram_exec_trap();
+#endif
+
+class RamExec final{
+    CRC& crc;
+    uint32_t* memory;
+    uint32_t expected = 0;
+    uint32_t received = 0;
+
+    void answer(FrameEncoder& encoder, uint8_t op, uint8_t result){
+        uint8_t payload[6];
+        payload[0] = op;
+        payload[1] = result;
+        write_le32(payload + 2, received);
+        encoder.send(frame_type, payload, sizeof(payload));
+    }
+
+    void answer_run(FrameEncoder& encoder, uint8_t result, const RamExitInfo& info){
+        uint8_t payload[RAM_EXEC_ANSWER_SIZE];
+        payload[0] = RamRun;
+        payload[1] = result;
+        payload[2] = info.reason;
+        payload[3] = info.exception;
+        write_le32(payload + 4, info.value);
+        write_le32(payload + 8, info.cfsr);
+        write_le32(payload + 12, info.hfsr);
+        write_le32(payload + 16, info.fault_address);
+        encoder.send(frame_type, payload, sizeof(payload));
+    }
+public:
+    /// @brief stack pointer of supervisor while user code runs, 0 otherwise
+    static inline volatile uint32_t saved_sp = 0;
+    static inline RamExitInfo last_exit;
+    /// @brief VTOR while user code runs
+    alignas(RAM_IMAGE_VECTOR_ALIGN) static inline uint32_t vector_table[RAM_IMAGE_VECTORS];
+
+    /// @brief frame type of answers, RunCode command of main
+    uint8_t frame_type;
+
+    RamExec(CRC& crc, uint32_t* memory, uint8_t frame_type) :
+        crc(crc), memory(memory), frame_type(frame_type) {}
+
+    RamExec(const RamExec&) = delete;
+    RamExec& operator=(const RamExec&) = delete;
+
+    uint8_t begin(uint32_t size){
+        if(size < RAM_IMAGE_HEADER_SIZE || size > USER_RAM_SIZE) return IapTooBig;
+
+        expected = size;
+        received = 0;
+        return IapOk;
+    }
+
+    uint8_t write(uint32_t offset, const uint8_t* data, uint32_t len){
+        if(offset != received) return IapBadOffset;
+        if(len > expected - received) return IapTooBig;
+
+        uint8_t* bytes = reinterpret_cast<uint8_t*>(memory);
+        for(uint32_t i = 0; i < len; i++) bytes[received + i] = data[i];
+        received += len;
+
+        return IapOk;
+    }
+
+    /// @brief validates header and crc of complete image
+    uint8_t check(){
+        if(expected == 0 || received != expected) return IapBadOffset;
+
+        const RamImageHeader& header = *reinterpret_cast<const RamImageHeader*>(memory);
+        uint32_t code = header.entry & ~1;
+        if(header.magic != RAM_IMAGE_MAGIC || header.size != received
+                || (header.entry & 1) == 0
+                || code < RAM_IMAGE_HEADER_SIZE || code >= header.size)
+            return IapBadHeader;
+        if(header.vectors != 0 && (header.vectors % 4 != 0
+                || header.vectors < RAM_IMAGE_HEADER_SIZE
+                || header.vectors + RAM_IMAGE_VECTORS * 4 > header.size))
+            return IapBadHeader;
+
+        uint8_t* bytes = reinterpret_cast<uint8_t*>(memory);
+        for(uint32_t i = received; i % 4 != 0; i++) bytes[i] = 0xFF;
+
+        uint32_t words = (received - RAM_IMAGE_HEADER_SIZE + 3) / 4;
+        if(crc.compute(memory + RAM_IMAGE_HEADER_SIZE / 4, words) != header.crc)
+            return IapCrcMismatch;
+
+        return IapOk;
+    }
+
+    /// @brief builds vector table for run from image offsets
+    /// @param image vector table of image or nullptr
+    static void relocate_vectors(uint32_t* table, const uint32_t* image,
+            const uint32_t* supervisor, uint32_t base, uint32_t trap){
+        table[0] = supervisor[0];
+        for(uint32_t i = 1; i < RAM_IMAGE_VECTORS; i++){
+            uint32_t offset = image != nullptr ? image[i] : 0;
+            // hard fault, memory management, bus, usage fault, svcall
+            if((i >= 3 && i <= 6) || i == 11) table[i] = trap;
+            else if(offset == 0) table[i] = supervisor[i];
+            else table[i] = base + offset;
+        }
+    }
+
+    /// @brief checks image and runs it until it returns, exits or faults
+    /// @return status of check, info is valid if status is IapOk
+    uint8_t run(RamExitInfo& info){
+        uint8_t status = check();
+        if(status != IapOk) return status;
+
+        last_exit = RamExitInfo{ RamNotRun, 0, 0, 0, 0, 0 };
+
+#ifndef HOST_BACKEND
+        const RamImageHeader& header = *reinterpret_cast<const RamImageHeader*>(memory);
+        SCB scb;
+        uint32_t supervisor = scb.get_vector_table();
+        uint32_t base = reinterpret_cast<uint32_t>(memory);
+
+        relocate_vectors(vector_table,
+            header.vectors != 0 ? memory + header.vectors / 4 : nullptr,
+            reinterpret_cast<const uint32_t*>(supervisor), base,
+            reinterpret_cast<uint32_t>(&ram_exec_trap));
+
+        scb.clear_faults();
+        last_exit.reason = RamReturned;
+        scb.set_vector_table(reinterpret_cast<uint32_t>(vector_table));
+
+        uint32_t value = ram_exec_call(base + header.entry, &saved_sp);
+
+        scb.set_vector_table(supervisor);
+        saved_sp = 0;
+        if(last_exit.reason == RamReturned) last_exit.value = value;
+#endif
+
+        info = last_exit;
+        return IapOk;
+    }
+
+    /// @brief RunCode frame, RamRun answers after user code ended
+    void on_frame(const Frame& frame, FrameEncoder& encoder){
+        if(frame.len < 1) return;
+        uint8_t op = frame.payload[0];
+        uint8_t result = IapMalformed;
+
+        switch(op){
+            case RamBegin:
+                if(frame.len != 5) break;
+                result = begin(read_le32(frame.payload + 1));
+                break;
+            case RamData:
+                if(frame.len < 5) break;
+                result = write(read_le32(frame.payload + 1), frame.payload + 5, frame.len - 5);
+                if(result == IapOk) return;
+                break;
+            case RamRun: {
+                RamExitInfo info = { RamNotRun, 0, 0, 0, 0, 0 };
+                result = run(info);
+                answer_run(encoder, result, info);
+                return;
+            }
+            default:
+                break;
+        }
+        answer(encoder, op, result);
+    }
+};
+
+#ifndef HOST_BACKEND
+/// @brief called by ram_exec_trap with stacked frame of svc or fault,
+///         fakes exception return into ram_exec_resume on supervisor stack
+extern "C" [[noreturn, gnu::used]] void ram_exec_return(uint32_t* frame){
+    SCB scb;
+    // fault of supervisor or inside a handler can not be unwound
+    if(RamExec::saved_sp == 0 || !scb.returns_to_base())
+        while(true) asm volatile("wfi");
+
+    uint32_t ipsr;
+    asm volatile("mrs %0, ipsr" : "=r"(ipsr));
+
+    RamExitInfo& info = RamExec::last_exit;
+    info.exception = ipsr & 0x1FF;
+    if(info.exception == 11){
+        info.reason = RamExit;
+        info.value = frame[0];
+    }
+    else{
+        uint32_t cfsr = scb.registers->cfsr;
+        info.reason = RamFault;
+        info.value = frame[6];
+        info.cfsr = cfsr;
+        info.hfsr = scb.registers->hfsr;
+        info.fault_address = (cfsr & (1 << 15)) ? scb.registers->bfar
+            : (cfsr & (1 << 7)) ? scb.registers->mmfar : 0;
+        scb.clear_faults();
+    }
+
+    // lazy FP state of user code is dropped, frame below has no FP part
+    *PERIPHERAL(reg32_t, FPCCR_BASE) &= ~1;
+
+    uint32_t* resume = reinterpret_cast<uint32_t*>(RamExec::saved_sp - 32);
+    resume[0] = info.value;
+    for(uint8_t i = 1; i < 6; i++) resume[i] = 0;
+    resume[6] = reinterpret_cast<uint32_t>(&ram_exec_resume) & ~1;
+    resume[7] = 1 << 24;
+
+    asm volatile(
+        "msr msp, %0    \n\t"
+        "bx %1"
+        :: "r"(resume), "r"(0xFFFFFFF9) : "memory");
+    __builtin_unreachable();
+}
+
+// ram_exec_call(entry, &saved_sp) keeps callee saved registers on stack
+// (10 core words and 16 FP words, stack stays 8 byte aligned), stores sp
+// and calls entry; ram_exec_resume is also the target of ram_exec_return.
+// ram_exec_trap passes stacked frame of svc or fault to ram_exec_return.
+asm(
+    "   .pushsection .text          \n"
+    "   .syntax unified             \n"
+    "   .thumb                      \n"
+    "   .global ram_exec_call       \n"
+    "   .type ram_exec_call, %function  \n"
+    "   .thumb_func                 \n"
+    "ram_exec_call:                 \n"
+    "   push {r3-r11, lr}           \n"
+    "   vpush {s16-s31}             \n"
+    "   mov r2, sp                  \n"
+    "   str r2, [r1]                \n"
+    "   blx r0                      \n"
+    "   .global ram_exec_resume     \n"
+    "   .thumb_func                 \n"
+    "ram_exec_resume:               \n"
+    "   vpop {s16-s31}              \n"
+    "   pop {r3-r11, pc}            \n"
+    "   .global ram_exec_trap       \n"
+    "   .type ram_exec_trap, %function  \n"
+    "   .thumb_func                 \n"
+    "ram_exec_trap:                 \n"
+    "   tst lr, #4                  \n"
+    "   ite eq                      \n"
+    "   mrseq r0, msp               \n"
+    "   mrsne r0, psp               \n"
+    "   b ram_exec_return           \n"
+    "   .popsection                 \n"
+);
+#endif
@@ -0,0 +1,144 @@
+#pragma once
+
+// Lock-free single producer / single consumer queue (interrupt handler
+// and main loop). Each side writes only its own free running counter
+// and publishes it with release, spans give contiguous slots for DMA.
+//
+// Included by driver.hpp after its integer typedefs, standalone (host
+// test) it takes them from <cstdint>.
+
+#ifndef UINT32_T_MAX
+#include <cstdint>
+#endif
+
+template<typename T>
+struct QueueSpan{
+    T* data;
+    uint32_t size;
+};
+
+/// @tparam SIZE must be power of two
+template<typename T, uint32_t SIZE>
+class SpscQueue final{
+    static_assert(SIZE != 0 && (SIZE & (SIZE - 1)) == 0, "SpscQueue SIZE must be power of two");
+
+    T data[SIZE];
+    uint32_t head = 0;
+    uint32_t tail = 0;
+
+    static uint32_t load_own(const uint32_t& counter){
+        return __atomic_load_n(&counter, __ATOMIC_RELAXED);
+    }
+
+    static uint32_t load_other(const uint32_t& counter){
+        return __atomic_load_n(&counter, __ATOMIC_ACQUIRE);
+    }
+
+    static void publish(uint32_t& counter, uint32_t value){
+        __atomic_store_n(&counter, value, __ATOMIC_RELEASE);
+    }
+public:
+    static constexpr uint32_t capacity(){
+        return SIZE;
+    }
+
+    /// @brief producer side
+    bool push(const T& value){
+        uint32_t current = load_own(head);
+        if(current - load_other(tail) == SIZE) return false;
+
+        data[current & (SIZE - 1)] = value;
+        publish(head, current + 1);
+
+        return true;
+    }
+
+    /// @brief producer side, copies as many values as fit
+    /// @return count of queued values
+    uint32_t push(const T* values, uint32_t count){
+        uint32_t current = load_own(head);
+        uint32_t space = SIZE - (current - load_other(tail));
+        if(count > space) count = space;
+
+        for(uint32_t i = 0; i < count; i++) data[(current + i) & (SIZE - 1)] = values[i];
+        publish(head, current + count);
+
+        return count;
+    }
+
+    /// @brief consumer side
+    bool pop(T& value){
+        uint32_t current = load_own(tail);
+        if(load_other(head) == current) return false;
+
+        value = data[current & (SIZE - 1)];
+        publish(tail, current + 1);
+
+        return true;
+    }
+
+    /// @brief consumer side
+    /// @return count of values written to values
+    uint32_t pop(T* values, uint32_t max){
+        uint32_t current = load_own(tail);
+        uint32_t count = load_other(head) - current;
+        if(count > max) count = max;
+
+        for(uint32_t i = 0; i < count; i++) values[i] = data[(current + i) & (SIZE - 1)];
+        publish(tail, current + count);
+
+        return count;
+    }
+
+    /// @brief producer side, contiguous free slots, they are
+    ///         queued by commit()
+    QueueSpan<T> write_span(){
+        uint32_t current = load_own(head);
+        uint32_t space = SIZE - (current - load_other(tail));
+        uint32_t index = current & (SIZE - 1);
+        uint32_t contiguous = SIZE - index;
+
+        return QueueSpan<T>{ &data[index], space < contiguous ? space : contiguous };
+    }
+
+    /// @param count values written to last write_span(), not more than its size
+    void commit(uint32_t count){
+        publish(head, load_own(head) + count);
+    }
+
+    /// @brief consumer side, contiguous queued values, they stay
+    ///         in queue until release()
+    QueueSpan<const T> read_span() const {
+        uint32_t current = load_own(tail);
+        uint32_t count = load_other(head) - current;
+        uint32_t index = current & (SIZE - 1);
+        uint32_t contiguous = SIZE - index;
+
+        return QueueSpan<const T>{ &data[index], count < contiguous ? count : contiguous };
+    }
+
+    /// @param count values taken from last read_span(), not more than its size
+    void release(uint32_t count){
+        publish(tail, load_own(tail) + count);
+    }
+
+    /// @brief exact on either side, snapshot for third context
+    uint32_t size() const {
+        // tail first: head loaded later is never behind it
+        uint32_t consumed = load_other(tail);
+        uint32_t count = load_other(head) - consumed;
+        return count < SIZE ? count : SIZE;
+    }
+
+    uint32_t free_space() const {
+        return SIZE - size();
+    }
+
+    bool is_empty() const {
+        return size() == 0;
+    }
+
+    bool is_full() const {
+        return size() == SIZE;
+    }
+};
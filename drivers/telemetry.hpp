@@ -0,0 +1,153 @@
+#pragma once
+
+#include "driver.hpp"
+#include "frame.hpp"
+#include "memory.hpp"
+
+// ADC telemetry without CPU per sample: timer TRGO starts scan of
+// CHANNELS, DMA stores results into circular buffer of 2 halves with
+// SCANS scans each. Half transfer / transfer complete interrupt sums
+// SCANS results of every channel into one record (oversampled value,
+// 12 bit * SCANS), records are queued for main loop, which sends them
+// in batches of BATCH records per frame.
+//
+// frame (type TELEMETRY_FRAME_TYPE), all little endian:
+//   channels(u8) scans(u8) index(u32) dropped(u32)
+//   vrefint_cal(u16) ts_cal1(u16) ts_cal2(u16)
+//   records[count][channels](u16)
+// index counts records sent in earlier frames, dropped counts records
+// lost because main loop did not keep up, count follows from len.
+// Frame payload lives in a pool block only while frame is encoded.
+
+#define TELEMETRY_FRAME_TYPE    0xF1
+#define TELEMETRY_HEADER_SIZE   16
+#define TELEMETRY_QUEUE_SIZE    64
+
+/// @tparam SCANS scans summed per record, sums must fit 16 bit
+template<uint8_t CHANNELS, uint8_t SCANS, uint8_t BATCH>
+class AdcTelemetry final{
+    static_assert(CHANNELS >= 1 && CHANNELS <= 16, "ADC sequence keeps 1..16 channels");
+    static_assert(SCANS >= 1 && SCANS * 4095 <= 0xFFFF, "record sum must fit 16 bit");
+    static_assert(BATCH >= 1 && TELEMETRY_HEADER_SIZE + BATCH * CHANNELS * 2 <= FRAME_MAX_PAYLOAD,
+        "batch must fit one frame");
+    static_assert(BATCH <= TELEMETRY_QUEUE_SIZE, "batch must fit record queue");
+
+    struct Record{
+        uint16_t values[CHANNELS];
+    };
+
+    ADC& adc;
+    DMA& dma;
+    uint16_t buffer[2][SCANS][CHANNELS];
+    SpscQueue<Record, TELEMETRY_QUEUE_SIZE> records;
+    Record last = {};
+    bool running = false;
+
+    void reduce(uint8_t half){
+        Record record;
+        for(uint8_t channel = 0; channel < CHANNELS; channel++){
+            uint32_t sum = 0;
+            for(uint8_t scan = 0; scan < SCANS; scan++) sum += buffer[half][scan][channel];
+            record.values[channel] = sum;
+        }
+        last = record;
+        if(!records.push(record)) dropped++;
+    }
+public:
+    /// @brief records reduced since start, sent or dropped
+    volatile uint32_t produced = 0;
+    uint32_t sent = 0;
+    volatile uint32_t dropped = 0;
+    volatile uint32_t dma_errors = 0;
+
+    AdcTelemetry(ADC& adc, DMA& dma) : adc(adc), dma(dma) {}
+
+    AdcTelemetry(const AdcTelemetry&) = delete;
+    AdcTelemetry& operator=(const AdcTelemetry&) = delete;
+
+    /// @brief ADC and DMA clocks must be enabled, sequence is set
+    ///         by caller, scans start with first trigger edge
+    void start(uint8_t trigger){
+        produced = sent = 0;
+        dropped = 0;
+
+        adc.disable();
+        adc.update_clock();
+        adc.configure_triggered_scan(trigger);
+        adc.dma_start(dma, &buffer[0][0][0], sizeof(buffer) / sizeof(uint16_t));
+        adc.enable();
+        running = true;
+    }
+
+    void stop(){
+        adc.dma_stop(dma);
+        adc.disable();
+        running = false;
+    }
+
+    bool is_running() const {
+        return running;
+    }
+
+    /// @brief must be called from DMA stream interrupt handler,
+    ///         reduces the half which DMA has just left
+    void irq_handler(){
+        uint8_t flags = dma.irq_handler();
+
+        if(flags & DMA_FLAG_TRANSFER_ERROR) dma_errors++;
+        if(flags & DMA_FLAG_HALF_TRANSFER){
+            reduce(0);
+            produced++;
+        }
+        if(flags & DMA_FLAG_TRANSFER_COMPLETE){
+            reduce(1);
+            produced++;
+        }
+    }
+
+    /// @brief latest record, also when it was dropped or sent already
+    void snapshot(uint16_t* values) const {
+        IrqLock lock;
+        for(uint8_t channel = 0; channel < CHANNELS; channel++) values[channel] = last.values[channel];
+    }
+
+    static constexpr uint8_t get_channels(){
+        return CHANNELS;
+    }
+
+    static constexpr uint8_t get_scans(){
+        return SCANS;
+    }
+
+    bool has_batch() const {
+        return records.size() >= BATCH;
+    }
+
+    /// @brief sends one frame if BATCH records are ready
+    /// @return true if frame was sent, false also if no pool block is free
+    bool poll(FrameEncoder& encoder){
+        if(records.size() < BATCH) return false;
+        PoolPtr buffer(TELEMETRY_HEADER_SIZE + BATCH * CHANNELS * 2);
+        if(!buffer) return false;
+
+        uint8_t* payload = buffer.get();
+        payload[0] = CHANNELS;
+        payload[1] = SCANS;
+        write_le32(payload + 2, sent);
+        write_le32(payload + 6, dropped);
+        write_le16(payload + 10, ADC::get_vrefint_cal());
+        write_le16(payload + 12, ADC::get_ts_cal1());
+        write_le16(payload + 14, ADC::get_ts_cal2());
+
+        uint8_t* out = payload + TELEMETRY_HEADER_SIZE;
+        Record record;
+        for(uint8_t i = 0; i < BATCH && records.pop(record); i++){
+            for(uint8_t channel = 0; channel < CHANNELS; channel++, out += 2)
+                write_le16(out, record.values[channel]);
+            sent++;
+        }
+
+        encoder.send(TELEMETRY_FRAME_TYPE, payload, out - payload);
+        return true;
+    }
+};
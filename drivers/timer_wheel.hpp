@@ -0,0 +1,148 @@
+#pragma once
+
+#include "driver.hpp"
+
+// Hashed timer wheel on top of Systick tick. Timer with expiry tick
+// t lives in slot t % TIMER_WHEEL_SLOTS, every tick only one slot is
+// visited, start and cancel are O(1) list operations. Callbacks run
+// in the context which calls advance() (systick_handler).
+
+#define TIMER_WHEEL_SLOTS   64
+
+class SoftTimer;
+typedef void (*TimerCallback)(SoftTimer& timer, void* arg);
+
+class SoftTimer final{
+    friend class TimerWheel;
+
+    SoftTimer* next = nullptr;
+    SoftTimer* prev = nullptr;
+    uint32_t expiry = 0;
+    bool active = false;
+public:
+    TimerCallback callback;
+    void* arg;
+    /// @brief 0 - one shot, otherwise ticks between callbacks
+    uint32_t period = 0;
+
+    SoftTimer(TimerCallback callback, void* arg = nullptr) :
+        callback(callback), arg(arg) {}
+
+    SoftTimer(const SoftTimer&) = delete;
+    SoftTimer& operator=(const SoftTimer&) = delete;
+
+    bool is_active() const {
+        return active;
+    }
+
+    uint32_t get_expiry() const {
+        return expiry;
+    }
+};
+
+class TimerWheel final{
+    static_assert((TIMER_WHEEL_SLOTS & (TIMER_WHEEL_SLOTS - 1)) == 0,
+        "TIMER_WHEEL_SLOTS must be power of two");
+
+    SoftTimer* slots[TIMER_WHEEL_SLOTS] = {};
+    /// @brief next timer of slot which is being processed by advance()
+    SoftTimer* cursor = nullptr;
+    uint32_t now = 0;
+    uint32_t count = 0;
+
+    void link(SoftTimer& timer){
+        SoftTimer*& head = slots[timer.expiry & (TIMER_WHEEL_SLOTS - 1)];
+        timer.prev = nullptr;
+        timer.next = head;
+        if(head != nullptr) head->prev = &timer;
+        head = &timer;
+        timer.active = true;
+        count++;
+    }
+
+    void unlink(SoftTimer& timer){
+        if(cursor == &timer) cursor = timer.next;
+
+        if(timer.prev != nullptr) timer.prev->next = timer.next;
+        else slots[timer.expiry & (TIMER_WHEEL_SLOTS - 1)] = timer.next;
+        if(timer.next != nullptr) timer.next->prev = timer.prev;
+
+        timer.next = timer.prev = nullptr;
+        timer.active = false;
+        count--;
+    }
+public:
+    /// @brief (re)start timer, callback is called after delay ticks
+    ///         and then every period ticks if period is not 0
+    /// @param delay 1..0x7FFFFFFF ticks
+    void start(SoftTimer& timer, uint32_t delay, uint32_t period = 0){
+        IrqLock lock;
+
+        if(timer.active) unlink(timer);
+        timer.expiry = now + (delay == 0 ? 1 : delay);
+        timer.period = period;
+        link(timer);
+    }
+
+    void cancel(SoftTimer& timer){
+        IrqLock lock;
+
+        if(timer.active) unlink(timer);
+    }
+
+    /// @brief runs callbacks of all timers expired up to tick,
+    ///         must be called from one context only (systick_handler),
+    ///         interrupts are masked only while lists are changed
+    void advance(uint32_t tick){
+        while(now != tick){
+            uint32_t primask = irq_save();
+
+            now++;
+            cursor = slots[now & (TIMER_WHEEL_SLOTS - 1)];
+            while(cursor != nullptr){
+                SoftTimer& timer = *cursor;
+                cursor = timer.next;
+                if(timer.expiry != now) continue;
+
+                unlink(timer);
+                if(timer.period != 0){
+                    timer.expiry = now + timer.period;
+                    link(timer);
+                }
+
+                // callback may start or cancel any timer, cursor follows unlink()
+                irq_restore(primask);
+                timer.callback(timer, timer.arg);
+                primask = irq_save();
+            }
+            cursor = nullptr;
+
+            irq_restore(primask);
+        }
+    }
+
+    /// @brief ticks until nearest expiry, limit if there is no timer
+    ///         expiring earlier, O(TIMER_WHEEL_SLOTS) with early exit
+    uint32_t ticks_to_next(uint32_t limit) const {
+        IrqLock lock;
+
+        uint32_t nearest = limit;
+        for(uint32_t i = 1; i <= TIMER_WHEEL_SLOTS && i < nearest; i++){
+            for(SoftTimer* timer = slots[(now + i) & (TIMER_WHEEL_SLOTS - 1)];
+                    timer != nullptr; timer = timer->next){
+                uint32_t left = timer->expiry - now;
+                if(left < nearest) nearest = left;
+            }
+        }
+        return nearest;
+    }
+
+    uint32_t get_now() const {
+        return now;
+    }
+
+    /// @brief count of active timers
+    uint32_t size() const {
+        return count;
+    }
+};
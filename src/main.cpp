@@ -1,65 +1,365 @@
 #include "../drivers/driver.hpp"
+#include "../drivers/frame.hpp"
+#include "../drivers/timer_wheel.hpp"
+#include "../drivers/profiler.hpp"
+#include "../drivers/iap.hpp"
+#include "../drivers/ram_exec.hpp"
+#include "../drivers/telemetry.hpp"
+#include "../drivers/irq.hpp"
+#include "../drivers/input.hpp"
+#include "../drivers/memory.hpp"
+#include "../drivers/idle.hpp"
+#include "../drivers/baud.hpp"
+#include "../drivers/command.hpp"
 
+// clocks set by config_pll(7, 4, 336, 16) in main(), APB1 is divided by 2,
+// USART dividers are computed and checked against them at compile time
+constexpr uint32_t SYSCLK_HZ = RCC::pll_clock(4, 336, 16);
+constexpr uint32_t PCLK1_HZ = SYSCLK_HZ / 2;
+constexpr uint32_t PCLK2_HZ = SYSCLK_HZ;
+// control channel starts at this rate, host raises it (baud.hpp)
+constexpr uint32_t LINK_SAFE_BAUD = 9600;
+
+// opcodes (frame types) of control channel, replies use the opcode of
+// the request, system frames (profiler, memory, baud) are 0xF0 and up
 enum Commands{
-    SendData, RecieveCode
+    SendData, RecieveCode, RunCode, GpioSet, GpioGet, TimerConfig,
+    TelemetryControl
+};
+
+// objects used by interrupt handlers have static storage,
+// handlers call them directly (see irq.hpp)
+// control channel: frames of Commands, code upload, profiler
+static USART usart = { 1, 9, 'A', 10, 'A' };
+// bulk channel: ADC telemetry frames only
+static USART telemetry_usart = { 2, 2, 'A', 3, 'A' };
+static Systick systick;
+static TimerWheel timers;
+static PowerIdle power_idle(systick, timers);
+static BaudNegotiator link_rate(usart, timers, LINK_SAFE_BAUD);
+static Flash flash;
+static CRC crc;
+static Iap code_loader(flash, crc, RecieveCode);
+static RamExec ram_runner(crc, reinterpret_cast<uint32_t*>(USER_RAM_BASE), RunCode);
+static ADC adc;
+static DMA adc_dma = { 2, ADC1_DMA_STREAM };
+// temperature sensor and VREFINT, 16 scans per record, 16 records per frame
+static AdcTelemetry<2, 16, 16> adc_telemetry(adc, adc_dma);
+static EXTI exti;
+static InputEvents input_events;
+// Button (PA0) - part of my development board, shorts pin to ground
+static DebouncedButton user_button(exti, timers, input_events, 0, 'A', true);
+
+// hot handler entries run from SRAM (RAMFUNC), flash wait states do not
+// add to their latency, driver code they call may still run from flash
+extern "C" RAMFUNC void usart1_handler(){
+    PROFILE_ZONE(ZoneUsartIrq);
+    usart.irq_handler();
+}
+
+IRQ_BIND(usart2_handler, telemetry_usart, irq_handler)
+IRQ_BIND(flash_handler, code_loader, irq_handler)
+IRQ_BIND_RAM(dma2_stream0_handler, adc_telemetry, irq_handler)
+IRQ_BIND(exti0_handler, user_button, irq_handler)
+// Stop wake up sources, EXTI15_10 serves only the rx line (PA10)
+IRQ_BIND(rtc_wkup_handler, power_idle, irq_handler)
+IRQ_BIND(exti15_10_handler, power_idle, irq_handler)
+
+extern "C" RAMFUNC void systick_handler(){
+    PROFILE_ZONE(ZoneSystickIrq);
+    timers.advance(Systick::on_tick());
+}
+
+/// @brief SendData: latest telemetry record
+///   reply: produced(u32) dropped(u32) channels(u8) scans(u8)
+///   values[channels](u16)
+static void send_data(const Frame& frame, FrameEncoder& encoder){
+    (void)frame;
+    constexpr uint8_t channels = adc_telemetry.get_channels();
+    uint8_t payload[10 + channels * 2];
+    uint16_t values[channels];
+
+    adc_telemetry.snapshot(values);
+    write_le32(payload, adc_telemetry.produced);
+    write_le32(payload + 4, adc_telemetry.dropped);
+    payload[8] = channels;
+    payload[9] = adc_telemetry.get_scans();
+    for(uint8_t i = 0; i < channels; i++) write_le16(payload + 10 + i * 2, values[i]);
+
+    encoder.send(SendData, payload, sizeof(payload));
+}
+
+static void gpio_reply(FrameEncoder& encoder, uint8_t opcode, uint8_t status,
+        uint8_t letter, uint8_t pin, uint8_t level){
+    const uint8_t payload[] = { status, letter, pin, level };
+    encoder.send(opcode, payload, sizeof(payload));
+}
+
+static bool gpio_exists(uint8_t letter, uint8_t pin){
+    return pin < 16 && ((letter >= 'A' && letter <= 'E') || letter == 'H');
+}
+
+/// @brief GpioGet: request letter(u8) pin(u8),
+///   reply status(u8) letter(u8) pin(u8) level(u8), status 1 - no such pin
+static void gpio_get(const Frame& frame, FrameEncoder& encoder){
+    if(frame.len != 2 || !gpio_exists(frame.payload[0], frame.payload[1])){
+        gpio_reply(encoder, GpioGet, 1, 0, 0, 0);
+        return;
+    }
+    GPIO pin(frame.payload[1], frame.payload[0]);
+    gpio_reply(encoder, GpioGet, 0, frame.payload[0], frame.payload[1], pin.read_data() != 0);
+}
+
+/// @brief GpioSet: request letter(u8) pin(u8) level(u8), reply as GpioGet
+///   with level read back, status 2 - pin is not configured as output
+static void gpio_set(const Frame& frame, FrameEncoder& encoder){
+    if(frame.len != 3 || !gpio_exists(frame.payload[0], frame.payload[1])){
+        gpio_reply(encoder, GpioSet, 1, 0, 0, 0);
+        return;
+    }
+    GPIO pin(frame.payload[1], frame.payload[0]);
+    if(!pin.is_output()){
+        gpio_reply(encoder, GpioSet, 2, frame.payload[0], frame.payload[1], 0);
+        return;
+    }
+    pin.write(frame.payload[2] != 0);
+    gpio_reply(encoder, GpioSet, 0, frame.payload[0], frame.payload[1], pin.read_data() != 0);
+}
+
+/// @brief TimerConfig: request timer(u8) frequency(u32) channel(u8)
+///   duty(u16, 1/1000), channel 0 - time base only, otherwise PWM
+///   on channel 1..4 (pin must be set up by user code)
+///   reply status(u8) timer(u8) period(u32), status 1 - invalid
+///   arguments, 2 - TIM2 triggers ADC telemetry
+static void timer_config(const Frame& frame, FrameEncoder& encoder){
+    uint8_t payload[6] = { 1, 0 };
+    if(frame.len != 8){
+        encoder.send(TimerConfig, payload, sizeof(payload));
+        return;
+    }
+
+    TIM tim(frame.payload[0]);
+    uint32_t frequency = read_le32(frame.payload + 1);
+    uint8_t channel = frame.payload[5];
+    uint16_t duty = read_le16(frame.payload + 6);
+    payload[1] = frame.payload[0];
+
+    RCC rcc;
+    if(tim.get_num() == 2) payload[0] = 2;
+    else if(tim.clock_enable(rcc) || channel > 4 || duty > 1000 || tim.set_frequency(frequency)) payload[0] = 1;
+    else{
+        uint32_t period = tim.get_period();
+        if(channel != 0){
+            tim.set_compare(channel, period / 1000 * duty + period % 1000 * duty / 1000);
+            tim.pwm_enable(channel);
+        }
+        tim.start();
+        payload[0] = 0;
+        write_le32(payload + 2, period);
+    }
+    encoder.send(TimerConfig, payload, sizeof(payload));
+}
+
+/// @brief TelemetryControl: request on(u8), starts or stops ADC telemetry
+///   and its TIM2 trigger, reply status(u8) on(u8), status 1 - malformed
+static void telemetry_control(const Frame& frame, FrameEncoder& encoder){
+    uint8_t payload[2] = { 1, adc_telemetry.is_running() };
+    if(frame.len == 1){
+        TIM tim2(2);
+        bool on = frame.payload[0] != 0;
+        if(on && !adc_telemetry.is_running()){
+            adc_telemetry.start(ADC_TRIGGER_TIM2_TRGO);
+            tim2.start_trigger(1000);
+        }
+        else if(!on && adc_telemetry.is_running()){
+            tim2.stop();
+            adc_telemetry.stop();
+        }
+        payload[0] = 0;
+        payload[1] = adc_telemetry.is_running();
+    }
+    encoder.send(TelemetryControl, payload, sizeof(payload));
+}
+
+static void receive_code(const Frame& frame, FrameEncoder& encoder){
+    code_loader.on_frame(frame, encoder);
+}
+
+static void run_code(const Frame& frame, FrameEncoder& encoder){
+    ram_runner.on_frame(frame, encoder);
+}
+
+static void profiler_dump(const Frame& frame, FrameEncoder& encoder){
+    (void)frame;
+    PROFILE_ZONE(ZoneProfilerDump);
+    Profiler::dump(encoder);
+}
+
+static void memory_dump(const Frame& frame, FrameEncoder& encoder){
+    (void)frame;
+    Memory::dump(encoder);
+}
+
+static void link_rate_frame(const Frame& frame, FrameEncoder& encoder){
+    link_rate.on_frame(frame, encoder);
+}
+
+static void command_stats(const Frame& frame, FrameEncoder& encoder);
+
+constexpr Command commands[] = {
+    { SendData, &send_data },
+    { RecieveCode, &receive_code },
+    { RunCode, &run_code },
+    { GpioSet, &gpio_set },
+    { GpioGet, &gpio_get },
+    { TimerConfig, &timer_config },
+    { TelemetryControl, &telemetry_control },
+    { PROFILER_FRAME_TYPE, &profiler_dump },
+    { MEMORY_FRAME_TYPE, &memory_dump },
+    { BAUD_CAPS_FRAME_TYPE, &link_rate_frame },
+    { BAUD_SWITCH_FRAME_TYPE, &link_rate_frame },
+    { BAUD_TEST_FRAME_TYPE, &link_rate_frame },
+    { BAUD_COMMIT_FRAME_TYPE, &link_rate_frame },
+    { COMMAND_STATS_FRAME_TYPE, &command_stats },
 };
+
+#define COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+constexpr CommandIndex<COMMANDS> command_index(commands);
+static_assert(command_index.unique, "opcode is listed twice in commands");
+static CommandDispatcher<COMMANDS> dispatcher(commands, command_index);
+
+static void command_stats(const Frame& frame, FrameEncoder& encoder){
+    (void)frame;
+    dispatcher.dump(encoder);
+}
+
+/// @brief Stop turns bus clocks off: no telemetry, timer, upload or
+///         baud trial may run and both USARTs must have sent everything
+static bool stop_allowed(){
+    if(adc_telemetry.is_running() || code_loader.is_active()) return false;
+    if(link_rate.get_state() != BaudState::Idle) return false;
+    if(!usart.is_tx_idle() || !telemetry_usart.is_tx_idle()) return false;
+    for(uint8_t num = 2; num <= 5; num++)
+        if(TIM(num).is_running()) return false;
+    return true;
+}
+
+/// @brief sleeps until next timer expiry or interrupt if no input and
+///         no work is waiting, SysTick is stopped meanwhile (idle.hpp)
+static void idle(){
+    IrqLock lock;
+    if(!usart.rx_buffer.is_empty() || !input_events.is_empty()) return;
+    if(code_loader.has_work() || adc_telemetry.has_batch() || link_rate.has_work()) return;
+    power_idle.enter(stop_allowed());
+}
+
 [[noreturn]]
 int main(){
+    Pools::init();
     RCC rcc;
     TIM tim2 = { 2 };
 // Led - part of my development board
     LED led = { 13, 'C' };
-// Button - part of my development board
-    Button button = { 0, 'A' };
-    Systick systick;
-    USART usart = { 9, 'A', 10, 'A' };
-
-// init led
-    led.clock_enable(rcc);
-    led.set_output_mode();
-    led.enable_push_pull();
-    led.set_speed(GpioSpeed::Three);
-    led.no_pull_up_down();
-
-    button.clock_enable(rcc);
-    button.set_input_mode();
-    button.set_speed(GpioSpeed::Three);
-    button.set_pull_up();
-    
+
+    GpioPort<'A'>::clock_enable(rcc);
+    GpioPort<'C'>::clock_enable(rcc);
+
+    GpioPort<'C'>::apply<
+        PinConfig<13, GpioMode::Output, GpioSpeed::Three>
+    >();
+// Button (PA0) - part of my development board, PA9/PA10 - usart tx/rx,
+// PA2/PA3 - telemetry usart tx/rx
+    GpioPort<'A'>::apply<
+        PinConfig<0, GpioMode::Input, GpioSpeed::Three, GpioPull::Up>,
+        PinConfig<2, GpioMode::Alternate, GpioSpeed::Three,
+                GpioPull::None, GpioOutput::PushPull, 7>,
+        PinConfig<3, GpioMode::Alternate, GpioSpeed::Three,
+                GpioPull::None, GpioOutput::PushPull, 7>,
+        PinConfig<9, GpioMode::Alternate, GpioSpeed::Three,
+                GpioPull::None, GpioOutput::PushPull, 7>,
+        PinConfig<10, GpioMode::Alternate, GpioSpeed::Three,
+                GpioPull::None, GpioOutput::PushPull, 7>
+    >();
+
     tim2.clock_enable(rcc);
-    rcc.config_pll(7, 4, 336, 16);
+    {
+        PROFILE_ZONE(ZoneConfigPll);
+        rcc.config_pll(7, 4, 336, 16);
+    }
     
     usart.clear_data_reg();
     usart.clock_enable(rcc);
-    
-    usart.tx.set_alt_function_mode();
-    usart.rx.set_alt_function_mode();
 
-    usart.tx.clock_enable(rcc);
-    usart.rx.clock_enable(rcc);
+    usart.disable_usart();
+    usart.set_frame_format(DataBits::Eight, Parity::None, StopBits::One);
+    usart.set_baud_rate<PCLK2_HZ, LINK_SAFE_BAUD>();
+    usart.enable_usart(true, true);
 
-    usart.tx.set_alt_function(7);
-    usart.rx.set_alt_function(7);
+    telemetry_usart.clock_enable(rcc);
+    telemetry_usart.disable_usart();
+    telemetry_usart.set_frame_format(DataBits::Eight, Parity::None, StopBits::One);
+    telemetry_usart.set_baud_rate<PCLK1_HZ, 115200>();
+    telemetry_usart.enable_usart(true, false);
 
-    usart.tx.enable_push_pull();
-    usart.rx.enable_push_pull();
-    usart.tx.no_pull_up_down();
-    usart.rx.no_pull_up_down();
-    usart.tx.set_speed(GpioSpeed::Three);
-    usart.rx.set_speed(GpioSpeed::Three);
+    NVIC nvic;
+    VectorTable::relocate();
+    NVIC::set_priority_grouping(NVIC_PRIORITY_BITS);
+    // usart rx must not wait for telemetry or flash handlers
+    nvic.set_priority(usart.get_irq(), 1);
+    nvic.set_priority(telemetry_usart.get_irq(), 2);
+    nvic.set_priority(adc_dma.get_irq(), 2);
+    nvic.set_priority(FLASH_IRQ, 3);
+    usart.async_enable(nvic);
+    telemetry_usart.async_enable(nvic);
 
-    usart.disable_usart();
-    usart.set_data_bits(DataBits::Eight);
-    usart.set_stop_bits(StopBits::One);
-    usart.configure_parity(Parity::None);
-    usart.set_baud_rate(9600);
-
-    usart.tx_enable(); 
-    usart.rx_enable(); 
-    usart.enable_usart(); 
+    systick.start_tick(1000);
+
+    exti.clock_enable(rcc);
+    user_button.start(nvic);
+    // wake up from Stop by RTC and by start bit on PA10
+    power_idle.enable_stop(rcc, exti, nvic, 10, 'A');
     
+    FrameLink link(usart);
+    FrameEncoder telemetry_encoder(telemetry_usart);
+
+    crc.clock_enable(rcc);
+    code_loader.interrupt_enable(nvic);
+
+    adc.clock_enable(rcc);
+    adc_dma.clock_enable(rcc);
+    adc.enable_internal_channels();
+    const uint8_t channels[] = { ADC_TEMPERATURE_CHANNEL, ADC_VREFINT_CHANNEL };
+    adc.set_sequence(channels, sizeof(channels));
+    adc.set_sample_time(ADC_TEMPERATURE_CHANNEL, AdcSampleTime::Cycles480);
+    adc.set_sample_time(ADC_VREFINT_CHANNEL, AdcSampleTime::Cycles480);
+
+    nvic.enable_interrupt(adc_dma.get_irq());
+    adc_telemetry.start(ADC_TRIGGER_TIM2_TRGO);
+    // 1 kHz scans, one record every 16 ms
+    tim2.start_trigger(1000);
+
     led.disable_light();
     while(true){
-        
+        {
+            PROFILE_ZONE(ZoneMainLoop);
+
+            code_loader.poll(link.encoder);
+            link_rate.poll();
+            adc_telemetry.poll(telemetry_encoder);
+
+            InputEvent event;
+            while(input_events.pop(event)){
+                if(event.type == InputEventType::Press) led.blink();
+                else if(event.type == InputEventType::LongPress) Profiler::reset();
+            }
+
+            Frame frame;
+            if(link.poll(frame)){
+                dispatcher.dispatch(frame, link.encoder);
+                continue;
+            }
+        }
+        idle();
     }
 }
@@ -1,28 +1,88 @@
 #define uintptr_t unsigned int
 #define uint32_t unsigned int
 
-#define SRAM_START                  0x20000000U
-#define SRAM_SIZE                   64U * 1024U //64K
-#define SRAM_END                    SRAM_START + SRAM_SIZE
-#define STACK_POINTER_FIRST_ADDR    ((uint32_t)SRAM_END)
+// same value as STACK_PAINT of drivers/memory.hpp
+#define STACK_PAINT                 0xA5A5A5A5U
 
-#define VECTOR_TABLE_SIZE_WORDS     255
+// 16 core exceptions + 85 stm32F401 interrupts (RM0368 table 38)
+#define VECTOR_TABLE_SIZE_WORDS     101
 
 void reset_handler(void);
-void nmi_handler(void)  __attribute((weak, alias("default_handler")));
-void hard_fault_handler(void)   __attribute((weak, alias("default_handler")));
-void memory_management_fault_handler(void)  __attribute((weak, alias("default_handler")));
-void bus_fault_handler(void)    __attribute((weak, alias("default_handler")));
-void usage_fault_handler(void)  __attribute((weak, alias("default_handler")));
-void svcall_handler(void)   __attribute((weak, alias("default_handler")));
-void pend_sv_handler(void)  __attribute((weak, alias("default_handler")));
-void systick_handler(void)  __attribute((weak, alias("default_handler")));
+void nmi_handler(void) __attribute((weak, alias("default_handler")));
+void hard_fault_handler(void) __attribute((weak, alias("default_handler")));
+void memory_management_fault_handler(void) __attribute((weak, alias("default_handler")));
+void bus_fault_handler(void) __attribute((weak, alias("default_handler")));
+void usage_fault_handler(void) __attribute((weak, alias("default_handler")));
+void svcall_handler(void) __attribute((weak, alias("default_handler")));
+void debug_monitor_handler(void) __attribute((weak, alias("default_handler")));
+void pend_sv_handler(void) __attribute((weak, alias("default_handler")));
+void systick_handler(void) __attribute((weak, alias("default_handler")));
+void wwdg_handler(void) __attribute((weak, alias("default_handler")));
+void pvd_handler(void) __attribute((weak, alias("default_handler")));
+void tamp_stamp_handler(void) __attribute((weak, alias("default_handler")));
+void rtc_wkup_handler(void) __attribute((weak, alias("default_handler")));
+void flash_handler(void) __attribute((weak, alias("default_handler")));
+void rcc_handler(void) __attribute((weak, alias("default_handler")));
+void exti0_handler(void) __attribute((weak, alias("default_handler")));
+void exti1_handler(void) __attribute((weak, alias("default_handler")));
+void exti2_handler(void) __attribute((weak, alias("default_handler")));
+void exti3_handler(void) __attribute((weak, alias("default_handler")));
+void exti4_handler(void) __attribute((weak, alias("default_handler")));
+void dma1_stream0_handler(void) __attribute((weak, alias("default_handler")));
+void dma1_stream1_handler(void) __attribute((weak, alias("default_handler")));
+void dma1_stream2_handler(void) __attribute((weak, alias("default_handler")));
+void dma1_stream3_handler(void) __attribute((weak, alias("default_handler")));
+void dma1_stream4_handler(void) __attribute((weak, alias("default_handler")));
+void dma1_stream5_handler(void) __attribute((weak, alias("default_handler")));
+void dma1_stream6_handler(void) __attribute((weak, alias("default_handler")));
+void adc_handler(void) __attribute((weak, alias("default_handler")));
+void exti9_5_handler(void) __attribute((weak, alias("default_handler")));
+void tim1_brk_tim9_handler(void) __attribute((weak, alias("default_handler")));
+void tim1_up_tim10_handler(void) __attribute((weak, alias("default_handler")));
+void tim1_trg_com_tim11_handler(void) __attribute((weak, alias("default_handler")));
+void tim1_cc_handler(void) __attribute((weak, alias("default_handler")));
+void tim2_handler(void) __attribute((weak, alias("default_handler")));
+void tim3_handler(void) __attribute((weak, alias("default_handler")));
+void tim4_handler(void) __attribute((weak, alias("default_handler")));
+void i2c1_ev_handler(void) __attribute((weak, alias("default_handler")));
+void i2c1_er_handler(void) __attribute((weak, alias("default_handler")));
+void i2c2_ev_handler(void) __attribute((weak, alias("default_handler")));
+void i2c2_er_handler(void) __attribute((weak, alias("default_handler")));
+void spi1_handler(void) __attribute((weak, alias("default_handler")));
+void spi2_handler(void) __attribute((weak, alias("default_handler")));
+void usart1_handler(void) __attribute((weak, alias("default_handler")));
+void usart2_handler(void) __attribute((weak, alias("default_handler")));
+void exti15_10_handler(void) __attribute((weak, alias("default_handler")));
+void rtc_alarm_handler(void) __attribute((weak, alias("default_handler")));
+void otg_fs_wkup_handler(void) __attribute((weak, alias("default_handler")));
+void dma1_stream7_handler(void) __attribute((weak, alias("default_handler")));
+void sdio_handler(void) __attribute((weak, alias("default_handler")));
+void tim5_handler(void) __attribute((weak, alias("default_handler")));
+void spi3_handler(void) __attribute((weak, alias("default_handler")));
+void dma2_stream0_handler(void) __attribute((weak, alias("default_handler")));
+void dma2_stream1_handler(void) __attribute((weak, alias("default_handler")));
+void dma2_stream2_handler(void) __attribute((weak, alias("default_handler")));
+void dma2_stream3_handler(void) __attribute((weak, alias("default_handler")));
+void dma2_stream4_handler(void) __attribute((weak, alias("default_handler")));
+void otg_fs_handler(void) __attribute((weak, alias("default_handler")));
+void dma2_stream5_handler(void) __attribute((weak, alias("default_handler")));
+void dma2_stream6_handler(void) __attribute((weak, alias("default_handler")));
+void dma2_stream7_handler(void) __attribute((weak, alias("default_handler")));
+void usart6_handler(void) __attribute((weak, alias("default_handler")));
+void i2c3_ev_handler(void) __attribute((weak, alias("default_handler")));
+void i2c3_er_handler(void) __attribute((weak, alias("default_handler")));
+void fpu_handler(void) __attribute((weak, alias("default_handler")));
+void spi4_handler(void) __attribute((weak, alias("default_handler")));
+
+// main stack, reserved by mem.ld
+extern uintptr_t _sstack, _estack;
 
 void default_handler(void){ while(1){ asm("wfi"); } }
 
+// entries are ordered by position, comments give IRQ number, 0 - reserved
 static volatile uintptr_t isr_vector[VECTOR_TABLE_SIZE_WORDS] 
-__attribute__((section(".isr_vector"))) = {
-    STACK_POINTER_FIRST_ADDR,
+__attribute__((section(".isr_vector"), used)) = {
+    (uintptr_t)&_estack,
 	(uintptr_t)&reset_handler,
 	(uintptr_t)&nmi_handler,
 	(uintptr_t)&hard_fault_handler,
@@ -34,36 +94,196 @@ __attribute__((section(".isr_vector"))) = {
 	(uintptr_t)0,
 	(uintptr_t)0,
 	(uintptr_t)&svcall_handler,
-	(uintptr_t)0,
+	(uintptr_t)&debug_monitor_handler,
 	(uintptr_t)0,
 	(uintptr_t)&pend_sv_handler,
-	(uintptr_t)&systick_handler
+	(uintptr_t)&systick_handler,
+	(uintptr_t)&wwdg_handler,                 // 0
+	(uintptr_t)&pvd_handler,                  // 1
+	(uintptr_t)&tamp_stamp_handler,           // 2
+	(uintptr_t)&rtc_wkup_handler,             // 3
+	(uintptr_t)&flash_handler,                // 4
+	(uintptr_t)&rcc_handler,                  // 5
+	(uintptr_t)&exti0_handler,                // 6
+	(uintptr_t)&exti1_handler,                // 7
+	(uintptr_t)&exti2_handler,                // 8
+	(uintptr_t)&exti3_handler,                // 9
+	(uintptr_t)&exti4_handler,                // 10
+	(uintptr_t)&dma1_stream0_handler,         // 11
+	(uintptr_t)&dma1_stream1_handler,         // 12
+	(uintptr_t)&dma1_stream2_handler,         // 13
+	(uintptr_t)&dma1_stream3_handler,         // 14
+	(uintptr_t)&dma1_stream4_handler,         // 15
+	(uintptr_t)&dma1_stream5_handler,         // 16
+	(uintptr_t)&dma1_stream6_handler,         // 17
+	(uintptr_t)&adc_handler,                  // 18
+	(uintptr_t)0,                             // 19
+	(uintptr_t)0,                             // 20
+	(uintptr_t)0,                             // 21
+	(uintptr_t)0,                             // 22
+	(uintptr_t)&exti9_5_handler,              // 23
+	(uintptr_t)&tim1_brk_tim9_handler,        // 24
+	(uintptr_t)&tim1_up_tim10_handler,        // 25
+	(uintptr_t)&tim1_trg_com_tim11_handler,   // 26
+	(uintptr_t)&tim1_cc_handler,              // 27
+	(uintptr_t)&tim2_handler,                 // 28
+	(uintptr_t)&tim3_handler,                 // 29
+	(uintptr_t)&tim4_handler,                 // 30
+	(uintptr_t)&i2c1_ev_handler,              // 31
+	(uintptr_t)&i2c1_er_handler,              // 32
+	(uintptr_t)&i2c2_ev_handler,              // 33
+	(uintptr_t)&i2c2_er_handler,              // 34
+	(uintptr_t)&spi1_handler,                 // 35
+	(uintptr_t)&spi2_handler,                 // 36
+	(uintptr_t)&usart1_handler,               // 37
+	(uintptr_t)&usart2_handler,               // 38
+	(uintptr_t)0,                             // 39
+	(uintptr_t)&exti15_10_handler,            // 40
+	(uintptr_t)&rtc_alarm_handler,            // 41
+	(uintptr_t)&otg_fs_wkup_handler,          // 42
+	(uintptr_t)0,                             // 43
+	(uintptr_t)0,                             // 44
+	(uintptr_t)0,                             // 45
+	(uintptr_t)0,                             // 46
+	(uintptr_t)&dma1_stream7_handler,         // 47
+	(uintptr_t)0,                             // 48
+	(uintptr_t)&sdio_handler,                 // 49
+	(uintptr_t)&tim5_handler,                 // 50
+	(uintptr_t)&spi3_handler,                 // 51
+	(uintptr_t)0,                             // 52
+	(uintptr_t)0,                             // 53
+	(uintptr_t)0,                             // 54
+	(uintptr_t)0,                             // 55
+	(uintptr_t)&dma2_stream0_handler,         // 56
+	(uintptr_t)&dma2_stream1_handler,         // 57
+	(uintptr_t)&dma2_stream2_handler,         // 58
+	(uintptr_t)&dma2_stream3_handler,         // 59
+	(uintptr_t)&dma2_stream4_handler,         // 60
+	(uintptr_t)0,                             // 61
+	(uintptr_t)0,                             // 62
+	(uintptr_t)0,                             // 63
+	(uintptr_t)0,                             // 64
+	(uintptr_t)0,                             // 65
+	(uintptr_t)0,                             // 66
+	(uintptr_t)&otg_fs_handler,               // 67
+	(uintptr_t)&dma2_stream5_handler,         // 68
+	(uintptr_t)&dma2_stream6_handler,         // 69
+	(uintptr_t)&dma2_stream7_handler,         // 70
+	(uintptr_t)&usart6_handler,               // 71
+	(uintptr_t)&i2c3_ev_handler,              // 72
+	(uintptr_t)&i2c3_er_handler,              // 73
+	(uintptr_t)0,                             // 74
+	(uintptr_t)0,                             // 75
+	(uintptr_t)0,                             // 76
+	(uintptr_t)0,                             // 77
+	(uintptr_t)0,                             // 78
+	(uintptr_t)0,                             // 79
+	(uintptr_t)0,                             // 80
+	(uintptr_t)&fpu_handler,                  // 81
+	(uintptr_t)0,                             // 82
+	(uintptr_t)0,                             // 83
+	(uintptr_t)&spi4_handler,                 // 84
 };
 
+#define SCB_CPACR                   (*(volatile uint32_t*)0xE000ED88U)
+#define FLASH_ACR                   (*(volatile uint32_t*)0x40023C00U)
+#define DEMCR                       (*(volatile uint32_t*)0xE000EDFCU)
+#define DWT_CTRL                    (*(volatile uint32_t*)0xE0001000U)
+#define DWT_CYCCNT                  (*(volatile uint32_t*)0xE0001004U)
+
+#define FLASH_ACR_PRFTEN            (1U << 8)
+#define FLASH_ACR_ICEN              (1U << 9)
+#define FLASH_ACR_DCEN              (1U << 10)
+#define FLASH_ACR_ICRST             (1U << 11)
+#define FLASH_ACR_DCRST             (1U << 12)
+
 void main(void);
 
-extern uintptr_t _sdata, _edata, _sbss, _ebss, _etext;
+extern uintptr_t _sidata, _sdata, _edata, _sbss, _ebss;
+extern uintptr_t _siramfunc, _sramfunc, _eramfunc;
+extern void (*_spreinit_array[])(void);
+extern void (*_epreinit_array[])(void);
+extern void (*_sinit_array[])(void);
+extern void (*_einit_array[])(void);
+
+// cycles from reset to main(), counted by DWT CYCCNT
+volatile uint32_t boot_cycles;
+
+// 16 bytes per LDM/STM pair, tail word by word
+static inline void copy_words(uint32_t* dst, const uint32_t* src, uint32_t bytes){
+    uint32_t blocks = bytes >> 4;
+
+    if(blocks != 0){
+        asm volatile(
+            "1: ldmia %[src]!, {r3-r6}  \n\t"
+            "   stmia %[dst]!, {r3-r6}  \n\t"
+            "   subs %[blocks], #1      \n\t"
+            "   bne 1b"
+            : [dst] "+r"(dst), [src] "+r"(src), [blocks] "+r"(blocks)
+            :: "r3", "r4", "r5", "r6", "cc", "memory");
+    }
+
+    for(bytes &= 0xF; bytes != 0; bytes -= sizeof(uint32_t))
+        *dst++ = *src++;
+}
+
+static inline void zero_words(uint32_t* dst, uint32_t bytes){
+    uint32_t blocks = bytes >> 4;
+
+    if(blocks != 0){
+        asm volatile(
+            "   movs r3, #0             \n\t"
+            "   movs r4, #0             \n\t"
+            "   movs r5, #0             \n\t"
+            "   movs r6, #0             \n\t"
+            "1: stmia %[dst]!, {r3-r6}  \n\t"
+            "   subs %[blocks], #1      \n\t"
+            "   bne 1b"
+            : [dst] "+r"(dst), [blocks] "+r"(blocks)
+            :: "r3", "r4", "r5", "r6", "cc", "memory");
+    }
+
+    for(bytes &= 0xF; bytes != 0; bytes -= sizeof(uint32_t))
+        *dst++ = 0;
+}
+
 // entry point
 void reset_handler(void){
-    // zero bss
-    uintptr_t* sdata = &_sdata; 
-    uintptr_t* edata = &_edata; 
-    uintptr_t* sbss = &_sbss; 
-    uintptr_t* ebss = &_ebss;
-    uintptr_t* etext = &_etext;
-    
-    uintptr_t data_size = (uintptr_t)edata - (uintptr_t)sdata;
-    uintptr_t bss_size = (uintptr_t)ebss - (uintptr_t)sbss;
-    
-    for(uintptr_t i = 0; i < bss_size; i += sizeof(uintptr_t)){
-        *(sbss + i) = 0;
-    }
+    // cycle counter first, boot time is measured from here
+    DEMCR |= 1U << 24;
+    DWT_CYCCNT = 0;
+    DWT_CTRL |= 1U;
+
+    // full access to CP10/CP11, code is built with -mfloat-abi=hard
+    SCB_CPACR |= 0xFU << 20;
+    asm volatile("dsb\n\tisb" ::: "memory");
+
+    // ART accelerator: caches can be reset only while disabled
+    FLASH_ACR &= ~(FLASH_ACR_ICEN | FLASH_ACR_DCEN);
+    FLASH_ACR |= FLASH_ACR_ICRST | FLASH_ACR_DCRST;
+    FLASH_ACR &= ~(FLASH_ACR_ICRST | FLASH_ACR_DCRST);
+    FLASH_ACR |= FLASH_ACR_PRFTEN | FLASH_ACR_ICEN | FLASH_ACR_DCEN;
+
+    // unused stack gets a pattern, first overwritten word shows the
+    // deepest stack use (high water mark), volatile keeps the loop
+    // from becoming memset call (no libc is linked)
+    uint32_t* sp;
+    asm volatile("mov %0, sp" : "=r"(sp));
+    for(volatile uint32_t* word = &_sstack; word < sp - 16; word++) *word = STACK_PAINT;
+
+    // copy data and RAMFUNC code from FLASH to SRAM
+    copy_words(&_sdata, &_sidata, (uintptr_t)&_edata - (uintptr_t)&_sdata);
+    copy_words(&_sramfunc, &_siramfunc, (uintptr_t)&_eramfunc - (uintptr_t)&_sramfunc);
+    asm volatile("dsb\n\tisb" ::: "memory");
     
-    // copy data from FLASH to SRAM
-    for(uintptr_t i = 0; i < data_size; i += sizeof(uintptr_t)){
-        *(sdata + i) = *(etext + i);
-    }
+    // zero bss
+    zero_words(&_sbss, (uintptr_t)&_ebss - (uintptr_t)&_sbss);
+
+    // C++ static constructors
+    for(void (**fn)(void) = _spreinit_array; fn < _epreinit_array; fn++) (*fn)();
+    for(void (**fn)(void) = _sinit_array; fn < _einit_array; fn++) (*fn)();
+
+    boot_cycles = DWT_CYCCNT;
     
     main();
 }
-
@@ -0,0 +1,140 @@
+// Link rate negotiation on the host register backend, built with
+// -DHOST_BACKEND by `make host_test_baud`. Requests go to
+// BaudNegotiator::on_frame, replies are decoded from the bytes the
+// USART model shifted out, ticks are passed to the timer wheel directly.
+
+#include "../drivers/baud.hpp"
+
+#include <cstdio>
+
+static uint32_t failures = 0;
+
+#define CHECK(condition) \
+    do{ \
+        if(!(condition)){ \
+            printf("%s:%d: %s\n", __FILE__, __LINE__, #condition); \
+            failures++; \
+        } \
+    }while(0)
+
+#define TEST_SAFE_BAUD  9600
+
+static host::Bus& bus(){
+    return host::Bus::instance();
+}
+
+static USART usart(1, 9, 'A', 10, 'A');
+
+static void usart1_irq(){
+    usart.irq_handler();
+}
+
+static void request(BaudNegotiator& link, FrameEncoder& encoder, uint8_t type, const uint8_t* payload, uint16_t len){
+    bus().model<host::UsartModel>(USART1_BASE)->transmitted.clear();
+    Frame frame{ 0, type, len, payload };
+    link.on_frame(frame, encoder);
+}
+
+static void request_switch(BaudNegotiator& link, FrameEncoder& encoder, uint32_t rate){
+    uint8_t payload[4];
+    write_le32(payload, rate);
+    request(link, encoder, BAUD_SWITCH_FRAME_TYPE, payload, sizeof(payload));
+}
+
+/// @return status of reply sent since last request, 0xFF if none
+static uint8_t reply_status(){
+    while(!usart.is_tx_idle());
+    FrameDecoder decoder;
+    Frame frame{};
+    uint8_t status = 0xFF;
+    for(uint8_t byte : bus().model<host::UsartModel>(USART1_BASE)->transmitted)
+        if(decoder.feed(byte, frame) && frame.len == 5) status = frame.payload[0];
+    return status;
+}
+
+/// @brief switch reply goes at the old rate, trial starts once tx is idle
+static void start_trial(BaudNegotiator& link, FrameEncoder& encoder, uint32_t rate){
+    request_switch(link, encoder, rate);
+    CHECK(link.get_state() == BaudState::Switching);
+    CHECK(usart.baud_rate != rate);
+    while(link.get_state() == BaudState::Switching) link.poll();
+    CHECK(link.get_state() == BaudState::Trial);
+    CHECK(usart.baud_rate == rate);
+}
+
+/// @brief committed trial keeps new rate
+static void trial_commit(BaudNegotiator& link, FrameEncoder& encoder){
+    start_trial(link, encoder, 115200);
+    request(link, encoder, BAUD_COMMIT_FRAME_TYPE, nullptr, 0);
+    CHECK(reply_status() == BAUD_OK);
+    CHECK(link.get_state() == BaudState::Idle);
+    CHECK(usart.baud_rate == 115200);
+    CHECK(link.switches == 1);
+
+    // above bus clock / 8
+    request_switch(link, encoder, 20000000);
+    CHECK(reply_status() == BAUD_UNSUPPORTED);
+    CHECK(link.get_state() == BaudState::Idle);
+    request(link, encoder, BAUD_COMMIT_FRAME_TYPE, nullptr, 0);
+    CHECK(reply_status() == BAUD_NO_TRIAL);
+}
+
+/// @brief trial falls back to previous rate on timeout and on line error
+static void trial_fallback(BaudNegotiator& link, FrameEncoder& encoder, TimerWheel& timers){
+    start_trial(link, encoder, 230400);
+    request_switch(link, encoder, 460800);
+    CHECK(reply_status() == BAUD_BUSY);
+    timers.advance(timers.get_now() + BAUD_TRIAL_TICKS - 1);
+    link.poll();
+    CHECK(link.get_state() == BaudState::Trial);
+    timers.advance(timers.get_now() + 1);
+    CHECK(link.has_work());
+    link.poll();
+    CHECK(link.get_state() == BaudState::Idle);
+    CHECK(usart.baud_rate == 115200);
+    CHECK(link.fallbacks == 1);
+
+    start_trial(link, encoder, 230400);
+    usart.framing_errors = usart.framing_errors + 1;
+    link.poll();
+    CHECK(link.get_state() == BaudState::Idle);
+    CHECK(usart.baud_rate == 115200);
+    CHECK(link.fallbacks == 2);
+    CHECK(link.switches == 1);
+}
+
+/// @brief BAUD_ERROR_LIMIT line errors in the window move link to safe rate
+static void error_window(BaudNegotiator& link){
+    link.poll();
+    usart.noise_errors = usart.noise_errors + BAUD_ERROR_LIMIT - 1;
+    link.poll();
+    CHECK(usart.baud_rate == 115200);
+    usart.noise_errors = usart.noise_errors + 1;
+    link.poll();
+    CHECK(usart.baud_rate == TEST_SAFE_BAUD);
+    CHECK(link.fallbacks == 3);
+}
+
+int main(){
+    RCC rcc;
+    NVIC nvic;
+    CHECK(rcc.config_pll(7, 4, 336, 16) == 0);
+    usart.clock_enable(rcc);
+    usart.disable_usart();
+    usart.set_frame_format(DataBits::Eight, Parity::None, StopBits::One);
+    CHECK(usart.set_baud_rate(TEST_SAFE_BAUD) == 0);
+    usart.enable_usart(true, false);
+    bus().attach_irq(usart.get_irq(), usart1_irq);
+    usart.async_enable(nvic);
+
+    static TimerWheel timers;
+    static BaudNegotiator link(usart, timers, TEST_SAFE_BAUD);
+    FrameEncoder encoder(usart);
+
+    trial_commit(link, encoder);
+    trial_fallback(link, encoder, timers);
+    error_window(link);
+
+    printf("baud: %u failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
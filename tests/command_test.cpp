@@ -0,0 +1,150 @@
+// Command dispatch on the host register backend, built with
+// -DHOST_BACKEND by `make host_test_command`. Latency comes from the
+// DWT model, handlers spend simulated cycles with Bus::advance().
+
+#include "../drivers/command.hpp"
+
+#include <cstdio>
+
+static uint32_t failures = 0;
+
+#define CHECK(condition) \
+    do{ \
+        if(!(condition)){ \
+            printf("%s:%d: %s\n", __FILE__, __LINE__, #condition); \
+            failures++; \
+        } \
+    }while(0)
+
+#define TEST_SLOW_CYCLES    500
+
+static host::Bus& bus(){
+    return host::Bus::instance();
+}
+
+static USART usart(1, 9, 'A', 10, 'A');
+
+static void usart1_irq(){
+    usart.irq_handler();
+}
+
+static uint32_t fast_calls = 0;
+static uint32_t slow_calls = 0;
+static uint16_t last_len = 0;
+
+static void fast(const Frame& frame, FrameEncoder& encoder){
+    (void)encoder;
+    fast_calls++;
+    last_len = frame.len;
+}
+
+static void slow(const Frame& frame, FrameEncoder& encoder){
+    (void)frame;
+    (void)encoder;
+    slow_calls++;
+    bus().advance(TEST_SLOW_CYCLES);
+}
+
+constexpr Command commands[] = {
+    { 0x00, &fast },
+    { 0x42, &slow },
+    { 0xF0, &fast },
+};
+
+#define COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+constexpr CommandIndex<COMMANDS> command_index(commands);
+static_assert(command_index.unique, "opcode is listed twice in commands");
+
+constexpr Command repeated[] = { { 0x10, &fast }, { 0x10, &slow } };
+static_assert(!CommandIndex<2>(repeated).unique, "repeated opcode must be caught");
+
+static bool dispatch(CommandDispatcher<COMMANDS>& dispatcher, FrameEncoder& encoder, uint8_t type, uint16_t len){
+    static const uint8_t payload[8] = {};
+    Frame frame{ 0, type, len, payload };
+    return dispatcher.dispatch(frame, encoder);
+}
+
+/// @brief opcode selects handler, unknown opcode is only counted
+static void dispatch_table(CommandDispatcher<COMMANDS>& dispatcher, FrameEncoder& encoder){
+    CHECK(dispatch(dispatcher, encoder, 0x00, 3));
+    CHECK(fast_calls == 1 && last_len == 3);
+    CHECK(dispatch(dispatcher, encoder, 0xF0, 8));
+    CHECK(fast_calls == 2 && last_len == 8);
+    CHECK(dispatch(dispatcher, encoder, 0x42, 0));
+    CHECK(dispatch(dispatcher, encoder, 0x42, 0));
+    CHECK(slow_calls == 2);
+
+    CHECK(!dispatch(dispatcher, encoder, 0x41, 0));
+    CHECK(!dispatch(dispatcher, encoder, 0xFF, 0));
+    CHECK(dispatcher.unknown == 2);
+    CHECK(fast_calls == 2 && slow_calls == 2);
+
+    const CommandStats& stats = dispatcher.get_stats(0x42);
+    CHECK(stats.calls == 2);
+    CHECK(stats.last >= TEST_SLOW_CYCLES && stats.last <= TEST_SLOW_CYCLES + 10);
+    CHECK(stats.max >= stats.last);
+    CHECK(stats.total >= 2 * TEST_SLOW_CYCLES);
+    CHECK(dispatcher.get_stats(0x41).calls == 0);
+}
+
+/// @brief stats frame: count(u8) unknown(u32), then 21 bytes per
+///         command in table order
+static void stats_dump(CommandDispatcher<COMMANDS>& dispatcher, FrameEncoder& encoder){
+    host::UsartModel* model = bus().model<host::UsartModel>(USART1_BASE);
+    model->transmitted.clear();
+    dispatcher.dump(encoder);
+    while(!usart.is_tx_idle());
+
+    FrameDecoder decoder;
+    Frame frame{};
+    bool decoded = false;
+    for(uint8_t byte : model->transmitted)
+        if(decoder.feed(byte, frame)) decoded = true;
+    CHECK(decoded);
+    CHECK(frame.type == COMMAND_STATS_FRAME_TYPE);
+    CHECK(frame.len == 5 + COMMANDS * 21);
+    if(!decoded || frame.len != 5 + COMMANDS * 21) return;
+
+    CHECK(frame.payload[0] == COMMANDS);
+    CHECK(read_le32(frame.payload + 1) == 2);
+    for(uint32_t i = 0; i < COMMANDS; i++){
+        const uint8_t* entry = frame.payload + 5 + i * 21;
+        const CommandStats& stats = dispatcher.get_stats(commands[i].opcode);
+        CHECK(entry[0] == commands[i].opcode);
+        CHECK(read_le32(entry + 1) == stats.calls);
+        CHECK(read_le32(entry + 5) == stats.last);
+        CHECK(read_le32(entry + 9) == stats.max);
+        CHECK(read_le32(entry + 13) == static_cast<uint32_t>(stats.total));
+        CHECK(read_le32(entry + 17) == static_cast<uint32_t>(stats.total >> 32));
+    }
+
+    dispatcher.reset_stats();
+    CHECK(dispatcher.unknown == 0);
+    CHECK(dispatcher.get_stats(0x42).calls == 0);
+}
+
+int main(){
+    RCC rcc;
+    NVIC nvic;
+    DWT dwt;
+    dwt.enable_cycle_counter();
+
+    usart.clock_enable(rcc);
+    usart.disable_usart();
+    usart.set_frame_format(DataBits::Eight, Parity::None, StopBits::One);
+    // short bit time, line speed does not matter here
+    usart.usart_registers->brr = 16;
+    usart.enable_usart(true, false);
+    bus().attach_irq(usart.get_irq(), usart1_irq);
+    usart.async_enable(nvic);
+
+    static CommandDispatcher<COMMANDS> dispatcher(commands, command_index);
+    FrameEncoder encoder(usart);
+
+    dispatch_table(dispatcher, encoder);
+    stats_dump(dispatcher, encoder);
+
+    printf("command: %u failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
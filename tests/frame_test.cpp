@@ -0,0 +1,131 @@
+// Framed protocol on the host register backend, built with -DHOST_BACKEND
+// by `make host_test_frame`. FrameEncoder sends through USART1 in
+// interrupt mode, bytes shifted out by the USART model are fed back to
+// FrameDecoder.
+
+#include "../drivers/frame.hpp"
+
+#include <cstdio>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+static uint32_t failures = 0;
+
+#define CHECK(condition) \
+    do{ \
+        if(!(condition)){ \
+            printf("%s:%d: %s\n", __FILE__, __LINE__, #condition); \
+            failures++; \
+        } \
+    }while(0)
+
+static host::Bus& bus(){
+    return host::Bus::instance();
+}
+
+static USART usart(1, 9, 'A', 10, 'A');
+
+static void usart1_irq(){
+    usart.irq_handler();
+}
+
+/// @brief bytes on the line for one frame, ends with delimiter
+static std::vector<uint8_t> transmit(FrameEncoder& encoder, uint8_t type, const uint8_t* payload, uint16_t len){
+    host::UsartModel* model = bus().model<host::UsartModel>(USART1_BASE);
+    model->transmitted.clear();
+    CHECK(encoder.send(type, payload, len) == 0);
+    while(!usart.is_tx_idle());
+    return model->transmitted;
+}
+
+/// @return count of frames decoded from bytes, last one in frame
+static uint32_t decode(FrameDecoder& decoder, const std::vector<uint8_t>& bytes, Frame& frame){
+    uint32_t frames = 0;
+    for(uint8_t byte : bytes)
+        if(decoder.feed(byte, frame)) frames++;
+    return frames;
+}
+
+/// @brief CRC-16/CCITT-FALSE check value
+static void crc16_check(){
+    const uint8_t digits[] = { '1', '2', '3', '4', '5', '6', '7', '8', '9' };
+    CHECK(crc16(digits, sizeof(digits)) == 0x29B1);
+}
+
+/// @brief zeros and a run longer than one 254 byte COBS block survive
+static void round_trip(FrameEncoder& encoder){
+    uint8_t payload[400];
+    for(uint32_t i = 0; i < sizeof(payload); i++) payload[i] = i % 251 + 1;
+    payload[0] = 0;
+    payload[10] = 0;
+    payload[11] = 0;
+    payload[sizeof(payload) - 1] = 0;
+
+    std::vector<uint8_t> line = transmit(encoder, 0x21, payload, sizeof(payload));
+    CHECK(line.back() == FRAME_DELIMITER);
+    CHECK(std::count(line.begin(), line.end(), FRAME_DELIMITER) == 1);
+
+    FrameDecoder decoder;
+    Frame frame{};
+    CHECK(decode(decoder, line, frame) == 1);
+    CHECK(frame.type == 0x21);
+    CHECK(frame.len == sizeof(payload));
+    CHECK(memcmp(frame.payload, payload, sizeof(payload)) == 0);
+    CHECK(decoder.crc_errors == 0 && decoder.malformed == 0);
+
+    // empty payload
+    line = transmit(encoder, 0x22, nullptr, 0);
+    CHECK(decode(decoder, line, frame) == 1);
+    CHECK(frame.type == 0x22 && frame.len == 0);
+    CHECK(decoder.lost == 0);
+}
+
+/// @brief flipped payload bit fails crc, cut frame is malformed,
+///         skipped frame is counted by sequence number
+static void corrupt_frames(FrameEncoder& encoder){
+    const uint8_t payload[] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    FrameDecoder decoder;
+    Frame frame{};
+
+    std::vector<uint8_t> line = transmit(encoder, 0x30, payload, sizeof(payload));
+    CHECK(decode(decoder, line, frame) == 1);
+
+    line = transmit(encoder, 0x30, payload, sizeof(payload));
+    // data byte of the only COBS block, stays non zero
+    line[8] ^= 0x10;
+    CHECK(decode(decoder, line, frame) == 0);
+    CHECK(decoder.crc_errors == 1);
+
+    line = transmit(encoder, 0x30, payload, sizeof(payload));
+    line.erase(line.begin() + 4, line.begin() + 6);
+    CHECK(decode(decoder, line, frame) == 0);
+    CHECK(decoder.malformed == 1);
+
+    // two frames were rejected, next good one shows them as lost
+    line = transmit(encoder, 0x30, payload, sizeof(payload));
+    CHECK(decode(decoder, line, frame) == 1);
+    CHECK(decoder.lost == 2);
+    CHECK(memcmp(frame.payload, payload, sizeof(payload)) == 0);
+}
+
+int main(){
+    RCC rcc;
+    NVIC nvic;
+    usart.clock_enable(rcc);
+    usart.disable_usart();
+    usart.set_frame_format(DataBits::Eight, Parity::None, StopBits::One);
+    // short bit time, line speed does not matter here
+    usart.usart_registers->brr = 16;
+    usart.enable_usart(true, false);
+    bus().attach_irq(usart.get_irq(), usart1_irq);
+    usart.async_enable(nvic);
+
+    FrameEncoder encoder(usart);
+    crc16_check();
+    round_trip(encoder);
+    corrupt_frames(encoder);
+
+    printf("frame: %u failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,293 @@
+// Behavioral checks of drivers on the host register backend, built with
+// -DHOST_BACKEND by `make host_test_backend`. Every peripheral model gets
+// at least one check, access counts are checked where a driver call
+// promises a fixed number of bus transactions.
+
+#include "../drivers/driver.hpp"
+
+#include <cstdio>
+
+static uint32_t failures = 0;
+
+#define CHECK(condition) \
+    do{ \
+        if(!(condition)){ \
+            printf("%s:%d: %s\n", __FILE__, __LINE__, #condition); \
+            failures++; \
+        } \
+    }while(0)
+
+static host::Bus& bus(){
+    return host::Bus::instance();
+}
+
+/// @brief PLL is locked only after pll_lock_cycles
+static void rcc_pll_lock(RCC& rcc){
+    host::RccModel* model = bus().model<host::RccModel>(RCC_BASE);
+
+    rcc.enable_hsi();
+    rcc.diasble_pll();
+    rcc.enable_pll();
+    CHECK(!rcc.is_locked());
+    bus().advance(model->pll_lock_cycles);
+    CHECK(rcc.is_locked());
+
+    // VCO 2 MHz * 300 = 600 MHz is above 432 MHz
+    CHECK(rcc.config_pll(7, 8, 300, 8) == 1);
+    CHECK(rcc.config_pll(7, 4, 336, 16) == 0);
+    CHECK(RCC::get_sysclk() == 84000000);
+    CHECK(RCC::get_pclk2() == 84000000);
+    CHECK(rcc.is_pll_source());
+}
+
+/// @brief one byte takes 10 bit times of BRR cycles on the line
+static void usart_line_timing(RCC& rcc){
+    USART_Reg* usart = PERIPHERAL(USART_Reg, USART1_BASE);
+    rcc.registers->apb2enr |= 1 << 4;
+    usart->brr = 729;
+    // UE, TE
+    usart->cr1 = (1 << 13) | (1 << 3);
+
+    host::AccessCounter counter;
+    usart->dr = 0x55;
+    // TC
+    while(!(usart->sr & (1 << 6)));
+    CHECK(counter.cycles() >= 10 * 729);
+    CHECK(counter.cycles() <= 10 * 729 + 4);
+    CHECK(bus().model<host::UsartModel>(USART1_BASE)->transmitted.back() == 0x55);
+    usart->cr1 = 0;
+}
+
+/// @brief divider from APB2 clock, frame format in one access per register
+static void usart_driver_setup(RCC& rcc){
+    USART usart(1, 9, 'A', 10, 'A');
+    usart.clock_enable(rcc);
+    usart.disable_usart();
+
+    host::AccessCounter counter;
+    usart.set_frame_format(DataBits::Eight, Parity::Even, StopBits::Two);
+    CHECK(counter.reads() == 2);
+    CHECK(counter.writes() == 2);
+
+    usart.set_frame_format(DataBits::Eight, Parity::None, StopBits::One);
+    CHECK(usart.set_baud_rate(115200) == 0);
+    // 84 MHz / 115200 = 729.2 cycles per bit
+    CHECK(usart.usart_registers->brr.raw() == 729);
+}
+
+/// @brief USART number which does not exist has no registers, getters
+///         and setup calls report it
+static void usart_invalid_number(RCC& rcc){
+    USART usart(3, 9, 'A', 10, 'A');
+    CHECK(!usart.is_valid());
+    CHECK(usart.usart_registers == nullptr);
+    CHECK(usart.get_num() == 0);
+    CHECK(usart.get_irq() == 0xFF);
+    CHECK(usart.get_clock() == 0);
+    CHECK(usart.clock_enable(rcc) == 1);
+    CHECK(usart.set_baud_rate(115200) == 1);
+}
+
+/// @brief CNT counts timer clock / (PSC + 1), PSC is loaded by update
+static void tim_cnt_psc(RCC& rcc){
+    TIM_Reg* tim = PERIPHERAL(TIM_Reg, TIM_BASE);
+    // TIM2
+    rcc.registers->apb1enr |= 1;
+    tim->psc = 83;
+    tim->arr = UINT32_T_MAX;
+    tim->egr = 1;
+    tim->cr1 = 1;
+    bus().advance(84 * 1000);
+    uint32_t count = tim->cnt;
+    CHECK(count >= 999 && count <= 1001);
+
+    // new PSC waits for update event
+    tim->psc = 0;
+    bus().advance(84 * 10);
+    count = tim->cnt;
+    CHECK(count >= 1009 && count <= 1011);
+    tim->cr1 = 0;
+}
+
+/// @brief delay and pulse must fit 16 bit ARR of TIM3
+static void tim_one_pulse_range(RCC& rcc){
+    TIM tim(3);
+    CHECK(tim.clock_enable(rcc) == 0);
+    CHECK(tim.set_one_pulse(1, 0x10000, 1) == 1);
+    CHECK(tim.set_one_pulse(1, 0xFFFF, 2) == 1);
+    CHECK(tim.set_one_pulse(1, 0xFFFF, 1) == 0);
+    CHECK(tim.registers->arr.raw() == 0xFFFF);
+}
+
+/// @brief COUNTFLAG is set at 1 -> 0 and cleared by CSR read
+static void systick_countflag(){
+    Systick systick;
+    systick.registers->rvr = 99;
+    systick.registers->cvr = 0;
+    // core clock, no interrupt
+    systick.registers->csr = 0b101;
+    CHECK(!systick.is_end());
+    bus().advance(150);
+    CHECK(systick.is_end());
+    CHECK(!systick.is_end());
+    systick.registers->csr = 0;
+}
+
+static uint32_t usart_tc_calls = 0;
+
+static void usart_tc_handler(){
+    usart_tc_calls++;
+    // TCIE
+    PERIPHERAL(USART_Reg, USART1_BASE)->cr1 &= ~(1 << 6);
+}
+
+/// @brief pending interrupt reaches handler only when enabled in ISER,
+///         ICER reads back as ISER
+static void nvic_enable(){
+    NVIC_Reg* nvic = PERIPHERAL(NVIC_Reg, NVIC_BASE);
+    USART_Reg* usart = PERIPHERAL(USART_Reg, USART1_BASE);
+    bus().attach_irq(USART1_IRQ, usart_tc_handler);
+
+    // UE, TE, TCIE, TC is set after last byte
+    usart->cr1 = (1 << 13) | (1 << 3) | (1 << 6);
+    bus().advance(100);
+    CHECK(usart_tc_calls == 0);
+
+    nvic->iser[USART1_IRQ / 32] = 1 << (USART1_IRQ % 32);
+    CHECK(nvic->icer[USART1_IRQ / 32] & (1 << (USART1_IRQ % 32)));
+    CHECK(usart_tc_calls == 1);
+
+    nvic->icer[USART1_IRQ / 32] = 1 << (USART1_IRQ % 32);
+    CHECK(!(nvic->iser[USART1_IRQ / 32] & (1 << (USART1_IRQ % 32))));
+    usart->cr1 = 0;
+    bus().attach_irq(USART1_IRQ, nullptr);
+}
+
+/// @brief CYCCNT follows core cycles while CYCCNTENA is set
+static void dwt_cyccnt(){
+    DWT_Reg* dwt = PERIPHERAL(DWT_Reg, DWT_BASE);
+    dwt->ctrl = 1;
+    dwt->cyccnt = 0;
+    bus().advance(1000);
+    uint32_t count = dwt->cyccnt;
+    CHECK(count >= 1000 && count <= 1002);
+
+    // stopped counter keeps its value
+    dwt->ctrl = 0;
+    count = dwt->cyccnt;
+    bus().advance(1000);
+    CHECK(dwt->cyccnt == count);
+}
+
+/// @brief sector erase and word program keep BSY for erase_cycles and
+///         program_cycles, EOP is set at the end
+static void flash_erase_program(){
+    host::FlashModel* model = bus().model<host::FlashModel>(FLASH_BASE);
+    Flash_Reg* flash = PERIPHERAL(Flash_Reg, FLASH_BASE);
+    reg32_t* word = PERIPHERAL(reg32_t, USER_FLASH_BASE);
+    const uint32_t bsy = 1 << 16;
+    const uint32_t eop = 1;
+    // PSIZE x32, EOPIE
+    const uint32_t cr = (0b10 << 8) | (1 << 24);
+
+    // CR is locked until KEYR sequence
+    flash->cr = cr;
+    CHECK(flash->cr & (1u << 31));
+    flash->keyr = 0x45670123;
+    flash->keyr = 0xCDEF89AB;
+    CHECK(!(flash->cr & (1u << 31)));
+
+    // SER, SNB, STRT
+    flash->cr = cr | (USER_FLASH_SECTOR << 3) | (1 << 1);
+    flash->cr = cr | (USER_FLASH_SECTOR << 3) | (1 << 1) | (1 << 16);
+    CHECK(flash->sr & bsy);
+    bus().advance(model->erase_cycles - 100);
+    CHECK(flash->sr & bsy);
+    bus().advance(100);
+    CHECK(!(flash->sr & bsy));
+    CHECK(flash->sr & eop);
+    flash->sr = eop;
+    CHECK(!(flash->sr & eop));
+
+    // PG, bits can be only cleared
+    flash->cr = cr | 1;
+    *word = 0x12345678;
+    CHECK(flash->sr & bsy);
+    bus().advance(model->program_cycles);
+    CHECK(!(flash->sr & bsy));
+    CHECK(*word == 0x12345678);
+    *word = 0xFFFF0000;
+    bus().advance(model->program_cycles);
+    CHECK(*word == 0x12340000);
+
+    flash->sr = eop;
+    flash->cr = 1u << 31;
+}
+
+/// @brief DR is CRC-32/MPEG-2 of words written since reset by CR
+static void crc_word(){
+    CRC_Reg* crc = PERIPHERAL(CRC_Reg, CRC_BASE);
+    crc->cr = 1;
+    CHECK(crc->dr == 0xFFFFFFFF);
+    crc->dr = 0x12345678;
+    CHECK(crc->dr == 0xDF8A8A2B);
+    crc->cr = 1;
+    CHECK(crc->dr == 0xFFFFFFFF);
+}
+
+static uint32_t exti0_calls = 0;
+
+static void exti0_handler(){
+    exti0_calls++;
+    PERIPHERAL(EXTI_Reg, EXTI_BASE)->pr = 1;
+}
+
+/// @brief SWIER pends only unmasked lines, PR is write one to clear
+static void exti_swier(){
+    EXTI_Reg* exti = PERIPHERAL(EXTI_Reg, EXTI_BASE);
+    NVIC_Reg* nvic = PERIPHERAL(NVIC_Reg, NVIC_BASE);
+    bus().attach_irq(EXTI0_IRQ, exti0_handler);
+    nvic->iser[0] = 1 << EXTI0_IRQ;
+
+    exti->swier = 1;
+    CHECK(!(exti->pr & 1));
+    CHECK(exti0_calls == 0);
+    exti->swier = 0;
+
+    exti->imr = 1;
+    exti->swier = 1;
+    CHECK(exti0_calls == 1);
+    CHECK(!(exti->pr & 1));
+
+    exti->imr = 0;
+    nvic->icer[0] = 1 << EXTI0_IRQ;
+    bus().attach_irq(EXTI0_IRQ, nullptr);
+}
+
+/// @brief read-modify-write of one register is one read and one write
+static void access_counts(RCC& rcc){
+    host::AccessCounter counter;
+    rcc.enable_pll();
+    CHECK(counter.reads() == 1);
+    CHECK(counter.writes() == 1);
+}
+
+int main(){
+    RCC rcc;
+    rcc_pll_lock(rcc);
+    usart_line_timing(rcc);
+    usart_driver_setup(rcc);
+    usart_invalid_number(rcc);
+    tim_cnt_psc(rcc);
+    tim_one_pulse_range(rcc);
+    systick_countflag();
+    nvic_enable();
+    dwt_cyccnt();
+    flash_erase_program();
+    crc_word();
+    exti_swier();
+    access_counts(rcc);
+
+    printf("host_backend: %u failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
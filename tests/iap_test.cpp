@@ -0,0 +1,156 @@
+// IAP engine on the host register backend, built with -DHOST_BACKEND by
+// `make host_test_iap`. Frames go to Iap::on_frame, erase ends in
+// FLASH_IRQ raised by the flash model, image is read back from the
+// user flash model.
+
+#include "../drivers/iap.hpp"
+
+#include <cstdio>
+#include <cstring>
+
+static uint32_t failures = 0;
+
+#define CHECK(condition) \
+    do{ \
+        if(!(condition)){ \
+            printf("%s:%d: %s\n", __FILE__, __LINE__, #condition); \
+            failures++; \
+        } \
+    }while(0)
+
+#define IAP_TEST_FRAME_TYPE 0x10
+
+static host::Bus& bus(){
+    return host::Bus::instance();
+}
+
+static Iap* loader = nullptr;
+
+static void flash_irq(){
+    loader->irq_handler();
+}
+
+static void send(Iap& iap, FrameEncoder& encoder, const uint8_t* payload, uint16_t len){
+    Frame frame{ 0, IAP_TEST_FRAME_TYPE, len, payload };
+    iap.on_frame(frame, encoder);
+}
+
+static void send_begin(Iap& iap, FrameEncoder& encoder, uint32_t size, uint32_t crc){
+    uint8_t payload[9] = { IapBegin };
+    write_le32(payload + 1, size);
+    write_le32(payload + 5, crc);
+    send(iap, encoder, payload, sizeof(payload));
+}
+
+static void wait_erase(Iap& iap, FrameEncoder& encoder){
+    bus().advance(bus().model<host::FlashModel>(FLASH_BASE)->erase_cycles + 100);
+    iap.poll(encoder);
+}
+
+/// @brief second IapBegin restarts upload without KEYR write to
+///         unlocked flash
+static void begin_twice(Iap& iap, FrameEncoder& encoder, Flash& flash){
+    host::FlashModel* model = bus().model<host::FlashModel>(FLASH_BASE);
+
+    send_begin(iap, encoder, 8, 0);
+    CHECK(iap.state == IapState::Erasing);
+    wait_erase(iap, encoder);
+    CHECK(iap.state == IapState::Receiving);
+    CHECK(read_field(flash.registers, flash_cr::PG) == 1);
+
+    uint8_t data[9] = { IapData };
+    send(iap, encoder, data, sizeof(data));
+
+    send_begin(iap, encoder, 8, 0);
+    CHECK(iap.state == IapState::Erasing);
+    CHECK(!model->key_error);
+    CHECK(read_field(flash.registers, flash_cr::PG) == 0);
+    wait_erase(iap, encoder);
+    CHECK(iap.state == IapState::Receiving);
+    CHECK(iap.status == IapOk);
+}
+
+/// @brief CRC-32/MPEG-2 of image as little endian words, last word
+///         padded with 0xFF
+static uint32_t image_crc(const uint8_t* image, uint32_t size){
+    uint32_t crc = 0xFFFFFFFF;
+    for(uint32_t i = 0; i < size; i += 4){
+        uint8_t word[4] = { 0xFF, 0xFF, 0xFF, 0xFF };
+        for(uint32_t j = 0; j < 4 && i + j < size; j++) word[j] = image[i + j];
+        crc ^= read_le32(word);
+        for(uint8_t bit = 0; bit < 32; bit++)
+            crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+    }
+    return crc;
+}
+
+/// @brief streams image in IapData frames, poll() programs between them
+static void stream(Iap& iap, FrameEncoder& encoder, const uint8_t* image, uint32_t size){
+    uint8_t payload[5 + 200] = { IapData };
+    for(uint32_t offset = 0; offset < size; offset += 200){
+        uint32_t len = size - offset < 200 ? size - offset : 200;
+        write_le32(payload + 1, offset);
+        memcpy(payload + 5, image + offset, len);
+        send(iap, encoder, payload, 5 + len);
+        iap.poll(encoder);
+    }
+}
+
+/// @brief erase, double buffered programming and crc check of image
+///         which spans three blocks and ends with a partial word
+static void upload(Iap& iap, FrameEncoder& encoder){
+    static uint8_t image[2 * IAP_BLOCK_SIZE + 1003];
+    for(uint32_t i = 0; i < sizeof(image); i++) image[i] = i * 7 + (i >> 8);
+    const uint8_t end[1] = { IapEnd };
+
+    send_begin(iap, encoder, sizeof(image), image_crc(image, sizeof(image)));
+    wait_erase(iap, encoder);
+    CHECK(iap.state == IapState::Receiving);
+
+    stream(iap, encoder, image, sizeof(image));
+    CHECK(iap.status == IapOk);
+    send(iap, encoder, end, sizeof(end));
+    CHECK(iap.state == IapState::Done);
+    CHECK(iap.status == IapOk);
+    UserFlash_Reg* memory = PERIPHERAL(UserFlash_Reg, USER_FLASH_BASE);
+    uint32_t mismatches = 0;
+    for(uint32_t i = 0; i < sizeof(image); i++)
+        if(((memory->words[i / 4].raw() >> (i % 4 * 8)) & 0xFF) != image[i]) mismatches++;
+    CHECK(mismatches == 0);
+    // padding of last word
+    CHECK(memory->words[sizeof(image) / 4].raw() >> 24 == 0xFF);
+    CHECK(read_field(PERIPHERAL(Flash_Reg, FLASH_BASE), flash_cr::LOCK) == 1);
+    CHECK(Pools::get(POOL_CLASSES - 1).get_used() == 0);
+
+    // same image with wrong crc fails after programming
+    send_begin(iap, encoder, sizeof(image), image_crc(image, sizeof(image)) ^ 1);
+    wait_erase(iap, encoder);
+    stream(iap, encoder, image, sizeof(image));
+    send(iap, encoder, end, sizeof(end));
+    CHECK(iap.state == IapState::Failed);
+    CHECK(iap.status == IapCrcMismatch);
+    CHECK(Pools::get(POOL_CLASSES - 1).get_used() == 0);
+}
+
+int main(){
+    CHECK(Pools::init() == 0);
+
+    RCC rcc;
+    NVIC nvic;
+    Flash flash;
+    CRC crc;
+    USART usart(1, 9, 'A', 10, 'A');
+    FrameEncoder encoder(usart);
+
+    static Iap iap(flash, crc, IAP_TEST_FRAME_TYPE);
+    loader = &iap;
+    crc.clock_enable(rcc);
+    iap.interrupt_enable(nvic);
+    bus().attach_irq(FLASH_IRQ, flash_irq);
+
+    begin_twice(iap, encoder, flash);
+    upload(iap, encoder);
+
+    printf("iap: %u failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,99 @@
+// Block pools on the host, built with -DHOST_BACKEND by
+// `make host_test_memory`. The pool region is host_pool_region.
+
+#include "../drivers/memory.hpp"
+
+#include <cstdio>
+
+static uint32_t failures = 0;
+
+#define CHECK(condition) \
+    do{ \
+        if(!(condition)){ \
+            printf("%s:%d: %s\n", __FILE__, __LINE__, #condition); \
+            failures++; \
+        } \
+    }while(0)
+
+/// @brief requests go to the smallest class which fits, blocks are
+///         8 byte aligned and inside the pool region
+static void size_classes(){
+    for(uint8_t i = 0; i < POOL_CLASSES; i++){
+        uint32_t size = pool_layout[i].block_size;
+        void* block = Pools::alloc(size);
+        CHECK(block != nullptr);
+        CHECK(Pools::get(i).owns(block));
+        CHECK(reinterpret_cast<uintptr_t>(block) % 8 == 0);
+        CHECK(Pools::get(i).get_used() == 1);
+        Pools::free(block);
+        CHECK(Pools::get(i).get_used() == 0);
+    }
+    CHECK(Pools::alloc(pool_layout[POOL_CLASSES - 1].block_size + 1) == nullptr);
+    CHECK(Pools::failures == 1);
+}
+
+/// @brief empty class spills into the next one, all classes empty
+///         fails, freed blocks are reused
+static void exhaustion(){
+    const uint8_t last = POOL_CLASSES - 1;
+    const uint16_t count = pool_layout[last].count;
+    void* blocks[pool_layout[last].count];
+
+    for(uint16_t i = 0; i < count; i++){
+        blocks[i] = Pools::alloc(pool_layout[last].block_size);
+        CHECK(blocks[i] != nullptr);
+    }
+    CHECK(Pools::alloc(pool_layout[last].block_size) == nullptr);
+    CHECK(Pools::get(last).get_failures() == 1);
+    CHECK(Pools::get(last).get_high_water() == count);
+
+    // freed block comes back first
+    Pools::free(blocks[1]);
+    void* again = Pools::alloc(pool_layout[last].block_size);
+    CHECK(again == blocks[1]);
+
+    for(uint16_t i = 0; i < count; i++) Pools::free(blocks[i]);
+    CHECK(Pools::get(last).get_used() == 0);
+    CHECK(Pools::get(last).get_high_water() == count);
+
+    // smallest class full, small request takes next class
+    void* small[pool_layout[0].count];
+    for(uint16_t i = 0; i < pool_layout[0].count; i++) small[i] = Pools::alloc(1);
+    void* spilled = Pools::alloc(1);
+    CHECK(spilled != nullptr && Pools::get(1).owns(spilled));
+    Pools::free(spilled);
+    for(void* block : small) Pools::free(block);
+    CHECK(Pools::get(0).get_used() == 0);
+    Pools::free(nullptr);
+}
+
+/// @brief PoolPtr returns block when destroyed, move keeps one owner
+static void pool_ptr(){
+    {
+        PoolPtr first(100);
+        CHECK(first && first.size() == 100);
+        CHECK(Pools::get(1).get_used() == 1);
+
+        PoolPtr second(std::move(first));
+        CHECK(!first && second);
+        CHECK(Pools::get(1).get_used() == 1);
+
+        uint8_t* raw = second.release();
+        PoolPtr third = PoolPtr::adopt(raw, 100);
+        CHECK(third.get() == raw);
+    }
+    CHECK(Pools::get(1).get_used() == 0);
+
+    PoolPtr none(pool_layout[POOL_CLASSES - 1].block_size + 1);
+    CHECK(!none && none.size() == 0);
+}
+
+int main(){
+    CHECK(Pools::init() == 0);
+    size_classes();
+    exhaustion();
+    pool_ptr();
+
+    printf("memory: %u failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,87 @@
+// Two thread producer / consumer check of SpscQueue, built with
+// ThreadSanitizer by `make host_test_spsc`. Producer queues a counting
+// sequence with push, bulk push and write_span, consumer takes it with
+// pop, bulk pop and read_span, every value must arrive once and in order.
+
+#include "../drivers/spsc_queue.hpp"
+
+#include <cstdio>
+#include <thread>
+
+#define TEST_VALUES     200000
+#define TEST_QUEUE_SIZE 64
+#define TEST_CHUNK      7
+
+static SpscQueue<uint32_t, TEST_QUEUE_SIZE> queue;
+
+static void produce(){
+    uint32_t next = 0;
+    uint32_t round = 0;
+    while(next < TEST_VALUES){
+        // one core CI runners need the other thread to get the cpu
+        if(queue.is_full()) std::this_thread::yield();
+        switch(round++ % 3){
+        case 0:
+            if(queue.push(next)) next++;
+            break;
+        case 1: {
+            uint32_t values[TEST_CHUNK];
+            uint32_t count = TEST_VALUES - next < TEST_CHUNK ? TEST_VALUES - next : TEST_CHUNK;
+            for(uint32_t i = 0; i < count; i++) values[i] = next + i;
+            next += queue.push(values, count);
+            break;
+        }
+        default: {
+            QueueSpan<uint32_t> span = queue.write_span();
+            uint32_t count = TEST_VALUES - next < span.size ? TEST_VALUES - next : span.size;
+            for(uint32_t i = 0; i < count; i++) span.data[i] = next + i;
+            queue.commit(count);
+            next += count;
+        }
+        }
+    }
+}
+
+/// @return count of values which arrived out of order
+static uint32_t consume(){
+    uint32_t expected = 0;
+    uint32_t errors = 0;
+    uint32_t round = 0;
+    while(expected < TEST_VALUES){
+        if(queue.is_empty()) std::this_thread::yield();
+        switch(round++ % 3){
+        case 0: {
+            uint32_t value;
+            if(queue.pop(value) && value != expected++) errors++;
+            break;
+        }
+        case 1: {
+            uint32_t values[TEST_CHUNK];
+            uint32_t count = queue.pop(values, TEST_CHUNK);
+            for(uint32_t i = 0; i < count; i++)
+                if(values[i] != expected++) errors++;
+            break;
+        }
+        default: {
+            QueueSpan<const uint32_t> span = queue.read_span();
+            for(uint32_t i = 0; i < span.size; i++)
+                if(span.data[i] != expected++) errors++;
+            queue.release(span.size);
+        }
+        }
+        if(queue.size() > TEST_QUEUE_SIZE) errors++;
+    }
+    return errors;
+}
+
+int main(){
+    uint32_t errors = 0;
+    std::thread producer(produce);
+    std::thread consumer([&errors]{ errors = consume(); });
+    producer.join();
+    consumer.join();
+
+    if(!queue.is_empty()) errors++;
+    printf("spsc_queue: %u values, %u errors\n", TEST_VALUES, errors);
+    return errors == 0 ? 0 : 1;
+}
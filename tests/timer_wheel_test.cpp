@@ -0,0 +1,126 @@
+// TimerWheel on the host, built with -DHOST_BACKEND by
+// `make host_test_timer_wheel`. Ticks are passed to advance() directly.
+
+#include "../drivers/timer_wheel.hpp"
+
+#include <cstdio>
+
+static uint32_t failures = 0;
+
+#define CHECK(condition) \
+    do{ \
+        if(!(condition)){ \
+            printf("%s:%d: %s\n", __FILE__, __LINE__, #condition); \
+            failures++; \
+        } \
+    }while(0)
+
+struct Fired{
+    uint32_t calls = 0;
+    uint32_t tick = 0;
+};
+
+static TimerWheel* wheel = nullptr;
+
+static void record(SoftTimer& timer, void* arg){
+    (void)timer;
+    Fired* fired = static_cast<Fired*>(arg);
+    fired->calls++;
+    fired->tick = wheel->get_now();
+}
+
+/// @brief timers more than one wheel turn away share slot with near
+///         ones and fire only on their own tick
+static void slot_wrap(TimerWheel& timers){
+    Fired near, far, farther;
+    SoftTimer near_timer(record, &near);
+    SoftTimer far_timer(record, &far);
+    SoftTimer farther_timer(record, &farther);
+    uint32_t start = timers.get_now();
+
+    timers.start(near_timer, 5);
+    timers.start(far_timer, 5 + TIMER_WHEEL_SLOTS);
+    timers.start(farther_timer, 5 + 3 * TIMER_WHEEL_SLOTS);
+    CHECK(timers.size() == 3);
+    CHECK(timers.ticks_to_next(1000) == 5);
+
+    timers.advance(start + 5);
+    CHECK(near.calls == 1 && near.tick == start + 5);
+    CHECK(far.calls == 0 && farther.calls == 0);
+    // far timer is one full turn away
+    CHECK(timers.ticks_to_next(1000) == TIMER_WHEEL_SLOTS);
+
+    timers.advance(start + 5 + TIMER_WHEEL_SLOTS);
+    CHECK(far.calls == 1 && far.tick == start + 5 + TIMER_WHEEL_SLOTS);
+    CHECK(farther.calls == 0);
+
+    timers.advance(start + 5 + 3 * TIMER_WHEEL_SLOTS);
+    CHECK(farther.calls == 1);
+    CHECK(near.calls == 1 && far.calls == 1);
+    CHECK(timers.size() == 0);
+}
+
+/// @brief periodic timer keeps its phase, restart moves expiry
+static void periodic_restart(TimerWheel& timers){
+    Fired fired;
+    SoftTimer timer(record, &fired);
+    uint32_t start = timers.get_now();
+
+    timers.start(timer, 3, 10);
+    timers.advance(start + 33);
+    CHECK(fired.calls == 4);
+    CHECK(fired.tick == start + 33);
+    CHECK(timer.get_expiry() == start + 43);
+
+    timers.start(timer, 2);
+    CHECK(timers.size() == 1);
+    timers.advance(start + 45);
+    CHECK(fired.calls == 5 && fired.tick == start + 35);
+    CHECK(!timer.is_active());
+}
+
+static SoftTimer* victim = nullptr;
+
+static void cancel_other(SoftTimer& timer, void* arg){
+    (void)timer;
+    static_cast<Fired*>(arg)->calls++;
+    wheel->cancel(*victim);
+}
+
+/// @brief cancelled timer never fires, also when it is cancelled by
+///         callback of a timer in the same slot
+static void cancel(TimerWheel& timers){
+    Fired first, second, third;
+    SoftTimer first_timer(cancel_other, &first);
+    SoftTimer second_timer(record, &second);
+    SoftTimer third_timer(record, &third);
+    uint32_t start = timers.get_now();
+
+    timers.start(third_timer, 4);
+    timers.cancel(third_timer);
+    CHECK(!third_timer.is_active());
+    timers.cancel(third_timer);
+    CHECK(timers.size() == 0);
+
+    // slot list is in reverse start order, first_timer runs first
+    victim = &second_timer;
+    timers.start(second_timer, 7);
+    timers.start(first_timer, 7);
+    timers.advance(start + 10);
+    CHECK(first.calls == 1);
+    CHECK(second.calls == 0);
+    CHECK(third.calls == 0);
+    CHECK(timers.size() == 0);
+}
+
+int main(){
+    static TimerWheel timers;
+    wheel = &timers;
+
+    slot_wrap(timers);
+    periodic_restart(timers);
+    cancel(timers);
+
+    printf("timer_wheel: %u failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}